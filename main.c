@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // Udostępnia rozszerzenia GNU/Linux (np. copy_file_range)
 #include <stdio.h>      // Biblioteka do obsługi wejścia/wyjścia (np. printf, fprintf)
 #include <stdlib.h>     // Biblioteka do funkcji ogólnych (np. malloc, free, exit, atoi, atol)
 #include <string.h>     // Biblioteka do operacji na łańcuchach znaków (np. strcmp, strcpy, memcpy)
@@ -5,219 +6,5892 @@
 #include <sys/stat.h>   // Struktury i funkcje do obsługi informacji o plikach (np. stat, lstat)
 #include <unistd.h>     // Funkcje systemowe POSIX (np. fork, sleep, unlink, rmdir, close)
 #include <fcntl.h>      // Definicje do obsługi plików (np. open, O_RDONLY, O_CREAT)
-#include <dirent.h>     // Obsługa katalogów (np. opendir, readdir, closedir)
+#include <dirent.h>     // Obsługa katalogów (struct dirent64, getdents64, typy DT_*)
 #include <signal.h>     // Obsługa sygnałów (np. signal, SIGUSR1)
 #include <sys/mman.h>   // Obsługa mapowania plików do pamięci (np. mmap, munmap)
 #include <syslog.h>     // Obsługa logowania do sysloga (systemowy dziennik zdarzeń)
+#include <errno.h>      // Kody błędów zwracane przez funkcje systemowe (np. EINTR, EAGAIN)
+#include <poll.h>       // Oczekiwanie na zdarzenia na deskryptorach (poll)
+#include <sys/inotify.h> // Powiadomienia jądra o zmianach w katalogach (inotify)
+#include <sys/ioctl.h>  // Wywołanie ioctl (np. FICLONE - klonowanie pliku w systemie plików)
+#include <sys/sendfile.h> // Kopiowanie danych między deskryptorami w jądrze (sendfile)
+#include <linux/fs.h>   // Stałe systemów plików Linuksa (np. FICLONE)
+#include <pthread.h>    // Wątki POSIX (pula wątków roboczych)
+#include <stdatomic.h>  // Operacje atomowe na licznikach współdzielonych przez wątki
+#include <stdint.h>     // Typy całkowite o stałym rozmiarze (np. uint64_t) - format pliku indeksu
+#include <sys/syscall.h> // Numery wywołań systemowych (io_uring nie ma opakowań w glibc)
+#include <sys/sysmacros.h> // makedev (konwersja wyniku statx)
+#include <sys/uio.h>    // struct iovec (rejestracja buforów io_uring)
+#include <linux/io_uring.h> // Struktury i stałe interfejsu io_uring
+#include <linux/perf_event.h> // Liczniki wydajności jądra (zliczanie wywołań systemowych w trybie --bench)
+#include <time.h>       // Pomiar czasu (clock_gettime) i znaczniki czasu plików w trybie --bench
+#include <stdarg.h>     // Funkcje o zmiennej liczbie argumentów (log_file)
+#include <sys/socket.h> // Gniazda (serwer metryk)
+#include <sys/un.h>     // Gniazda domeny uniksowej (struct sockaddr_un)
+#include <sys/signalfd.h> // Odbiór sygnałów przez deskryptor (signalfd) w pętli demona
+#include <sys/xattr.h>  // Rozszerzone atrybuty plików (flistxattr, fgetxattr, fsetxattr)
+#include <stddef.h>     // offsetof (rekordy manifestu starszej wersji)
+
+#define COPY_BUFFER_SIZE (1024 * 1024)  // Rozmiar bufora dla kopiowania przez read/write (1MB)
+
+// Wyniki zwracane przez strategie kopiowania
+#define COPY_OK 0           // Plik został skopiowany
+#define COPY_UNSUPPORTED 1  // Strategia niedostępna dla tej pary plików - próbujemy kolejnej (nic nie zapisano)
+#define COPY_ERROR -1       // Błąd w trakcie kopiowania - przerywamy
 
 #define DEFAULT_MODE 0755  // Domyślne uprawnienia dla katalogów (rwxr-xr-x), czyli właściciel ma pełne prawa, grupa i inni tylko odczyt i wykonanie
 
-typedef struct stat Stat;  // Tworzymy alias "Stat" dla struktury "struct stat" (ułatwia pisanie kodu)
+typedef struct stat Stat;  // Tworzymy alias "Stat" dla struktury "struct stat" (ułatwia pisanie kodu)
+
+// Globalne zmienne konfiguracyjne
+unsigned int sleep_time = 0;        // Czas (w sekundach) pomiędzy kolejnymi synchronizacjami katalogów (domyślnie 0, ustawiany później)
+int recursive = 0;                  // Flaga (0 lub 1), czy kopiowanie ma być rekurencyjne (czyli czy kopiować podkatalogi)
+int mmap_threshold = 10 * 1024 * 1024;  // Próg rozmiaru pliku (w bajtach), od którego używamy mmap zamiast zwykłego kopiowania (domyślnie 10MB)
+int watch_mode = 0;                 // Flaga (0 lub 1), czy reagujemy na zdarzenia inotify zamiast pełnego skanowania co sleep_time
+int jobs = 1;                       // Liczba wątków roboczych synchronizacji (1 - synchronizacja w bieżącym wątku)
+off_t delta_threshold = 0;          // Próg rozmiaru pliku (w bajtach), od którego aktualizujemy pliki różnicowo (0 - wyłączone)
+const char *index_path = NULL;      // Ścieżka do pliku indeksu metadanych (NULL - indeks wyłączony)
+const char *metrics_path = NULL;    // Ścieżka gniazda uniksowego z metrykami w formacie Prometheus (NULL - wyłączone)
+const char *control_path = NULL;    // Ścieżka gniazda sterującego (NULL - wyłączone)
+int hash_mode = 0;                  // Flaga (0 lub 1), czy niejednoznaczne przypadki (ten sam rozmiar, inny mtime) rozstrzygamy skrótem zawartości
+int owner_mode = 0;                 // Flaga (0 lub 1), czy przenosimy właściciela i atrybuty spoza user.* (tylko root - ustawiana w main)
+int store_mode = 0;                 // Flaga (0 lub 1), czy cel jest magazynem fragmentów z manifestem zamiast kopii lustrzanej
+int plan_mode = 0;                  // Flaga (0 lub 1), czy przebieg najpierw buduje plan operacji, a potem go wykonuje
+int dry_run = 0;                    // Flaga (0 lub 1), czy tylko wypisujemy plan synchronizacji i kończymy
+long log_limit = 100;               // Maksymalna liczba komunikatów o pojedynczych plikach w syslogu na cykl (reszta w podsumowaniu)
+long long bandwidth_limit = 0;      // Limit przepustowości kopiowania w bajtach na sekundę (0 - bez ograniczenia)
+long ops_limit = 0;                 // Limit operacji na wpisach (stat, kopiowanie, usunięcie) na sekundę (0 - bez ograniczenia)
+int adaptive_mode = 0;              // Flaga (0 lub 1), czy zwalniamy, gdy rośnie zmierzone opóźnienie odczytu/zapisu
+int nice_mode = 0;                  // Flaga (0 lub 1), czy synchronizujemy z niskim priorytetem wejścia/wyjścia i bez zaśmiecania cache stron
+
+// Stan trybu obserwacji (inotify)
+// Każdy obserwowany katalog źródłowy ma swój deskryptor obserwacji (wd) oraz
+// odpowiadającą mu ścieżkę w katalogu docelowym
+typedef struct {
+    int wd;     // Deskryptor obserwacji zwrócony przez inotify_add_watch
+    char *src;  // Ścieżka obserwowanego katalogu źródłowego
+    char *dst;  // Ścieżka odpowiadającego mu katalogu docelowego
+    size_t pair; // Para katalogów, do której należy katalog (numer w tablicy pairs)
+} Watch;
+
+int inotify_fd = -1;        // Deskryptor instancji inotify (-1, jeśli tryb obserwacji jest wyłączony)
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER; // Chroni tablicę obserwacji (katalogi skanują wątki puli)
+Watch *watches = NULL;      // Dynamiczna tablica obserwowanych katalogów
+size_t watch_count = 0;     // Liczba zajętych elementów tablicy watches
+size_t watch_cap = 0;       // Pojemność tablicy watches
+size_t current_pair = 0;    // Numer synchronizowanej właśnie pary katalogów (pair_activate)
+
+// Metryki synchronizacji
+// Liczniki zwiększają wszystkie wątki; odczytują je gniazdo metryk (-M), zrzut po SIGUSR1
+// i tryb --bench. Czasy trwania zbieramy w histogramach o przedziałach będących potęgami dwójki.
+#define HISTOGRAM_BUCKETS 28        // Przedziały <= 2^0 ... 2^27 mikrosekund (~134 s) oraz +Inf
+
+typedef struct {
+    atomic_long buckets[HISTOGRAM_BUCKETS + 1]; // Liczba pomiarów w każdym przedziale (ostatni - +Inf)
+    atomic_llong sum_us;                        // Suma pomiarów (w mikrosekundach)
+    atomic_long count;                          // Liczba pomiarów
+} Histogram;
+
+atomic_long files_copied = 0;       // Liczba skopiowanych plików
+atomic_llong bytes_copied = 0;      // Łączny rozmiar skopiowanych plików (w bajtach)
+atomic_long files_skipped = 0;      // Liczba plików pominiętych, bo cel był aktualny
+atomic_long files_deleted = 0;      // Liczba plików usuniętych z celu
+atomic_long dirs_deleted = 0;       // Liczba katalogów usuniętych z celu
+atomic_long copy_errors = 0;        // Liczba nieudanych kopiowań
+atomic_long files_touched = 0;      // Liczba plików, w których poprawiono tylko metadane
+atomic_long files_hashed = 0;       // Liczba obliczonych skrótów zawartości (-H)
+atomic_long hash_cache_hits = 0;    // Liczba skrótów wziętych z pamięci podręcznej (-H)
+atomic_long cycles = 0;             // Liczba pełnych przebiegów synchronizacji
+atomic_long cycles_overrun = 0;     // Liczba przebiegów dłuższych niż sleep_time
+atomic_llong last_cycle_us = 0;     // Czas ostatniego pełnego przebiegu (w mikrosekundach)
+atomic_long queue_depth_max = 0;    // Największa liczba zadań w kolejkach puli (od uruchomienia)
+atomic_llong throttle_wait_us = 0;  // Łączny czas uśpienia wątków przez ogranicznik tempa (w mikrosekundach)
+atomic_long store_chunks_written = 0; // Liczba nowych fragmentów zapisanych w magazynie (-S)
+atomic_long store_chunks_reused = 0;  // Liczba fragmentów, które już były w magazynie (deduplikacja)
+atomic_llong store_bytes_written = 0; // Liczba bajtów zapisanych w fragmentach (po kompresji)
+Histogram copy_latency;             // Czas kopiowania pojedynczego pliku
+Histogram cycle_duration;           // Czas pełnego przebiegu synchronizacji
+
+atomic_long cycle_log_count = 0;    // Liczba komunikatów o plikach w bieżącym cyklu (log_file)
+volatile sig_atomic_t stats_requested = 0; // Ustawiane przez SIGUSR1 - zrzut metryk do sysloga
+
+// Funkcja zwracająca bieżący czas monotoniczny w nanosekundach
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Funkcja dodająca pomiar (w mikrosekundach) do histogramu
+void histogram_add(Histogram *h, long long us) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS && us > (1LL << bucket)) bucket++;
+    atomic_fetch_add(&h->buckets[bucket], 1);
+    atomic_fetch_add(&h->sum_us, us);
+    atomic_fetch_add(&h->count, 1);
+}
+
+// Funkcja zapisująca do sysloga komunikat o pojedynczym pliku (kopiowanie, usunięcie)
+// W jednym cyklu zapisujemy najwyżej log_limit takich komunikatów - przy dużych
+// synchronizacjach pozostałe operacje widać tylko w podsumowaniu cyklu (metrics_cycle_end)
+void log_file(const char *fmt, ...) {
+    long n = atomic_fetch_add(&cycle_log_count, 1);
+    if (n >= log_limit) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsyslog(LOG_INFO, fmt, ap);
+    va_end(ap);
+    if (n == log_limit - 1)
+        syslog(LOG_INFO, "Osiągnięto limit %ld komunikatów o plikach - kolejne operacje w podsumowaniu cyklu", log_limit);
+}
+
+// Funkcja obsługująca sygnał SIGUSR1
+// Sygnały to specjalne powiadomienia wysyłane do procesu przez system lub inne procesy
+// SIGUSR1 to jeden z sygnałów użytkownika, można go użyć np. do "obudzenia" demona
+// W procedurze obsługi sygnału nie wolno bezpiecznie wołać printf ani syslog, więc tylko
+// zaznaczamy prośbę o zrzut metryk - wykona go pętla demona (przerwany sleep/poll ją budzi)
+void handle_signal(int sig) {
+    if (sig == SIGUSR1) // Sprawdzamy, czy otrzymany sygnał to SIGUSR1
+        stats_requested = 1;
+}
+
+// Funkcja zapisująca cały bufor do deskryptora (write może zapisać mniej bajtów niż żądano)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) {
+            if (errno == EINTR) continue; // Przerwanie sygnałem - ponawiamy zapis
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Ograniczanie tempa synchronizacji (-B, -O, -A, -N)
+// Pełny przebieg nie może zagłodzić aplikacji, które korzystają z tego samego dysku.
+// Bajty i operacje ograniczają kubełki żetonów wspólne dla wszystkich wątków: wątek, który pobierze
+// więcej żetonów, niż jest w kubełku, zaciąga dług i odsypia go, a kolejne czekają za nim.
+// Przy włączonym ograniczeniu duże pliki kopiujemy porcjami THROTTLE_CHUNK, żeby limit działał
+// również w trakcie kopiowania jednego pliku.
+// Tryb adaptacyjny mierzy czas każdej porcji (w przeliczeniu na 64 KB). Gdy szybka średnia krocząca
+// rośnie ponad THROTTLE_BACKOFF razy względem wolnej (poziomu bazowego), połowimy wypełnienie (udział pracy w czasie,
+// resztę przesypiamy); gdy opóźnienie wraca do normy, wypełnienie rośnie stopniowo.
+#define THROTTLE_CHUNK (1024 * 1024)        // Porcja kopiowania przy włączonym ograniczeniu
+#define THROTTLE_BURST 0.25                 // Pojemność kubełka - ułamek sekundowego limitu
+#define THROTTLE_BACKOFF 2.0                // Krotność opóźnienia bazowego, od której zwalniamy
+#define THROTTLE_MIN_DUTY (1.0 / 64)        // Najmniejsze wypełnienie w trybie adaptacyjnym
+#define THROTTLE_ADJUST_NS 100000000LL      // Co ile (ns) najczęściej zmieniamy wypełnienie
+
+typedef struct {
+    double tokens;          // Dostępne żetony (ujemne - dług do odespania)
+    long long last;         // Czas ostatniego uzupełnienia (now_ns, 0 - kubełek nieużywany)
+} TokenBucket;
+
+pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER; // Chroni kubełki i stan trybu adaptacyjnego
+TokenBucket byte_bucket, op_bucket;
+double io_latency_avg = 0;  // Szybka średnia krocząca czasu porcji (ns na 64 KB)
+double io_latency_base = 0; // Wolna średnia krocząca - poziom bazowy opóźnienia
+double io_duty = 1.0;       // Wypełnienie w trybie adaptacyjnym (1 - bez przerw)
+long long io_duty_changed = 0; // Czas ostatniej zmiany wypełnienia (now_ns)
+
+// Funkcja pobierająca amount żetonów z kubełka uzupełnianego z szybkością rate na sekundę
+// Zwraca czas (w ns), jaki wątek musi odczekać, żeby spłacić dług
+long long bucket_reserve(TokenBucket *b, double rate, double amount, long long now) {
+    double burst = rate * THROTTLE_BURST;
+    if (!b->last) b->tokens = burst; // Pierwsze użycie - pełny kubełek
+    else b->tokens += (now - b->last) * rate / 1e9;
+    if (b->tokens > burst) b->tokens = burst;
+    b->last = now;
+    b->tokens -= amount;
+    return b->tokens < 0 ? (long long)(-b->tokens / rate * 1e9) : 0;
+}
+
+// Funkcja usypiająca wątek na ns nanosekund (czas trafia do metryk)
+void throttle_sleep(long long ns) {
+    if (ns <= 0) return;
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {}
+    atomic_fetch_add(&throttle_wait_us, ns / 1000);
+}
+
+// Funkcja zwracająca rozmiar kolejnej porcji kopiowania (remaining - ile zostało do skopiowania)
+off_t throttle_chunk(off_t remaining) {
+    if ((bandwidth_limit || adaptive_mode) && remaining > THROTTLE_CHUNK) return THROTTLE_CHUNK;
+    return remaining;
+}
+
+// Funkcja wywoływana po każdej porcji danych: bytes - liczba przeniesionych bajtów,
+// ns - czas trwania porcji (0 - nieznany, nie aktualizujemy opóźnienia)
+void throttle_bytes(long long bytes, long long ns) {
+    if (!bandwidth_limit && !adaptive_mode) return;
+    long long now = now_ns(), wait = 0;
+    pthread_mutex_lock(&throttle_lock);
+    if (bandwidth_limit) wait = bucket_reserve(&byte_bucket, bandwidth_limit, bytes, now);
+    if (adaptive_mode && ns > 0) {
+        double latency = (double)ns * 65536 / (bytes > 65536 ? bytes : 65536);
+        io_latency_avg = io_latency_avg ? io_latency_avg * 0.9 + latency * 0.1 : latency;
+        io_latency_base = io_latency_base ? io_latency_base + (latency - io_latency_base) / 256 : latency;
+        if (now - io_duty_changed >= THROTTLE_ADJUST_NS) {
+            if (io_latency_avg > io_latency_base * THROTTLE_BACKOFF)
+                io_duty = io_duty / 2 > THROTTLE_MIN_DUTY ? io_duty / 2 : THROTTLE_MIN_DUTY;
+            else
+                io_duty = io_duty + 1.0 / 16 < 1 ? io_duty + 1.0 / 16 : 1;
+            io_duty_changed = now;
+        }
+        wait += (long long)(ns * (1 / io_duty - 1));
+    }
+    pthread_mutex_unlock(&throttle_lock);
+    throttle_sleep(wait);
+}
+
+// Funkcja wywoływana przed operacją na wpisie katalogu (stat, kopiowanie, usunięcie)
+void throttle_op(void) {
+    if (!ops_limit) return;
+    pthread_mutex_lock(&throttle_lock);
+    long long wait = bucket_reserve(&op_bucket, ops_limit, 1, now_ns());
+    pthread_mutex_unlock(&throttle_lock);
+    throttle_sleep(wait);
+}
+
+// Funkcja usuwająca z cache stron przeniesione już dane (-N), żeby synchronizacja
+// nie wypierała z pamięci danych używanych przez inne aplikacje
+// Plik źródłowy zwalniamy w zakresie [0, done). Zapis zakresu [prev, done) pliku docelowego
+// tylko zlecamy, a czekamy na wcześniejszy [0, prev) - jego zapis trwał w tle podczas kopiowania porcji
+// (brudnych stron nie da się zwolnić przed zapisem na dysk)
+void drop_cache(int src_fd, int dst_fd, off_t prev, off_t done) {
+    posix_fadvise(src_fd, 0, done, POSIX_FADV_DONTNEED);
+    if (prev > 0) {
+        sync_file_range(dst_fd, 0, prev, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dst_fd, 0, prev, POSIX_FADV_DONTNEED);
+    }
+    if (done > prev) sync_file_range(dst_fd, prev, done - prev, SYNC_FILE_RANGE_WRITE);
+}
+
+// Funkcja wywoływana po skopiowaniu porcji n bajtów (done - łącznie skopiowane) w czasie ns
+void copy_progress(int src_fd, int dst_fd, off_t done, off_t n, long long ns) {
+    throttle_bytes(n, ns);
+    if (nice_mode) drop_cache(src_fd, dst_fd, done - n, done);
+}
+
+// Funkcja obniżająca priorytet wejścia/wyjścia procesu (-N) do najniższego w klasie best-effort
+// (klasa idle mogłaby zagłodzić synchronizację na stale zajętym dysku)
+// Wątki utworzone później dziedziczą priorytet
+void set_io_priority(void) {
+    int prio = (2 << 13) | 7; // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)
+    if (syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, prio) == -1)
+        syslog(LOG_WARNING, "Nie można obniżyć priorytetu wejścia/wyjścia: %s", strerror(errno));
+}
+
+// Czy błąd oznacza, że dana metoda kopiowania nie jest obsługiwana dla tej pary plików
+// (np. inny system plików, brak obsługi w jądrze) - wtedy próbujemy kolejnej strategii
+int copy_unsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF || err == EPERM;
+}
+
+// Strategia 1: klonowanie pliku (reflink) - btrfs/XFS współdzielą bloki danych,
+// więc kopiowanie trwa chwilę niezależnie od rozmiaru pliku
+int copy_reflink(int src_fd, int dst_fd, off_t size) {
+    (void)size;
+    return ioctl(dst_fd, FICLONE, src_fd) == 0 ? COPY_OK : COPY_UNSUPPORTED;
+}
+
+// Strategia 2: pliki rzadkie (z dziurami, np. obrazy dysków maszyn wirtualnych) - kopiujemy tylko
+// zakresy danych wskazane przez SEEK_DATA/SEEK_HOLE, a dziury odtwarzamy, pomijając je w pliku
+// docelowym (ftruncate ustala pełny rozmiar, więc dziura na końcu też pozostaje dziurą)
+// Małe pliki i pliki bez dziur zostawiamy kolejnym strategiom (kosztuje to jedno lseek)
+#define SPARSE_MIN_SIZE (64 * 1024)     // Mniejszych plików nie sprawdzamy pod kątem dziur
+
+// Funkcja sprawdzająca, czy plik st (deskryptor fd, -1 - tylko według st_blocks) ma dziury
+int file_has_holes(int fd, const Stat *st) {
+    if (st->st_size < SPARSE_MIN_SIZE) return 0;
+    if ((off_t)st->st_blocks * 512 < st->st_size) return 1;
+    if (fd == -1) return 0;
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    lseek(fd, 0, SEEK_SET);
+    return hole != -1 && hole < st->st_size;
+}
+
+int copy_sparse(int src_fd, int dst_fd, off_t size) {
+    if (size < SPARSE_MIN_SIZE) return COPY_UNSUPPORTED;
+    off_t hole = lseek(src_fd, 0, SEEK_HOLE);
+    if (hole == -1 || hole >= size) {
+        lseek(src_fd, 0, SEEK_SET); // Kolejne strategie czytają od bieżącej pozycji
+        return COPY_UNSUPPORTED;    // Brak dziur (albo system plików nie obsługuje SEEK_HOLE)
+    }
+    if (ftruncate(dst_fd, size) == -1) return COPY_UNSUPPORTED;
+
+    char *buffer = NULL;    // Bufor dla pread/pwrite, jeśli copy_file_range nie działa dla tej pary plików
+    int use_range = 1;
+    int result = COPY_OK;
+    off_t data = 0;
+    // lseek(SEEK_DATA) zwraca ENXIO, gdy za pozycją nie ma już danych
+    while ((data = lseek(src_fd, data, SEEK_DATA)) != -1 && data < size) {
+        off_t end = lseek(src_fd, data, SEEK_HOLE);
+        if (end == -1 || end > size) end = size;
+        while (data < end) {
+            long long start = now_ns();
+            ssize_t n;
+            if (use_range) {
+                off_t in = data, out = data;
+                n = copy_file_range(src_fd, &in, dst_fd, &out, throttle_chunk(end - data), 0);
+                if (n == -1 && copy_unsupported(errno)) {
+                    use_range = 0;
+                    continue;
+                }
+            } else {
+                if (!buffer && !(buffer = malloc(COPY_BUFFER_SIZE))) {
+                    result = COPY_ERROR;
+                    goto out;
+                }
+                n = pread(src_fd, buffer, end - data < COPY_BUFFER_SIZE ? end - data : COPY_BUFFER_SIZE, data);
+                if (n > 0 && pwrite(dst_fd, buffer, n, data) != n) n = -1;
+            }
+            if (n == -1 && errno == EINTR) continue;
+            if (n == 0) goto out; // Plik źródłowy się skrócił
+            if (n == -1) {
+                result = COPY_ERROR;
+                goto out;
+            }
+            data += n;
+            copy_progress(src_fd, dst_fd, data, n, now_ns() - start);
+        }
+    }
+out:
+    free(buffer);
+    return result;
+}
+
+// Strategia 3: mmap - tylko dla dużych plików (>= mmap_threshold)
+// Plik kopiujemy strumieniowo, oknami STREAM_WINDOW, a nie jednym mapowaniem całego pliku - pamięć
+// i przestrzeń adresowa są ograniczone niezależnie od rozmiaru pliku. Osobny wątek czytający mapuje
+// kolejne okna źródła z MAP_POPULATE (odczyt z dysku) i zleca odczyt z wyprzedzeniem następnego okna,
+// a w tym czasie bieżący wątek kopiuje poprzednie okno do celu. Za kursorem kopiowania zwalniamy strony
+// źródła i zapisanego już celu, żeby duży plik nie wypchnął z cache stron danych innych aplikacji.
+// Plik docelowy musi mieć odpowiedni rozmiar przed mapowaniem (inaczej zapis kończy się SIGBUS)
+#define STREAM_WINDOW (16 * 1024 * 1024)    // Rozmiar okna (wielokrotność rozmiaru strony)
+#define STREAM_DEPTH 2                      // Liczba okien przygotowanych przez wątek czytający z wyprzedzeniem
+
+typedef struct {
+    int src_fd;                     // Plik źródłowy
+    off_t size;                     // Rozmiar kopiowanego pliku
+    pthread_mutex_t lock;
+    pthread_cond_t cond;            // Zmiana produced, consumed lub stop
+    void *maps[STREAM_DEPTH];       // Zmapowane okna źródła czekające na skopiowanie (okno i w slocie i % STREAM_DEPTH)
+    size_t produced, consumed;      // Liczba okien przygotowanych i skopiowanych
+    int failed;                     // Wątek czytający nie zmapował okna (kończy pracę)
+    int stop;                       // Wątek kopiujący przerwał kopiowanie
+} Stream;
+
+// Funkcja zwracająca długość okna zaczynającego się na pozycji off
+size_t stream_len(const Stream *st, off_t off) {
+    return st->size - off < STREAM_WINDOW ? (size_t)(st->size - off) : STREAM_WINDOW;
+}
+
+// Wątek czytający: mapuje kolejne okna źródła (odczyt z dysku) najwyżej STREAM_DEPTH okien przed kopiowaniem
+void *stream_reader(void *arg) {
+    Stream *st = arg;
+    for (off_t off = 0; off < st->size; off += STREAM_WINDOW) {
+        pthread_mutex_lock(&st->lock);
+        while (st->produced - st->consumed == STREAM_DEPTH && !st->stop)
+            pthread_cond_wait(&st->cond, &st->lock);
+        int stop = st->stop;
+        pthread_mutex_unlock(&st->lock);
+        if (stop) break;
+
+        size_t len = stream_len(st, off);
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, st->src_fd, off);
+        if (map != MAP_FAILED) madvise(map, len, MADV_SEQUENTIAL);
+        // Jądro czyta następne okno w tle, zanim po nie sięgniemy
+        if (off + (off_t)len < st->size) posix_fadvise(st->src_fd, off + len, STREAM_WINDOW, POSIX_FADV_WILLNEED);
+
+        pthread_mutex_lock(&st->lock);
+        if (map == MAP_FAILED) st->failed = 1;
+        else st->maps[st->produced++ % STREAM_DEPTH] = map;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+        if (map == MAP_FAILED) break;
+    }
+    return NULL;
+}
+
+int copy_mmap(int src_fd, int dst_fd, off_t size) {
+    if (size < mmap_threshold || size == 0) return COPY_UNSUPPORTED;
+    if (ftruncate(dst_fd, size) == -1) return COPY_UNSUPPORTED;
+
+    Stream st = { .src_fd = src_fd, .size = size };
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    pthread_t reader;
+    int result = COPY_UNSUPPORTED;
+    if (pthread_create(&reader, NULL, stream_reader, &st) != 0) goto out;
+
+    result = COPY_OK;
+    for (off_t off = 0; off < size; off += STREAM_WINDOW) {
+        size_t window = off / STREAM_WINDOW, len = stream_len(&st, off);
+        // Czekamy, aż wątek czytający przygotuje okno
+        pthread_mutex_lock(&st.lock);
+        while (st.produced == window && !st.failed)
+            pthread_cond_wait(&st.cond, &st.lock);
+        void *src_map = st.produced > window ? st.maps[window % STREAM_DEPTH] : NULL;
+        pthread_mutex_unlock(&st.lock);
+
+        void *dst_map = src_map ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, off) : MAP_FAILED;
+        if (dst_map == MAP_FAILED) {
+            result = off == 0 ? COPY_UNSUPPORTED : COPY_ERROR; // Na początku można jeszcze spróbować innej strategii
+            break;
+        }
+
+        // Kopiujemy okno (przy ograniczeniu tempa - porcjami)
+        for (size_t done = 0; done < len;) {
+            size_t n = throttle_chunk(len - done);
+            long long start = now_ns();
+            memcpy((char *)dst_map + done, (char *)src_map + done, n);
+            done += n;
+            throttle_bytes(n, now_ns() - start);
+        }
+        munmap(dst_map, len);
+        munmap(src_map, len);
+
+        pthread_mutex_lock(&st.lock);
+        st.maps[window % STREAM_DEPTH] = NULL;
+        st.consumed++;
+        pthread_cond_broadcast(&st.cond);
+        pthread_mutex_unlock(&st.lock);
+
+        // Zwalniamy strony za kursorem: źródło od razu, a cel po zapisie na dysk - zapis bieżącego
+        // okna tylko zlecamy, a czekamy na poprzednie (zapisywało się w tle podczas kopiowania)
+        posix_fadvise(src_fd, off, len, POSIX_FADV_DONTNEED);
+        sync_file_range(dst_fd, off, len, SYNC_FILE_RANGE_WRITE);
+        if (off > 0) {
+            sync_file_range(dst_fd, off - STREAM_WINDOW, STREAM_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(dst_fd, off - STREAM_WINDOW, STREAM_WINDOW, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    // Zatrzymujemy wątek czytający i zwalniamy okna, których nie skopiowaliśmy
+    pthread_mutex_lock(&st.lock);
+    st.stop = 1;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.lock);
+    pthread_join(reader, NULL);
+    for (size_t i = st.consumed; i < st.produced; i++)
+        munmap(st.maps[i % STREAM_DEPTH], stream_len(&st, (off_t)i * STREAM_WINDOW));
+
+out:
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    if (result == COPY_UNSUPPORTED) ftruncate(dst_fd, 0); // Cofamy zmianę rozmiaru - kolejna strategia zapisuje od początku
+    return result;
+}
+
+// Strategia 4: copy_file_range - kopiowanie w jądrze (bez przechodzenia danych przez przestrzeń użytkownika),
+// systemy plików mogą je dodatkowo przyspieszyć (np. NFS/CIFS po stronie serwera)
+int copy_range(int src_fd, int dst_fd, off_t size) {
+    off_t copied = 0;
+    while (copied < size) {
+        long long start = now_ns();
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, throttle_chunk(size - copied), 0);
+        if (n == 0) break; // Koniec pliku (plik źródłowy się skrócił)
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return (copied == 0 && copy_unsupported(errno)) ? COPY_UNSUPPORTED : COPY_ERROR;
+        }
+        copied += n;
+        copy_progress(src_fd, dst_fd, copied, n, now_ns() - start);
+    }
+    return COPY_OK;
+}
+
+// Strategia 5: sendfile - również kopiowanie w jądrze, dostępne na starszych jądrach
+int copy_sendfile(int src_fd, int dst_fd, off_t size) {
+    off_t copied = 0;
+    while (copied < size) {
+        long long start = now_ns();
+        ssize_t n = sendfile(dst_fd, src_fd, NULL, throttle_chunk(size - copied));
+        if (n == 0) break; // Koniec pliku
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return (copied == 0 && copy_unsupported(errno)) ? COPY_UNSUPPORTED : COPY_ERROR;
+        }
+        copied += n;
+        copy_progress(src_fd, dst_fd, copied, n, now_ns() - start);
+    }
+    return COPY_OK;
+}
+
+// Strategia 6 (ostateczna): zwykłe kopiowanie przez bufor w przestrzeni użytkownika
+int copy_readwrite(int src_fd, int dst_fd, off_t size) {
+    (void)size;
+    char *buffer = malloc(COPY_BUFFER_SIZE); // Duży bufor ogranicza liczbę wywołań systemowych
+    if (!buffer) return COPY_ERROR;
+
+    ssize_t r; // Liczba przeczytanych bajtów
+    off_t copied = 0;
+    int result = COPY_OK;
+    long long start = now_ns();
+    // Czytamy dane z pliku źródłowego i zapisujemy do docelowego, aż do końca pliku
+    while ((r = read(src_fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            result = COPY_ERROR;
+            break;
+        }
+        if (write_all(dst_fd, buffer, r) == -1) {
+            result = COPY_ERROR;
+            break;
+        }
+        copied += r;
+        copy_progress(src_fd, dst_fd, copied, r, now_ns() - start);
+        start = now_ns();
+    }
+    free(buffer);
+    return result;
+}
+
+// Kopiowanie różnicowe (-D próg) dla dużych, zmodyfikowanych plików
+// Na wzór rsync: dla istniejącego pliku docelowego liczymy sumy kontrolne bloków
+// (słabą, przesuwną i silną), a następnie przesuwamy okno po pliku źródłowym
+// i szukamy bloków, które już są w pliku docelowym. Nowa wersja powstaje zawsze w pliku
+// tymczasowym: sklonowanym ze starej (FICLONE) - wtedy zapisujemy tylko różniące się fragmenty,
+// albo pustym - wtedy bloki bez zmian kopiujemy ze starej wersji, której nie modyfikujemy.
+// W klonie zapis odbywa się na pozycji pos (rosnąco), więc blok można wykorzystać tylko,
+// jeśli leży na pozycji >= pos (dane przed pos mogły już zostać nadpisane).
+
+#define DELTA_MIN_BLOCK 4096            // Minimalny rozmiar bloku
+#define DELTA_MAX_BLOCK (1024 * 1024)   // Maksymalny rozmiar bloku
+#define DELTA_WINDOW (4 * 1024 * 1024)  // Rozmiar bufora odczytu pliku źródłowego
+#define DELTA_NONE UINT32_MAX           // Brak bloku (koniec łańcucha w tablicy mieszającej)
+
+// 64-bitowy skrót XXH64 (silna suma kontrolna bloku)
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return xxh_rotl(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// Cztery niezależne akumulatory przetwarzają po 32 bajty na iterację,
+// więc procesor wykonuje je równolegle (ILP)
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = xxh_rotl(h ^ (xxh_read32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = xxh_rotl(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Słaba suma kontrolna bloku (jak w rsync): a = suma bajtów, b = suma ważona (len - i) * x[i]
+// Iteracje pętli są niezależne (same sumy), więc kompilator wektoryzuje ją instrukcjami SIMD
+uint32_t weak_checksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Sygnatura bloku pliku docelowego
+typedef struct {
+    uint32_t weak;      // Słaba suma kontrolna
+    uint32_t next;      // Następny blok o tym samym kubełku tablicy mieszającej
+    uint64_t strong;    // Silna suma kontrolna (XXH64)
+} BlockSig;
+
+// Funkcja przenosząca len bajtów z pliku źródłowego (pozycja off) do docelowego (ta sama pozycja)
+int delta_write_literal(int src_fd, int dst_fd, off_t off, off_t len, char *buf) {
+    while (len > 0) {
+        size_t chunk = len < DELTA_WINDOW ? (size_t)len : DELTA_WINDOW;
+        long long start = now_ns();
+        ssize_t r = pread(src_fd, buf, chunk, off);
+        if (r <= 0) return -1;
+        if (pwrite(dst_fd, buf, r, off) != r) return -1;
+        throttle_bytes(r, now_ns() - start);
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+// Funkcja zapisująca do dst_fd zawartość pliku źródłowego na podstawie poprzedniej wersji base_fd
+// base_fd == dst_fd - aktualizacja w miejscu (plik tymczasowy sklonowany ze starej wersji)
+// base_fd != dst_fd - dst_fd jest pustym plikiem tymczasowym, a dopasowane bloki czytamy z base_fd
+// written - liczba bajtów faktycznie zapisanych do pliku docelowego
+// Zwraca COPY_OK, COPY_UNSUPPORTED (nic nie zmieniono) lub COPY_ERROR
+int copy_delta(int src_fd, int base_fd, int dst_fd, off_t size, off_t base_size, off_t *written) {
+    // Rozmiar bloku ~ pierwiastek z rozmiaru pliku (jak w rsync), wyrównany do 4KB
+    size_t block = DELTA_MIN_BLOCK;
+    while ((off_t)block * (off_t)block < size && block < DELTA_MAX_BLOCK) block *= 2;
+
+    size_t nblocks = base_size / block; // Niepełny ostatni blok zawsze przepisujemy
+    int in_place = base_fd == dst_fd;
+    size_t buckets = 1;
+    while (buckets < nblocks * 2) buckets *= 2;
+
+    BlockSig *sigs = malloc((nblocks ? nblocks : 1) * sizeof(BlockSig));
+    uint32_t *table = malloc(buckets * sizeof(uint32_t));
+    unsigned char *win = malloc(DELTA_WINDOW + 2 * block); // Bufor okna na pliku źródłowym
+    char *tmp = malloc(DELTA_WINDOW);                      // Bufor do przenoszenia danych
+    int result = COPY_UNSUPPORTED;
+    if (!sigs || !table || !win || !tmp) goto out;
+
+    // Etap 1: sygnatury bloków istniejącego pliku docelowego
+    for (size_t i = 0; i < buckets; i++) table[i] = DELTA_NONE;
+    for (size_t i = 0; i < nblocks; i++) {
+        if (pread(base_fd, win, block, (off_t)i * block) != (ssize_t)block) goto out;
+        throttle_bytes(block, 0);
+        sigs[i].weak = weak_checksum(win, block);
+        sigs[i].strong = xxh64(win, block, 0);
+        uint32_t bucket = (sigs[i].weak * 2654435761u) & (buckets - 1);
+        sigs[i].next = table[bucket];
+        table[bucket] = i;
+    }
+
+    // Etap 2: przesuwne okno po pliku źródłowym
+    result = COPY_ERROR; // Od tej chwili plik docelowy może być częściowo zmieniony
+    *written = 0;
+    off_t pos = 0, lit_start = 0;       // Bieżąca pozycja i początek niedopasowanych danych
+    off_t win_off = 0, win_len = 0;     // Zakres pliku źródłowego obecny w buforze win
+    uint32_t a = 0, b = 0;              // Składowe słabej sumy dla okna [pos, pos + block)
+    int have_sum = 0;
+
+    while (pos + (off_t)block <= size) {
+        // Dbamy, by w buforze był cały blok od pos oraz bajt za nim (do przesunięcia sumy)
+        if (pos + (off_t)block + 1 > win_off + win_len && win_off + win_len < size) {
+            size_t keep = win_off + win_len - pos;
+            memmove(win, win + (pos - win_off), keep);
+            win_off = pos;
+            win_len = keep;
+            while (win_len < DELTA_WINDOW + (off_t)block && win_off + win_len < size) {
+                long long start = now_ns();
+                ssize_t r = pread(src_fd, win + win_len, DELTA_WINDOW + block - win_len, win_off + win_len);
+                if (r <= 0) goto out;
+                win_len += r;
+                throttle_bytes(r, now_ns() - start);
+            }
+        }
+        unsigned char *cur = win + (pos - win_off);
+
+        if (!have_sum) {
+            uint32_t s = weak_checksum(cur, block);
+            a = s & 0xffff;
+            b = s >> 16;
+            have_sum = 1;
+        }
+
+        // Szukamy bloku poprzedniej wersji o tej samej sumie (w miejscu - tylko na pozycji >= pos,
+        // bo wcześniejsze bloki mogliśmy już nadpisać)
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        uint32_t match = DELTA_NONE;
+        uint64_t strong = 0;
+        int strong_done = 0;
+        for (uint32_t i = table[(weak * 2654435761u) & (buckets - 1)]; i != DELTA_NONE; i = sigs[i].next) {
+            if (sigs[i].weak != weak || (in_place && (off_t)i * (off_t)block < pos)) continue;
+            if (!strong_done) {
+                strong = xxh64(cur, block, 0);
+                strong_done = 1;
+            }
+            if (sigs[i].strong != strong) continue;
+            match = i;
+            if ((off_t)i * (off_t)block == pos) break; // Blok na swoim miejscu - nic nie trzeba zapisywać
+        }
+
+        if (match != DELTA_NONE) {
+            // Zapisujemy zaległe niedopasowane dane, a potem (jeśli trzeba) przenosimy dopasowany blok
+            if (delta_write_literal(src_fd, dst_fd, lit_start, pos - lit_start, tmp) == -1) goto out;
+            *written += pos - lit_start;
+            off_t from = (off_t)match * block;
+            if (from != pos || !in_place) {
+                if (pread(base_fd, tmp, block, from) != (ssize_t)block) goto out;
+                if (pwrite(dst_fd, tmp, block, pos) != (ssize_t)block) goto out;
+                *written += block;
+            }
+            pos += block;
+            lit_start = pos;
+            have_sum = 0;
+            continue;
+        }
+
+        // Brak dopasowania - przesuwamy okno o jeden bajt (aktualizacja sumy w O(1))
+        if (pos + (off_t)block < size) {
+            unsigned char out = cur[0], in = cur[block];
+            a = a - out + in;
+            b = b - (uint32_t)block * out + a;
+        }
+        pos++;
+
+        // Ograniczamy ilość zaległych danych, by nie przetrzymywać ich w nieskończoność
+        if (pos - lit_start >= DELTA_WINDOW) {
+            if (delta_write_literal(src_fd, dst_fd, lit_start, pos - lit_start, tmp) == -1) goto out;
+            *written += pos - lit_start;
+            lit_start = pos;
+        }
+    }
+
+    // Reszta pliku (za ostatnim dopasowaniem) i wyrównanie rozmiaru
+    if (delta_write_literal(src_fd, dst_fd, lit_start, size - lit_start, tmp) == -1) goto out;
+    *written += size - lit_start;
+    if (ftruncate(dst_fd, size) == -1) goto out;
+    result = COPY_OK;
+
+out:
+    free(sigs);
+    free(table);
+    free(win);
+    free(tmp);
+    return result;
+}
+
+// Strategia kopiowania: nazwa (do logów) i funkcja kopiująca
+typedef struct {
+    const char *name;
+    int (*copy)(int src_fd, int dst_fd, off_t size);
+} CopyStrategy;
+
+// Strategie w kolejności prób - od najtańszej do najbardziej uniwersalnej
+// Strumieniowe mmap stoi przed copy_file_range i sendfile: te prawie zawsze się udają, więc plik od
+// mmap_threshold nigdy nie trafiłby do okien zwalnianych z cache za kursorem. Mniejsze pliki mmap
+// odrzuca od razu, a gdy nie da się zmapować pierwszego okna, próbujemy kolejnych strategii.
+const CopyStrategy copy_strategies[] = {
+    { "reflink", copy_reflink },
+    { "sparse", copy_sparse },
+    { "mmap", copy_mmap },
+    { "copy_file_range", copy_range },
+    { "sendfile", copy_sendfile },
+    { "read/write", copy_readwrite },
+};
+
+// Metryki kopiowania według strategii: kolejne pozycje copy_strategies, a po nich delta, io_uring i magazyn
+#define COPY_STRATEGY_COUNT (sizeof(copy_strategies) / sizeof(copy_strategies[0]))
+#define STRATEGY_DELTA COPY_STRATEGY_COUNT          // Kopiowanie różnicowe (-D)
+#define STRATEGY_URING (COPY_STRATEGY_COUNT + 1)    // Partie małych plików io_uring (-U)
+#define STRATEGY_STORE (COPY_STRATEGY_COUNT + 2)    // Zapis w magazynie fragmentów (-S)
+#define STRATEGY_SLOTS (COPY_STRATEGY_COUNT + 3)
+
+typedef struct {
+    atomic_long files;      // Liczba plików skopiowanych tą strategią
+    atomic_llong bytes;     // Liczba zapisanych bajtów
+    atomic_llong nanos;     // Łączny czas kopiowania (w nanosekundach)
+} StrategyMetrics;
+
+StrategyMetrics strategy_metrics[STRATEGY_SLOTS];
+
+// Funkcja zwracająca nazwę strategii o numerze slot (w metrykach i logach)
+const char *strategy_name(size_t slot) {
+    if (slot == STRATEGY_DELTA) return "delta";
+    if (slot == STRATEGY_URING) return "io_uring";
+    if (slot == STRATEGY_STORE) return "store";
+    return copy_strategies[slot].name;
+}
+
+// Funkcja zapisująca w metrykach skopiowanie jednego pliku strategią slot
+void metrics_copy(size_t slot, long long bytes, long long ns) {
+    atomic_fetch_add(&strategy_metrics[slot].files, 1);
+    atomic_fetch_add(&strategy_metrics[slot].bytes, bytes);
+    atomic_fetch_add(&strategy_metrics[slot].nanos, ns);
+    histogram_add(&copy_latency, ns / 1000);
+}
+
+// Plik wskazany względem deskryptora katalogu
+typedef struct {
+    int dfd;                // Deskryptor katalogu, w którym leży plik
+    const char *name;       // Nazwa pliku w tym katalogu
+    const char *path;       // Pełna ścieżka (tylko do logów i indeksu)
+} PathAt;
+
+// Rozszerzone atrybuty (xattr)
+// Przenosimy atrybuty z przestrzeni user.*, a jako root (owner_mode) wszystkie - inaczej zapis
+// trusted.* i security.* się nie uda, a cel różniłby się od źródła w każdym cyklu.
+// Nazwy i wartości czytamy do bufora wątku (XATTR_LIST_MAX i XATTR_SIZE_MAX to po 64KB).
+__thread char *xattr_buffer = NULL;    // Listy nazw źródła i celu oraz wartości atrybutu w obu
+
+// Funkcja sprawdzająca, czy atrybut name przenosimy
+int xattr_wanted(const char *name) {
+    return owner_mode || !strncmp(name, "user.", 5);
+}
+
+// Funkcja odczytująca listę nazw atrybutów fd do bufora list (XATTR_LIST_MAX bajtów)
+// Zwraca długość listy (0 - brak atrybutów lub system plików ich nie obsługuje)
+size_t xattr_list(int fd, char *list) {
+    ssize_t len = flistxattr(fd, list, XATTR_LIST_MAX);
+    return len > 0 ? (size_t)len : 0;
+}
+
+// Funkcja porównująca (copy == 0) lub przenosząca (copy == 1) atrybuty src_fd na fd
+// Przy przenoszeniu usuwa z fd przenoszone atrybuty, których źródło nie ma
+// Zwraca 1, jeśli atrybuty się różnią (przy przenoszeniu - różniły się), 0 w przeciwnym razie
+int xattr_sync(int src_fd, int fd, int copy) {
+    char probe;
+    // Najczęstszy przypadek - żadna strona nie ma atrybutów (bez przydzielania bufora)
+    if (flistxattr(src_fd, &probe, 0) <= 0 && flistxattr(fd, &probe, 0) <= 0) return 0;
+    if (!xattr_buffer && !(xattr_buffer = malloc(2 * XATTR_LIST_MAX + 2 * XATTR_SIZE_MAX))) return 0;
+    char *src_list = xattr_buffer, *dst_list = src_list + XATTR_LIST_MAX;
+    char *src_value = dst_list + XATTR_LIST_MAX, *dst_value = src_value + XATTR_SIZE_MAX;
+    size_t src_len = xattr_list(src_fd, src_list), dst_len = xattr_list(fd, dst_list);
+
+    int differ = 0;
+    long src_count = 0, dst_count = 0;
+    for (const char *name = src_list; name < src_list + src_len; name += strlen(name) + 1) {
+        if (!xattr_wanted(name)) continue;
+        src_count++;
+        ssize_t len = fgetxattr(src_fd, name, src_value, XATTR_SIZE_MAX);
+        if (len < 0) continue;
+        ssize_t dst_len_value = fgetxattr(fd, name, dst_value, XATTR_SIZE_MAX);
+        if (dst_len_value == len && !memcmp(src_value, dst_value, len)) continue;
+        differ = 1;
+        if (!copy) return 1;
+        if (fsetxattr(fd, name, src_value, len, 0) == -1 && errno != ENOTSUP)
+            syslog(LOG_WARNING, "Nie można ustawić atrybutu %s: %s", name, strerror(errno));
+    }
+    for (const char *name = dst_list; name < dst_list + dst_len; name += strlen(name) + 1) {
+        if (!xattr_wanted(name)) continue;
+        dst_count++;
+        if (!copy) continue;
+        if (fgetxattr(src_fd, name, NULL, 0) == -1 && errno == ENODATA) {
+            differ = 1;
+            fremovexattr(fd, name);
+        }
+    }
+    return differ || src_count != dst_count;
+}
+
+// Funkcja przenosząca na otwarty plik (lub katalog) docelowy metadane źródła: właściciela,
+// uprawnienia, rozszerzone atrybuty (src_fd == -1 - bez nich) oraz czasy dostępu i modyfikacji
+// Dzięki zachowanemu mtime kolejne cykle porównują pliki po (rozmiar, mtime w ns) bez fałszywych różnic
+void preserve_metadata(int src_fd, int fd, const Stat *st) {
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    // Właściciel przed uprawnieniami - fchown kasuje bity setuid/setgid
+    if (owner_mode) fchown(fd, st->st_uid, st->st_gid);
+    fchmod(fd, st->st_mode & 07777);
+    if (src_fd != -1) xattr_sync(src_fd, fd, 1);
+    futimens(fd, times); // Na końcu - zmiana uprawnień nie zmienia mtime, ale zapis tak
+}
+
+// Funkcja przenosząca metadane wpisu src_name katalogu src_dfd na wpis name katalogu dfd
+// (src_dfd == -1 - bez rozszerzonych atrybutów); wpisy otwieramy tylko na czas zmiany metadanych
+void preserve_metadata_at(int src_dfd, const char *src_name, int dfd, const char *name, const Stat *st) {
+    int fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        // Bez deskryptora tylko dla pliku bez prawa odczytu (EACCES/EPERM) - przenosimy właściciela,
+        // uprawnienia i czasy. Dowiązania symbolicznego (ELOOP) ani innych błędów nie ruszamy:
+        // fchmodat podąża za dowiązaniem i zmieniłby plik, na który wskazuje, nawet poza celem
+        Stat cur;
+        if ((errno != EACCES && errno != EPERM) || fstatat(dfd, name, &cur, AT_SYMLINK_NOFOLLOW) == -1 ||
+            S_ISLNK(cur.st_mode))
+            return;
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        if (owner_mode) fchownat(dfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+        fchmodat(dfd, name, st->st_mode & 07777, 0);
+        utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW);
+        return;
+    }
+    int src_fd = src_dfd == -1 ? -1 : openat(src_dfd, src_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    preserve_metadata(src_fd, fd, st);
+    if (src_fd != -1) close(src_fd);
+    close(fd);
+}
+
+// Pliki tymczasowe
+// Kopię zapisujemy do pliku tymczasowego w katalogu docelowym i dopiero gotową podmieniamy
+// atomowo (rename), więc czytelnicy celu nigdy nie widzą niepełnego pliku, a po awarii zostaje
+// stara albo nowa wersja. Najpierw próbujemy O_TMPFILE (plik bez nazwy - po awarii nic nie
+// zostaje); bez niego tworzymy plik o nazwie z przedrostkiem TEMP_PREFIX, a ewentualne pozostałości
+// po awarii usuwa remove_extraneous_files (nie ma ich w źródle).
+#define TEMP_PREFIX ".syncdir-tmp."     // Przedrostek nazw plików tymczasowych w katalogu docelowym
+
+typedef struct {
+    int named;              // 1 - plik z nazwą, 0 - O_TMPFILE bez nazwy
+    char name[64];          // Nazwa pliku tymczasowego (jeśli named)
+} TempFile;
+
+atomic_long temp_seq = 0;   // Licznik do tworzenia unikalnych nazw plików tymczasowych
+
+// Funkcja tworząca unikalną nazwę pliku tymczasowego
+void temp_name(char *buf, size_t size) {
+    snprintf(buf, size, TEMP_PREFIX "%d.%ld", (int)getpid(), atomic_fetch_add(&temp_seq, 1));
+}
+
+// Funkcja tworząca plik tymczasowy w katalogu dfd
+// Zwraca deskryptor (do odczytu i zapisu) lub -1 w przypadku błędu
+// Sposób nadania nazwy plikowi O_TMPFILE - sprawdzany raz, przy pierwszym pliku tymczasowym
+#define TEMP_LINK_UNKNOWN 0     // Jeszcze nie sprawdzono
+#define TEMP_LINK_PROC 1        // linkat przez /proc/self/fd/N
+#define TEMP_LINK_EMPTY 2       // linkat z AT_EMPTY_PATH (bez /proc, wymaga CAP_DAC_READ_SEARCH)
+#define TEMP_LINK_NONE 3        // Żaden nie działa - tylko pliki tymczasowe z nazwą
+atomic_int temp_link_mode = TEMP_LINK_UNKNOWN;
+
+// Funkcja dowiązująca plik O_TMPFILE (deskryptor fd) pod nazwą name w katalogu dfd sposobem mode
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu (errno z linkat)
+int temp_link(int fd, int dfd, const char *name, int mode) {
+    if (mode == TEMP_LINK_EMPTY) return linkat(fd, "", dfd, name, AT_EMPTY_PATH);
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc, dfd, name, AT_SYMLINK_FOLLOW);
+}
+
+// Funkcja sprawdzająca, czy pliki O_TMPFILE w katalogu dfd da się dowiązać (np. bez zamontowanego /proc
+// w chroot działa tylko AT_EMPTY_PATH, i to z uprawnieniem CAP_DAC_READ_SEARCH)
+// Próbujemy na osobnym pliku - dowiązany i usunięty plik O_TMPFILE nie da się już dowiązać ponownie
+int temp_link_probe(int dfd) {
+    char probe[64];
+    temp_name(probe, sizeof(probe));
+    for (int mode = TEMP_LINK_PROC; mode <= TEMP_LINK_EMPTY; mode++) {
+        int fd = openat(dfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd == -1) break;
+        int linked = temp_link(fd, dfd, probe, mode) == 0;
+        close(fd);
+        if (linked) {
+            unlinkat(dfd, probe, 0);
+            return mode;
+        }
+    }
+    syslog(LOG_WARNING, "Nie można dowiązać pliku O_TMPFILE (%s) - używamy plików tymczasowych z nazwą", strerror(errno));
+    return TEMP_LINK_NONE;
+}
+
+int temp_open(int dfd, TempFile *t) {
+    t->named = 0;
+    int mode = atomic_load(&temp_link_mode);
+    int fd = mode == TEMP_LINK_NONE ? -1 : openat(dfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 && mode == TEMP_LINK_UNKNOWN) {
+        mode = temp_link_probe(dfd);
+        atomic_store(&temp_link_mode, mode);
+        if (mode == TEMP_LINK_NONE) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd != -1) return fd;
+    // System plików nie obsługuje O_TMPFILE (albo nie da się go dowiązać) - plik tymczasowy z nazwą
+    t->named = 1;
+    temp_name(t->name, sizeof(t->name));
+    return openat(dfd, t->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+}
+
+// Funkcja umieszczająca gotowy plik tymczasowy (deskryptor fd) pod nazwą name w katalogu dfd
+// Istniejący plik docelowy jest podmieniany atomowo (renameat)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu (plik tymczasowy jest wtedy usuwany)
+int temp_commit(int dfd, TempFile *t, int fd, const char *name) {
+    if (!t->named) {
+        int mode = atomic_load(&temp_link_mode);
+        // Jeśli celu jeszcze nie ma, dowiązujemy plik od razu pod docelową nazwą
+        if (temp_link(fd, dfd, name, mode) == 0) return 0;
+        if (errno != EEXIST) return -1;
+        // linkat nie nadpisuje - dowiązujemy pod nazwą tymczasową i podmieniamy przez renameat
+        temp_name(t->name, sizeof(t->name));
+        if (temp_link(fd, dfd, t->name, mode) == -1) return -1;
+        t->named = 1;
+    }
+    if (renameat(dfd, t->name, dfd, name) == 0) return 0;
+    int err = errno;
+    unlinkat(dfd, t->name, 0);
+    errno = err;
+    return -1;
+}
+
+// Funkcja usuwająca niepotrzebny plik tymczasowy (O_TMPFILE znika sam po zamknięciu)
+void temp_discard(int dfd, TempFile *t) {
+    if (t->named) unlinkat(dfd, t->name, 0);
+}
+
+// Funkcja kopiująca plik z lokalizacji src do dst
+// src - plik źródłowy (skąd kopiujemy)
+// dst - plik docelowy (dokąd kopiujemy)
+// st - metadane pliku źródłowego (rozmiar, a po skopiowaniu - uprawnienia i czasy dla celu)
+// Próbujemy kolejnych strategii z tablicy copy_strategies, aż któraś się powiedzie;
+// użyta strategia jest zapisywana w syslogu
+// Zwraca 0, jeśli plik został skopiowany, -1 w przypadku błędu
+int copy_file(const PathAt *src, const PathAt *dst, const Stat *st) {
+    off_t size = st->st_size;
+    int src_fd = openat(src->dfd, src->name, O_RDONLY | O_CLOEXEC); // Otwieramy plik źródłowy do odczytu
+    if (src_fd == -1) return -1; // Jeśli nie udało się otworzyć pliku, kończymy funkcję
+    // Kopię zapisujemy do pliku tymczasowego w katalogu docelowym (do odczytu i zapisu - wymagają tego mmap i delta)
+    TempFile tmp;
+    int dst_fd = temp_open(dst->dfd, &tmp);
+    if (dst_fd == -1) {
+        close(src_fd);
+        return -1;
+    }
+
+    long long start = now_ns();
+    size_t used = (size_t)-1; // Numer strategii, która skopiowała plik (strategy_name)
+    Stat dst_stat;
+    off_t written = -1; // Liczba zapisanych bajtów (tylko dla kopiowania różnicowego)
+    int result = COPY_UNSUPPORTED;
+    // Duży plik, który już istnieje w celu - próbujemy zapisać tylko zmienione bloki
+    // (oprócz plików z dziurami - delta zapisałaby je jako bloki zer, a copy_sparse je zachowa)
+    if (delta_threshold && size >= delta_threshold && !file_has_holes(src_fd, st) &&
+        fstatat(dst->dfd, dst->name, &dst_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(dst_stat.st_mode) &&
+        dst_stat.st_size > 0) {
+        int old_fd = openat(dst->dfd, dst->name, O_RDONLY | O_CLOEXEC); // Stara wersja - tylko do odczytu
+        if (old_fd != -1 && ioctl(dst_fd, FICLONE, old_fd) == 0) {
+            // Plik tymczasowy współdzieli bloki ze starą wersją - poprawiamy go i podmieniamy atomowo
+            close(old_fd);
+            result = copy_delta(src_fd, dst_fd, dst_fd, size, dst_stat.st_size, &written);
+        } else if (old_fd != -1) {
+            // Bez reflinków składamy nowy plik tymczasowy: bloki bez zmian czytamy ze starej wersji
+            // (tylko do odczytu - cel zostaje nietknięty do atomowej podmiany)
+            result = copy_delta(src_fd, old_fd, dst_fd, size, dst_stat.st_size, &written);
+            close(old_fd);
+        }
+        if (result == COPY_OK) used = STRATEGY_DELTA;
+        // Gdy delta się nie powiodła, zapisujemy cały plik od początku
+        if (result == COPY_UNSUPPORTED && ftruncate(dst_fd, 0) == -1) result = COPY_ERROR;
+    }
+
+    // Pozostałe strategie zapisują cały plik od początku
+    if (result == COPY_UNSUPPORTED) {
+        for (size_t i = 0; i < COPY_STRATEGY_COUNT; i++) {
+            result = copy_strategies[i].copy(src_fd, dst_fd, size);
+            if (result == COPY_UNSUPPORTED) continue; // Próbujemy kolejnej strategii
+            if (result == COPY_OK) used = i;
+            break;
+        }
+    }
+
+    if (used != (size_t)-1) preserve_metadata(src_fd, dst_fd, st);
+    if (used != (size_t)-1 && nice_mode) drop_cache(src_fd, dst_fd, size, size); // Czekamy na zapis reszty i zwalniamy cache
+    // Gotową kopię podmieniamy atomowo, a nieudaną usuwamy
+    if (used == (size_t)-1)
+        temp_discard(dst->dfd, &tmp);
+    else if (temp_commit(dst->dfd, &tmp, dst_fd, dst->name) == -1)
+        used = (size_t)-1;
+
+    // Zamykamy deskryptory plików
+    close(src_fd);
+    close(dst_fd);
+
+    if (used == (size_t)-1) {
+        atomic_fetch_add(&copy_errors, 1);
+        syslog(LOG_ERR, "Błąd kopiowania pliku: %s -> %s: %s", src->path, dst->path, strerror(errno));
+        return -1;
+    }
+    metrics_copy(used, written >= 0 ? written : size, now_ns() - start);
+
+    // Zapisujemy informację o skopiowaniu pliku do sysloga (z limitem komunikatów na cykl)
+    if (written >= 0)
+        log_file("Skopiowano plik (%s, zapisano %lld z %lld B): %s -> %s",
+                 strategy_name(used), (long long)written, (long long)size, src->path, dst->path);
+    else
+        log_file("Skopiowano plik (%s): %s -> %s", strategy_name(used), src->path, dst->path);
+    return 0;
+}
+
+
+// Arena - prosta pamięć na nazwy i ścieżki wpisów jednego katalogu
+// Zamiast osobnego malloc dla każdej nazwy przydzielamy kolejne fragmenty dużych bloków,
+// a całość zwalniamy jednym wywołaniem po zakończeniu synchronizacji katalogu.
+// Zwolnione bloki standardowego rozmiaru trafiają do puli wątku i są używane ponownie,
+// więc przejście drzewa o milionach katalogów nie wywołuje malloc/free dla każdego z nich.
+#define ARENA_BLOCK (64 * 1024)         // Rozmiar pojedynczego bloku areny
+#define ARENA_POOL_MAX 16               // Najwięcej wolnych bloków w puli jednego wątku
+#define DIR_BUFFER_SIZE (64 * 1024)     // Bufor dla getdents64 (wiele wpisów na jedno wywołanie)
+#define DIR_BATCH 65536                 // Najwięcej wpisów jednego katalogu w pamięci naraz
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;            // Poprzednio przydzielony blok
+    size_t used, cap;                   // Zajęta i całkowita pojemność bloku
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;                   // Bieżący blok (NULL - arena pusta)
+} Arena;
+
+// Zapamiętany stan areny (arena_mark) - arena_rewind zwalnia wszystko, co przydzielono później
+typedef struct {
+    ArenaBlock *head;
+    size_t used;
+} ArenaMark;
+
+__thread ArenaBlock *arena_pool = NULL; // Wolne bloki ARENA_BLOCK wątku
+__thread int arena_pool_count = 0;      // Liczba bloków w puli
+
+// Funkcja przydzielająca size bajtów z areny (wyrównanych do 8)
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!a->head || a->head->used + size > a->head->cap) {
+        size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        ArenaBlock *b = cap == ARENA_BLOCK ? arena_pool : NULL;
+        if (b) {
+            arena_pool = b->next;
+            arena_pool_count--;
+        } else {
+            b = malloc(sizeof(ArenaBlock) + cap);
+        }
+        if (!b) {
+            syslog(LOG_ERR, "Brak pamięci");
+            exit(EXIT_FAILURE);
+        }
+        b->next = a->head;
+        b->used = 0;
+        b->cap = cap;
+        a->head = b;
+    }
+    void *p = a->head->data + a->head->used;
+    a->head->used += size;
+    return p;
+}
+
+// Funkcja kopiująca napis do areny
+char *arena_strdup(Arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+// Funkcja tworząca w arenie ścieżkę "dir/name" (bez ograniczenia długości)
+char *arena_join(Arena *a, const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = arena_alloc(a, dir_len + name_len + 2);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+// Funkcja oddająca blok do puli wątku (lub systemowi, gdy pula jest pełna)
+void arena_release(ArenaBlock *b) {
+    if (b->cap == ARENA_BLOCK && arena_pool_count < ARENA_POOL_MAX) {
+        b->next = arena_pool;
+        arena_pool = b;
+        arena_pool_count++;
+    } else {
+        free(b);
+    }
+}
+
+// Funkcja zwalniająca całą pamięć areny
+void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        arena_release(a->head);
+        a->head = next;
+    }
+}
+
+// Funkcja zwalniająca pulę bloków wątku (przed zakończeniem krótko żyjącego wątku)
+void arena_pool_drain(void) {
+    while (arena_pool) {
+        ArenaBlock *next = arena_pool->next;
+        free(arena_pool);
+        arena_pool = next;
+    }
+    arena_pool_count = 0;
+}
+
+ArenaMark arena_mark(const Arena *a) {
+    return (ArenaMark){ a->head, a->head ? a->head->used : 0 };
+}
+
+// Funkcja cofająca arenę do stanu m (napisy przydzielone po arena_mark przestają być ważne)
+void arena_rewind(Arena *a, ArenaMark m) {
+    while (a->head != m.head) {
+        ArenaBlock *next = a->head->next;
+        arena_release(a->head);
+        a->head = next;
+    }
+    if (a->head) a->head->used = m.used;
+}
+
+// Wpis katalogu odczytany przez getdents64
+typedef struct {
+    const char *name;                   // Nazwa wpisu (w arenie)
+    unsigned char type;                 // Typ z d_type (DT_REG, DT_DIR, DT_LNK, DT_UNKNOWN, ...)
+    ino_t ino;                          // Numer i-węzła
+} DirEntry;
+
+__thread char *dir_buffer = NULL;       // Bufor getdents64 wątku (przydzielany raz)
+__thread DirEntry *dir_scratch = NULL;  // Robocza tablica wpisów wątku (rośnie do największego katalogu lub partii)
+__thread size_t dir_scratch_cap = 0;
+
+#define READ_DIR_ERROR ((size_t)-1)     // Wynik read_dir_batch: błąd getdents64 lub brak pamięci
+
+// Funkcja czytająca kolejne wpisy katalogu (bez "." i "..") do areny - najwyżej max wpisów
+// fd - deskryptor otwartego katalogu, out - tablica wpisów (w arenie)
+// Kolejne wywołanie czyta dalej od miejsca, w którym skończyło poprzednie
+// Zwraca liczbę wpisów (mniej niż max - koniec katalogu) albo READ_DIR_ERROR - lista byłaby
+// niepełna, więc wywołujący nie może na jej podstawie niczego usuwać ani zapisywać
+size_t read_dir_batch(int fd, Arena *a, DirEntry **out, size_t max) {
+    if (!dir_buffer) dir_buffer = malloc(DIR_BUFFER_SIZE);
+    size_t count = 0;
+    ssize_t n = 0;
+    int failed = !dir_buffer;
+
+    // getdents64 zwraca naraz tyle wpisów, ile zmieści się w buforze
+    while (!failed && count < max && (n = getdents64(fd, dir_buffer, DIR_BUFFER_SIZE)) > 0) {
+        off_t next = 0; // Pozycja katalogu za ostatnim przeczytanym wpisem (d_off)
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(dir_buffer + off);
+            if (count == max) {
+                // Partia pełna - cofamy pozycję katalogu do pierwszego nieprzeczytanego wpisu
+                lseek(fd, next, SEEK_SET);
+                break;
+            }
+            off += d->d_reclen;
+            next = d->d_off;
+            // Pomijamy "." i ".."
+            if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))) continue;
+            if (count == dir_scratch_cap) {
+                size_t cap = dir_scratch_cap ? dir_scratch_cap * 2 : 64;
+                DirEntry *tmp = realloc(dir_scratch, cap * sizeof(DirEntry));
+                if (!tmp) {
+                    failed = 1;
+                    break;
+                }
+                dir_scratch = tmp;
+                dir_scratch_cap = cap;
+            }
+            dir_scratch[count].name = arena_strdup(a, d->d_name);
+            dir_scratch[count].type = d->d_type;
+            dir_scratch[count].ino = d->d_ino;
+            count++;
+        }
+    }
+    if (failed || n == -1) {
+        *out = NULL;
+        return READ_DIR_ERROR;
+    }
+
+    // Kopiujemy tablicę do areny - zwolni się razem z nazwami
+    *out = arena_alloc(a, (count ? count : 1) * sizeof(DirEntry));
+    if (count) memcpy(*out, dir_scratch, count * sizeof(DirEntry));
+    return count;
+}
+
+// Funkcja czytająca wszystkie wpisy katalogu do areny
+size_t read_dir(int fd, Arena *a, DirEntry **out) {
+    return read_dir_batch(fd, a, out, SIZE_MAX);
+}
+
+// Funkcja ustalająca typ wpisu, gdy system plików nie wypełnia d_type (DT_UNKNOWN)
+unsigned char entry_type(int dfd, const char *name, unsigned char type) {
+    Stat st;
+    if (type != DT_UNKNOWN) return type;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) return DT_UNKNOWN;
+    return S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+}
+
+// Porównanie wpisów po nazwie (qsort/bsearch)
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+}
+
+// Porównanie wpisów po numerze i-węzła (qsort)
+// stat i unlink w kolejności i-węzłów czytają tablicę i-węzłów po kolei zamiast skakać po dysku
+// (kolejność getdents64 w katalogach ext4 z htree to kolejność skrótów nazw)
+int compare_inodes(const void *a, const void *b) {
+    ino_t x = ((const DirEntry *)a)->ino, y = ((const DirEntry *)b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+// Funkcja dopisująca nazwę do bufora nazw (nazwy zakończone '\0', jedna za drugą)
+void names_append(char **buf, size_t *len, size_t *cap, const char *name) {
+    size_t n = strlen(name) + 1;
+    if (*len + n > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        while (new_cap < *len + n) new_cap *= 2;
+        char *tmp = realloc(*buf, new_cap);
+        if (!tmp) return;
+        *buf = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, name, n);
+    *len += n;
+}
+
+// Katalog w trakcie synchronizacji
+// Źródło i cel są otwarte jako deskryptory, a operacje na wpisach używają *at()
+// (fstatat, openat, mkdirat, unlinkat), więc jądro nie rozwiązuje za każdym razem pełnej ścieżki.
+// Ścieżki służą tylko do logów, indeksu i obserwacji inotify.
+// W puli wątków pending liczy skanowanie katalogu, niezakończone kopie jego plików oraz
+// podkatalogi, które jeszcze nie otworzyły się względem jego deskryptorów;
+// finish_directory wykonujemy dopiero, gdy licznik spadnie do zera
+typedef struct {
+    const char *src, *dst;  // Ścieżki katalogu źródłowego i docelowego (w arenie)
+    int src_fd, dst_fd;     // Deskryptory katalogu źródłowego i docelowego
+    Arena arena;            // Pamięć na nazwy i ścieżki wpisów
+    DirEntry *entries;      // Wpisy katalogu źródłowego (po skanowaniu posortowane po nazwie)
+    size_t count;           // Liczba wpisów
+    int wide;               // Katalog ma więcej niż DIR_BATCH wpisów - entries to tylko ostatnia partia
+    char *subdirs;          // Podkatalogi odłożone dla walk_subdirs (names_append; poza pulą)
+    size_t subdirs_len, subdirs_cap;
+    int pooled;             // Czy katalog synchronizuje pula wątków
+    atomic_int pending;     // Liczba niezakończonych operacji w tym katalogu (tylko w puli)
+    int state;              // Stan listy nazw względem indeksu (DIR_NEW, DIR_CHANGED, DIR_UNCHANGED)
+    int incomplete;         // Nie przeczytaliśmy całej listy źródła - bez usuwania i zapisu katalogu w indeksie
+    Stat st;                // Stan katalogu źródłowego z początku skanowania
+} DirJob;
+
+// Funkcja otwierająca parę katalogów względem deskryptorów katalogów nadrzędnych
+// (AT_FDCWD i pełne ścieżki dla korzenia synchronizacji)
+// Podkatalogu celu nie otwieramy przez dowiązanie symboliczne (katalog celu pary może nim być)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int dir_open(DirJob *job, int src_parent, int dst_parent, const char *src_name, const char *dst_name,
+             const char *src_path, const char *dst_path) {
+    memset(job, 0, sizeof(*job));
+    job->src_fd = openat(src_parent, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (job->src_fd == -1) return -1;
+    job->dst_fd = openat(dst_parent, dst_name, O_RDONLY | O_DIRECTORY | (dst_parent == AT_FDCWD ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+    if (job->dst_fd == -1) {
+        close(job->src_fd);
+        return -1;
+    }
+    job->src = arena_strdup(&job->arena, src_path);
+    job->dst = arena_strdup(&job->arena, dst_path);
+    return 0;
+}
+
+// Funkcja zamykająca katalogi i zwalniająca pamięć wpisów
+// (deskryptory przejęte przez walk_adopt mają wartość -1)
+void dir_close(DirJob *job) {
+    if (job->src_fd != -1) close(job->src_fd);
+    if (job->dst_fd != -1) close(job->dst_fd);
+    arena_free(&job->arena);
+    free(job->subdirs);
+}
+
+// Przejście drzewa bez rekurencji
+// Zamiast rekurencji na stosie C (bardzo głębokie drzewo mogłoby go przepełnić) trzymamy jawny
+// stos ramek. Ramka to katalog, który ma jeszcze podkatalogi do odwiedzenia, i pamięta tylko ich
+// nazwy, więc pamięć zależy od głębokości i liczby podkatalogów, a nie od liczby plików w drzewie.
+// Otwarte są deskryptory najwyżej WALK_FD_BUDGET / nfd górnych ramek. Niższe zamykamy, zapamiętując
+// urządzenie i i-węzeł, a po powrocie otwieramy ponownie przez ".." z katalogu dziecka - jeśli to
+// już inny katalog (przeniesiono go w trakcie przejścia), pomijamy jego resztę do następnego przebiegu.
+#define WALK_FD_BUDGET 64               // Najwięcej deskryptorów katalogów otwartych przez jedno przejście
+
+typedef struct {
+    int fd[2];              // Deskryptory katalogu (synchronizacja: źródło i cel, usuwanie: fd[0]); -1 - zamknięty
+    dev_t dev[2];           // Urządzenie i i-węzeł zamkniętego katalogu (do sprawdzenia po ponownym otwarciu)
+    ino_t ino[2];
+    char *src, *dst;        // Ścieżki katalogu (synchronizacja) albo jego nazwa w katalogu nadrzędnym (usuwanie, src)
+    char *names;            // Podkatalogi do odwiedzenia (names_append)
+    size_t names_len, names_cap, next; // Długość i pojemność bufora nazw oraz przesunięcie następnej nazwy
+    int rescanned;          // Usuwanie: katalog przeczytano ponownie przed rmdir
+} WalkFrame;
+
+typedef struct {
+    WalkFrame *frames;      // Stos ramek (tablica zostaje między przejściami)
+    size_t depth, cap;      // Liczba ramek na stosie i pojemność tablicy
+    size_t low;             // Najniższa ramka z otwartymi deskryptorami (wyższe też są otwarte)
+    int nfd;                // Liczba deskryptorów na ramkę
+} Walk;
+
+// Funkcja kładąca na stos ramkę z deskryptorami fd0 i fd1 (przejmuje je)
+// Zwraca ramkę lub NULL przy braku pamięci (deskryptory są wtedy zamknięte)
+WalkFrame *walk_push(Walk *w, int fd0, int fd1) {
+    if (w->depth == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 64;
+        WalkFrame *tmp = realloc(w->frames, cap * sizeof(WalkFrame));
+        if (!tmp) {
+            close(fd0);
+            if (fd1 != -1) close(fd1);
+            return NULL;
+        }
+        w->frames = tmp;
+        w->cap = cap;
+    }
+    // Budżet deskryptorów: zamykamy najniższą otwartą ramkę
+    if (w->depth - w->low >= (size_t)(WALK_FD_BUDGET / w->nfd)) {
+        WalkFrame *old = &w->frames[w->low++];
+        for (int i = 0; i < w->nfd; i++) {
+            Stat st;
+            int ok = fstat(old->fd[i], &st) == 0;
+            old->dev[i] = ok ? st.st_dev : 0;
+            old->ino[i] = ok ? st.st_ino : 0;
+            close(old->fd[i]);
+            old->fd[i] = -1;
+        }
+    }
+    WalkFrame *f = &w->frames[w->depth++];
+    memset(f, 0, sizeof(*f));
+    f->fd[0] = fd0;
+    f->fd[1] = fd1;
+    return f;
+}
+
+// Funkcja zdejmująca górną ramkę ze stosu (zamyka jej deskryptory i zwalnia pamięć)
+// Zamkniętą ramkę nadrzędną otwiera ponownie przez ".." (zob. wyżej)
+// Zwraca 0 lub -1, jeśli pozostałe podkatalogi ramki nadrzędnej pominięto
+int walk_pop(Walk *w) {
+    WalkFrame *f = &w->frames[--w->depth];
+    int ret = 0;
+    if (w->depth && w->depth - 1 < w->low) {
+        WalkFrame *p = &w->frames[w->depth - 1];
+        int ok = 1;
+        for (int i = 0; i < w->nfd; i++) {
+            Stat st;
+            p->fd[i] = f->fd[i] == -1 ? -1 : openat(f->fd[i], "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (p->fd[i] == -1 || fstat(p->fd[i], &st) == -1 || st.st_dev != p->dev[i] || st.st_ino != p->ino[i]) ok = 0;
+        }
+        w->low = w->depth - 1;
+        if (!ok) {
+            syslog(LOG_WARNING, "Katalog %s zmienił położenie w trakcie przejścia - pomijamy jego pozostałe podkatalogi", p->src);
+            for (int i = 0; i < w->nfd; i++) {
+                if (p->fd[i] != -1) close(p->fd[i]);
+                p->fd[i] = -1;
+            }
+            p->next = p->names_len;
+            w->low = w->depth; // Ramka p pozostaje zamknięta
+            ret = -1;
+        }
+    }
+    for (int i = 0; i < w->nfd; i++)
+        if (f->fd[i] != -1) close(f->fd[i]);
+    free(f->src);
+    free(f->dst);
+    free(f->names);
+    if (w->low > w->depth) w->low = w->depth;
+    return ret;
+}
+
+__thread Walk remove_walk = { .nfd = 1 }; // Stos usuwania drzew (remove_directory może działać w wielu wątkach)
+
+// Funkcja usuwająca pliki katalogu ramki f i zapamiętująca w niej jego podkatalogi
+// Wpisy czytamy partiami po DIR_BATCH, więc pamięć nie zależy od szerokości katalogu
+void remove_files(WalkFrame *f) {
+    Arena arena = {0};
+    DirEntry *entries;
+    size_t count;
+    do {
+        count = read_dir_batch(f->fd[0], &arena, &entries, DIR_BATCH);
+        if (count == READ_DIR_ERROR) break; // rmdir się nie uda - resztę usunie następny przebieg
+        qsort(entries, count, sizeof(DirEntry), compare_inodes);
+        // d_type mówi, czy to katalog - bez dodatkowego stat
+        for (size_t i = 0; i < count; i++) {
+            throttle_op();
+            if (entry_type(f->fd[0], entries[i].name, entries[i].type) == DT_DIR)
+                names_append(&f->names, &f->names_len, &f->names_cap, entries[i].name);
+            else
+                unlinkat(f->fd[0], entries[i].name, 0);
+        }
+        arena_free(&arena);
+    } while (count == DIR_BATCH);
+}
+
+// Funkcja usuwająca katalog i całą jego zawartość (bez rekurencji - jawny stos remove_walk)
+// dfd - deskryptor katalogu nadrzędnego, name - nazwa katalogu do usunięcia
+void remove_directory(int dfd, const char *name) {
+    Walk *w = &remove_walk;
+    int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    WalkFrame *f = fd == -1 ? NULL : walk_push(w, fd, -1);
+    if (!f) return; // Jeśli nie udało się otworzyć katalogu, kończymy funkcję
+    f->src = strdup(name);
+    remove_files(f);
+
+    while (w->depth) {
+        f = &w->frames[w->depth - 1];
+        if (f->next < f->names_len) {
+            // Schodzimy do kolejnego podkatalogu
+            const char *child = f->names + f->next;
+            f->next += strlen(child) + 1;
+            int cfd = openat(f->fd[0], child, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            char *copy = strdup(child); // walk_push może przenieść tablicę ramek (i bufor nazw f)
+            WalkFrame *c = cfd == -1 ? NULL : walk_push(w, cfd, -1);
+            if (!c) {
+                free(copy);
+                continue;
+            }
+            c->src = copy;
+            remove_files(c);
+            continue;
+        }
+        // Katalog powinien być pusty, ale przy czytaniu partiami z jednoczesnym usuwaniem system plików
+        // bez stałych pozycji w katalogu mógł pominąć wpisy - czytamy go jeszcze raz (jedno getdents64)
+        if (!f->rescanned && f->fd[0] != -1) {
+            f->rescanned = 1;
+            lseek(f->fd[0], 0, SEEK_SET);
+            remove_files(f);
+            if (f->next < f->names_len) continue;
+        }
+        // Zdejmujemy ramkę i usuwamy pusty już katalog
+        char *dir_name = f->src;
+        f->src = NULL;
+        walk_pop(w);
+        int parent = w->depth ? w->frames[w->depth - 1].fd[0] : dfd;
+        if (parent != -1) unlinkat(parent, dir_name, AT_REMOVEDIR);
+        free(dir_name);
+    }
+}
+
+// Funkcja usuwająca pojedynczy wpis z katalogu docelowego
+// dfd - deskryptor katalogu docelowego, name - nazwa wpisu, type - d_type (lub DT_UNKNOWN)
+// path - pełna ścieżka wpisu (do logów)
+// Katalogi usuwamy tylko w trybie rekurencyjnym (tak jak wcześniej)
+void remove_entry(int dfd, const char *name, unsigned char type, const char *path) {
+    throttle_op();
+    type = entry_type(dfd, name, type);
+    if (type == DT_UNKNOWN) return; // Wpisu nie ma w celu
+
+    if (type == DT_DIR) {
+        // Jeśli to katalog i kopiowanie jest rekurencyjne, usuwamy cały katalog
+        if (recursive) {
+            remove_directory(dfd, name);
+            atomic_fetch_add(&dirs_deleted, 1);
+            log_file("Usunięto katalog: %s", path);
+        }
+    } else {
+        // Jeśli to plik, usuwamy go
+        unlinkat(dfd, name, 0);
+        atomic_fetch_add(&files_deleted, 1);
+        log_file("Usunięto plik: %s", path);
+    }
+}
+
+// Funkcja usuwająca zbędne pliki i katalogi w katalogu docelowym,
+// które nie występują w katalogu źródłowym
+// Wpisy źródła są już w job->entries (posortowane), więc nazwy z celu sprawdzamy
+// w pamięci (bsearch), a nie przez lstat w źródle. Szerokiego katalogu (job->wide) nie ma
+// w pamięci w całości - wtedy każdą nazwę z celu sprawdzamy przez fstatat w źródle.
+// Cel też czytamy partiami; wpis pominięty przez system plików bez stałych pozycji
+// w katalogu (usuwamy w trakcie czytania) usunie następny przebieg
+void remove_extraneous_files(DirJob *job) {
+    ArenaMark mark = arena_mark(&job->arena);
+    DirEntry *entries;
+    size_t count;
+    do {
+        count = read_dir_batch(job->dst_fd, &job->arena, &entries, DIR_BATCH);
+        if (count == READ_DIR_ERROR) break; // Pozostałe zbędne wpisy usunie następny przebieg
+        for (size_t i = 0; i < count; i++) {
+            if (!job->wide && bsearch(&entries[i], job->entries, job->count, sizeof(DirEntry), compare_entries)) continue;
+
+            // Potwierdzamy brak w źródle (wpis mógł powstać po odczytaniu katalogu źródłowego)
+            Stat src_stat;
+            if (fstatat(job->src_fd, entries[i].name, &src_stat, AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT)
+                remove_entry(job->dst_fd, entries[i].name, entries[i].type, arena_join(&job->arena, job->dst, entries[i].name));
+        }
+        arena_rewind(&job->arena, mark);
+    } while (count == DIR_BATCH);
+}
+
+// Trwały indeks metadanych (-I plik)
+// Plik indeksu jest mapowany do pamięci i zawiera tablicę mieszającą (adresowanie otwarte)
+// z wpisem dla każdej zsynchronizowanej ścieżki źródłowej: rozmiar, mtime z nanosekundami,
+// numer i-węzła oraz miejsce na skrót zawartości. Dzięki niemu:
+//  - niezmienionych plików (ten sam rozmiar, mtime i i-węzeł) nie porównujemy z celem (brak lstat celu),
+//  - katalogów o niezmienionym mtime (brak dodanych/usuniętych nazw) nie sprawdzamy pod kątem zbędnych plików,
+//  - usunięte wpisy wykrywamy, porównując listę dzieci katalogu w indeksie z bieżącym przebiegiem
+//    (zamiast ponownie listować katalog docelowy i wywoływać lstat w źródle dla każdej nazwy),
+//  - po restarcie demona indeks jest od razu aktualny (brak "zimnego" pełnego porównania).
+// Układ pliku: nagłówek | sloty[slots] | sterta nazw[names_cap]
+
+#define INDEX_MAGIC 0x58494453u     // "SDIX"
+#define INDEX_VERSION 2
+#define INDEX_EMPTY 0               // Klucz wolnego slotu
+#define INDEX_TOMBSTONE 1           // Klucz slotu po usuniętym wpisie
+#define INDEX_DIR 1                 // Flaga: wpis opisuje katalog
+#define INDEX_DIR_DONE 2            // Flaga: zapisano mtime katalogu po pełnym przebiegu
+
+// Stan listy nazw katalogu względem indeksu
+#define DIR_NEW 0                   // Katalogu nie ma w indeksie - zbędne pliki sprawdzamy po staremu
+#define DIR_CHANGED 1               // mtime katalogu się zmienił - porównujemy dzieci z indeksem
+#define DIR_UNCHANGED 2             // mtime bez zmian - nic nie dodano ani nie usunięto
+
+typedef struct {
+    uint32_t magic, version;
+    uint64_t root;                  // Skrót pary (źródło, cel) - indeks innej pary jest odrzucany
+    uint64_t generation;            // Numer bieżącego przebiegu synchronizacji
+    uint64_t slots;                 // Liczba slotów tablicy (potęga dwójki)
+    uint64_t used;                  // Zajęte sloty (łącznie z usuniętymi)
+    uint64_t names_used, names_cap; // Zajęta i całkowita pojemność sterty nazw
+} IndexHeader;
+
+typedef struct {
+    uint64_t key;                   // Skrót ścieżki źródłowej (INDEX_EMPTY / INDEX_TOMBSTONE dla wolnych)
+    uint64_t parent;                // Skrót ścieżki katalogu nadrzędnego
+    uint64_t size;                  // Rozmiar pliku
+    int64_t mtime_ns;               // Czas modyfikacji w nanosekundach
+    int64_t ctime_ns;               // Czas zmiany i-węzła w nanosekundach (zmiany samych metadanych)
+    uint64_t ino;                   // Numer i-węzła
+    uint64_t hash;                  // Skrót zawartości (0 - nieobliczony)
+    uint64_t gen;                   // Przebieg, w którym ostatnio widziano wpis w źródle
+    uint32_t name;                  // Przesunięcie nazwy (bez katalogu) w stercie nazw
+    uint32_t first_child;           // Pierwsze dziecko katalogu (numer slotu + 1, 0 - brak)
+    uint32_t next_sibling;          // Następne dziecko tego samego katalogu (numer slotu + 1)
+    uint32_t flags;                 // INDEX_DIR, INDEX_DIR_DONE
+} IndexEntry;
+
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER; // Chroni indeks (wątki puli)
+IndexHeader *index_map = NULL;      // Zmapowany plik indeksu (NULL - indeks wyłączony)
+size_t index_map_size = 0;          // Rozmiar mapowania
+
+#define INDEX_ENTRIES(h) ((IndexEntry *)((h) + 1))
+#define INDEX_NAMES(h) ((char *)(INDEX_ENTRIES(h) + (h)->slots))
+
+// Funkcja licząca 64-bitowy skrót FNV-1a pierwszych len bajtów ścieżki
+// Wartości zarezerwowane dla wolnych slotów są przesuwane
+uint64_t path_key_n(const char *path, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h <= INDEX_TOMBSTONE ? h + 2 : h;
+}
+
+uint64_t path_key(const char *path) {
+    return path_key_n(path, strlen(path));
+}
+
+// Skrót katalogu nadrzędnego (ścieżki do ostatniego '/')
+uint64_t parent_key(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? path_key_n(path, slash - path) : 0;
+}
+
+// Czas modyfikacji z nanosekundami
+int64_t stat_mtime_ns(const Stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+int64_t stat_ctime_ns(const Stat *st) {
+    return (int64_t)st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+// Funkcja tworząca nowy, pusty plik indeksu i mapująca go do pamięci
+IndexHeader *index_create(const char *path, uint64_t root, uint64_t slots, uint64_t names_cap, size_t *map_size) {
+    size_t size = sizeof(IndexHeader) + slots * sizeof(IndexEntry) + names_cap;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return NULL;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return NULL;
+    }
+    IndexHeader *h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // Mapowanie pozostaje ważne po zamknięciu deskryptora
+    if (h == MAP_FAILED) return NULL;
+
+    // Plik po ftruncate jest wyzerowany - wystarczy wypełnić nagłówek
+    h->magic = INDEX_MAGIC;
+    h->version = INDEX_VERSION;
+    h->root = root;
+    h->slots = slots;
+    h->names_used = 1; // Przesunięcie 0 oznacza "brak nazwy"
+    h->names_cap = names_cap;
+    *map_size = size;
+    return h;
+}
+
+// Funkcja szukająca slotu dla klucza (adresowanie otwarte z sondowaniem liniowym)
+// Zwraca slot z kluczem albo - gdy go nie ma - pierwszy slot, w którym można go wstawić
+uint64_t index_probe(IndexHeader *h, uint64_t key) {
+    IndexEntry *e = INDEX_ENTRIES(h);
+    uint64_t mask = h->slots - 1, free_slot = UINT64_MAX;
+    for (uint64_t i = key & mask; ; i = (i + 1) & mask) {
+        if (e[i].key == key) return i;
+        if (e[i].key == INDEX_TOMBSTONE && free_slot == UINT64_MAX) free_slot = i;
+        if (e[i].key == INDEX_EMPTY) return free_slot != UINT64_MAX ? free_slot : i;
+    }
+}
+
+// Funkcja zwracająca wpis o danym kluczu (lub NULL)
+IndexEntry *index_get(uint64_t key) {
+    IndexEntry *e = &INDEX_ENTRIES(index_map)[index_probe(index_map, key)];
+    return e->key == key ? e : NULL;
+}
+
+// Funkcja dopisująca dziecko na początek listy dzieci katalogu nadrzędnego
+void index_link(IndexHeader *h, uint64_t slot) {
+    IndexEntry *e = INDEX_ENTRIES(h);
+    if (!e[slot].parent) return;
+    uint64_t p = index_probe(h, e[slot].parent);
+    if (e[p].key != e[slot].parent) return; // Katalog nadrzędny nie jest w indeksie (korzeń)
+    e[slot].next_sibling = e[p].first_child;
+    e[p].first_child = slot + 1;
+}
+
+// Funkcja przebudowująca indeks do większego pliku (więcej slotów i/lub większa sterta nazw)
+// Usunięte wpisy są przy tym pomijane, a listy dzieci budowane od nowa
+int index_rebuild(uint64_t slots, uint64_t names_cap) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    size_t new_size;
+    IndexHeader *h = index_create(tmp_path, index_map->root, slots, names_cap, &new_size);
+    if (!h) return -1;
+    h->generation = index_map->generation;
+
+    IndexEntry *old = INDEX_ENTRIES(index_map), *e = INDEX_ENTRIES(h);
+    for (uint64_t i = 0; i < index_map->slots; i++) {
+        if (old[i].key <= INDEX_TOMBSTONE) continue;
+        uint64_t slot = index_probe(h, old[i].key);
+        e[slot] = old[i];
+        e[slot].first_child = e[slot].next_sibling = 0;
+        // Przepisujemy nazwę do nowej sterty
+        const char *name = INDEX_NAMES(index_map) + old[i].name;
+        size_t len = strlen(name) + 1;
+        e[slot].name = h->names_used;
+        memcpy(INDEX_NAMES(h) + h->names_used, name, len);
+        h->names_used += len;
+        h->used++;
+    }
+    for (uint64_t i = 0; i < h->slots; i++)
+        if (e[i].key > INDEX_TOMBSTONE) index_link(h, i);
+
+    // Podmieniamy plik atomowo - po awarii zostaje stary albo nowy indeks
+    if (rename(tmp_path, index_path) == -1) {
+        munmap(h, new_size);
+        unlink(tmp_path);
+        return -1;
+    }
+    munmap(index_map, index_map_size);
+    index_map = h;
+    index_map_size = new_size;
+    return 0;
+}
+
+// Funkcja zwracająca wpis o danym kluczu, tworząca go w razie potrzeby
+// Zwracany wskaźnik jest ważny do następnego wywołania index_put (przebudowa zmienia mapowanie)
+IndexEntry *index_put(uint64_t key, uint64_t parent, const char *name) {
+    IndexEntry *e = index_get(key);
+    if (e) return e;
+
+    // Zapewniamy miejsce: zapełnienie tablicy do 70% i miejsce na nazwę w stercie
+    size_t len = strlen(name) + 1;
+    uint64_t slots = index_map->slots, names_cap = index_map->names_cap;
+    if ((index_map->used + 1) * 10 > slots * 7) slots *= 2;
+    while (index_map->names_used + len > names_cap) names_cap *= 2;
+    if ((slots != index_map->slots || names_cap != index_map->names_cap) &&
+        index_rebuild(slots, names_cap) == -1)
+        return NULL;
+
+    uint64_t slot = index_probe(index_map, key);
+    e = &INDEX_ENTRIES(index_map)[slot];
+    if (e->key == INDEX_EMPTY) index_map->used++;
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    e->parent = parent;
+    e->name = index_map->names_used;
+    memcpy(INDEX_NAMES(index_map) + index_map->names_used, name, len);
+    index_map->names_used += len;
+    index_link(index_map, slot);
+    return e;
+}
+
+// Funkcja usuwająca wpis z indeksu wraz ze wszystkimi jego potomkami
+// (nazwa zostaje w stercie do najbliższej przebudowy)
+void index_forget(uint64_t key) {
+    IndexEntry *entries = INDEX_ENTRIES(index_map);
+    IndexEntry *e = index_get(key);
+    if (!e) return;
+
+    // Odłączamy wpis od listy dzieci katalogu nadrzędnego
+    IndexEntry *p = e->parent ? index_get(e->parent) : NULL;
+    if (p) {
+        uint32_t *link = &p->first_child;
+        while (*link && &entries[*link - 1] != e) link = &entries[*link - 1].next_sibling;
+        if (*link) *link = e->next_sibling;
+    }
+
+    // Usuwamy potomków (bez odłączania ich od listy - znika ona razem z tym wpisem)
+    for (uint32_t c = e->first_child; c; ) {
+        uint32_t next = entries[c - 1].next_sibling;
+        entries[c - 1].parent = 0;
+        index_forget(entries[c - 1].key);
+        c = next;
+    }
+    e->key = INDEX_TOMBSTONE;
+}
+
+// Funkcja otwierająca (lub tworząca) indeks dla pary katalogów
+void index_open(const char *src, const char *dst) {
+    // Skrót pary katalogów - indeks utworzony dla innej pary nie może zostać użyty
+    char pair[8192];
+    snprintf(pair, sizeof(pair), "%s\n%s", src, dst);
+    uint64_t root = path_key(pair);
+
+    int fd = open(index_path, O_RDWR | O_CLOEXEC);
+    Stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(IndexHeader)) {
+        IndexHeader *h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (h != MAP_FAILED && h->magic == INDEX_MAGIC && h->version == INDEX_VERSION && h->root == root &&
+            sizeof(IndexHeader) + h->slots * sizeof(IndexEntry) + h->names_cap == (size_t)st.st_size) {
+            close(fd);
+            index_map = h;
+            index_map_size = st.st_size;
+            syslog(LOG_INFO, "Wczytano indeks %s (%llu wpisów)", index_path, (unsigned long long)h->used);
+            return;
+        }
+        if (h != MAP_FAILED) munmap(h, st.st_size);
+    }
+    if (fd != -1) close(fd);
+
+    // Brak indeksu lub niezgodny - zaczynamy od pustego
+    index_map = index_create(index_path, root, 4096, 64 * 1024, &index_map_size);
+    if (!index_map)
+        syslog(LOG_WARNING, "Nie można utworzyć indeksu %s: %s - indeks wyłączony", index_path, strerror(errno));
+}
+
+// Funkcja rozpoczynająca nowy przebieg synchronizacji (nowy numer generacji)
+void index_begin_pass(void) {
+    if (!index_map) return;
+    pthread_mutex_lock(&index_lock);
+    index_map->generation++;
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Funkcja kończąca przebieg - zlecamy zapis zmienionych stron indeksu na dysk
+void index_end_pass(void) {
+    if (!index_map) return;
+    pthread_mutex_lock(&index_lock);
+    msync(index_map, index_map_size, MS_ASYNC);
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Funkcja sprawdzająca, czy plik źródłowy nie zmienił się od ostatniej synchronizacji
+// Zwraca 1, jeśli rozmiar, mtime i i-węzeł zgadzają się z indeksem (wtedy oznacza wpis jako widziany)
+int index_file_unchanged(const char *path, const Stat *st) {
+    if (!index_map) return 0;
+    int unchanged = 0;
+    pthread_mutex_lock(&index_lock);
+    IndexEntry *e = index_get(path_key(path));
+    if (e && !(e->flags & INDEX_DIR) && e->size == (uint64_t)st->st_size &&
+        e->mtime_ns == stat_mtime_ns(st) && e->ctime_ns == stat_ctime_ns(st) && e->ino == (uint64_t)st->st_ino) {
+        e->gen = index_map->generation;
+        unchanged = 1;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return unchanged;
+}
+
+// Funkcja zapisująca w indeksie metadane zsynchronizowanego pliku lub katalogu
+// Dla katalogów mtime zapisuje dopiero index_dir_done (po przejściu całej zawartości)
+void index_record(const char *path, const Stat *st) {
+    if (!index_map) return;
+    const char *slash = strrchr(path, '/');
+    pthread_mutex_lock(&index_lock);
+    IndexEntry *e = index_put(path_key(path), parent_key(path), slash ? slash + 1 : path);
+    if (e) {
+        e->gen = index_map->generation;
+        e->ino = st->st_ino;
+        if (S_ISDIR(st->st_mode)) {
+            e->flags |= INDEX_DIR;
+        } else {
+            e->flags &= ~INDEX_DIR;
+            e->size = st->st_size;
+            e->mtime_ns = stat_mtime_ns(st);
+            e->ctime_ns = stat_ctime_ns(st);
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Funkcja usuwająca ścieżkę (i jej potomków) z indeksu
+void index_remove(const char *path) {
+    if (!index_map) return;
+    pthread_mutex_lock(&index_lock);
+    index_forget(path_key(path));
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Funkcja określająca, czy lista nazw katalogu mogła się zmienić od ostatniego przebiegu
+// (DIR_NEW, DIR_CHANGED lub DIR_UNCHANGED); rejestruje katalog w indeksie
+int index_dir_state(const char *path, const Stat *st) {
+    if (!index_map) return DIR_NEW;
+    const char *slash = strrchr(path, '/');
+    int state;
+    pthread_mutex_lock(&index_lock);
+    IndexEntry *e = index_get(path_key(path));
+    if (!e || !(e->flags & INDEX_DIR_DONE))
+        state = DIR_NEW;
+    else if (e->mtime_ns != stat_mtime_ns(st) || e->ino != (uint64_t)st->st_ino)
+        state = DIR_CHANGED;
+    else
+        state = DIR_UNCHANGED;
+    e = index_put(path_key(path), parent_key(path), slash ? slash + 1 : path);
+    if (e) {
+        e->flags |= INDEX_DIR;
+        e->gen = index_map->generation;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return state;
+}
+
+// Funkcja zapisująca mtime katalogu po zakończeniu jego synchronizacji
+void index_dir_done(const char *path, const Stat *st) {
+    if (!index_map) return;
+    pthread_mutex_lock(&index_lock);
+    IndexEntry *e = index_get(path_key(path));
+    if (e) {
+        e->mtime_ns = stat_mtime_ns(st);
+        e->ino = st->st_ino;
+        e->flags |= INDEX_DIR | INDEX_DIR_DONE;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Funkcja usuwająca z katalogu docelowego wpisy, których nie widziano w źródle w bieżącym przebiegu
+// (dzieci katalogu w indeksie ze starszą generacją)
+// Zwraca 0 w przypadku powodzenia, -1, jeśli zabrakło pamięci na listę nazw (nic nie usuwamy)
+int index_remove_stale(DirJob *job) {
+    const char **names = NULL;
+    size_t count = 0, cap = 0;
+
+    // Zbieramy nazwy pod blokadą, a usuwamy pliki już bez niej
+    pthread_mutex_lock(&index_lock);
+    IndexEntry *entries = INDEX_ENTRIES(index_map), *dir = index_get(path_key(job->src));
+    for (uint32_t c = dir ? dir->first_child : 0; c; c = entries[c - 1].next_sibling) {
+        if (entries[c - 1].gen == index_map->generation) continue;
+        if (count == cap) {
+            size_t new_cap = cap ? cap * 2 : 16;
+            const char **tmp = realloc(names, new_cap * sizeof(char *));
+            if (!tmp) {
+                pthread_mutex_unlock(&index_lock);
+                syslog(LOG_ERR, "Brak pamięci na listę usuniętych wpisów katalogu %s", job->src);
+                free(names);
+                return -1;
+            }
+            names = tmp;
+            cap = new_cap;
+        }
+        names[count++] = arena_strdup(&job->arena, INDEX_NAMES(index_map) + entries[c - 1].name);
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        Stat st;
+        // Ostrożnie: usuwamy tylko, jeśli wpisu rzeczywiście nie ma w źródle
+        if (fstatat(job->src_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT) {
+            remove_entry(job->dst_fd, names[i], DT_UNKNOWN, arena_join(&job->arena, job->dst, names[i]));
+            index_remove(arena_join(&job->arena, job->src, names[i]));
+        }
+    }
+    free(names);
+    return 0;
+}
+
+// Funkcja sprawdzająca, czy metadane celu (poza czasami) różnią się od źródła
+// Uprawnienia i właściciela porównujemy z wyników stat. Atrybuty rozszerzone czytamy tylko wtedy,
+// gdy i-węzeł źródła zmienił się (ctime) później niż cel - każda zmiana metadanych celu ustawia jego
+// ctime, więc po przeniesieniu atrybutów kolejne cykle już ich nie czytają.
+// src_fd, dst_fd - katalogi, w których leży wpis name (lub sam wpis, gdy name == NULL)
+int metadata_differs(int src_fd, int dst_fd, const char *name, const Stat *src, const Stat *dst) {
+    if ((src->st_mode & 07777) != (dst->st_mode & 07777)) return 1;
+    if (owner_mode && (src->st_uid != dst->st_uid || src->st_gid != dst->st_gid)) return 1;
+    if (stat_ctime_ns(src) <= stat_ctime_ns(dst)) return 0;
+    int flags = O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC;
+    int src_file = name ? openat(src_fd, name, flags) : src_fd, dst_file = name ? openat(dst_fd, name, flags) : dst_fd;
+    int differ = src_file != -1 && dst_file != -1 && xattr_sync(src_file, dst_file, 0);
+    if (name && src_file != -1) close(src_file);
+    if (name && dst_file != -1) close(dst_file);
+    return differ;
+}
+
+// Funkcja przenosząca metadane katalogu src_fd (stan st) na katalog dst_fd, jeśli się różnią
+void preserve_dir_metadata(int src_fd, int dst_fd, const Stat *st) {
+    Stat dst_st;
+    if (S_ISDIR(st->st_mode) && fstat(dst_fd, &dst_st) == 0 &&
+        (stat_mtime_ns(st) != stat_mtime_ns(&dst_st) || metadata_differs(src_fd, dst_fd, NULL, st, &dst_st)))
+        preserve_metadata(src_fd, dst_fd, st);
+}
+
+// Funkcja kończąca synchronizację katalogu: usuwa zbędne wpisy z celu, przenosi metadane katalogu
+// i zapisuje stan w indeksie (job->state i job->st pochodzą z początku skanowania)
+void finish_directory(DirJob *job) {
+    if (job->incomplete) return; // Z niepełnej listy źródła nie wiemy, co jest zbędne - ponowi następny cykl
+    if (job->state == DIR_NEW)
+        remove_extraneous_files(job); // Brak historii w indeksie - porównujemy z katalogiem docelowym
+    else if (job->state == DIR_CHANGED && index_remove_stale(job) == -1)
+        return; // Zmieniła się lista nazw, ale nie usunęliśmy zbędnych wpisów - katalog nie jest zakończony
+    // Metadane katalogu dopiero teraz - tworzenie i usuwanie wpisów zmienia jego mtime
+    // (podkatalogi zmieniają tylko własną zawartość, więc nie muszą być już zakończone)
+    preserve_dir_metadata(job->src_fd, job->dst_fd, &job->st);
+    index_dir_done(job->src, &job->st);
+}
+
+// Porównywanie plików i skróty zawartości (-H)
+// Pliki o różnym rozmiarze kopiujemy od razu, a o tym samym rozmiarze i mtime (w ns) uznajemy
+// za równe. Przypadek niejednoznaczny - ten sam rozmiar, inny mtime (np. po touch lub
+// odtworzeniu z kopii) - w trybie -H rozstrzygamy skrótem XXH64 całej zawartości.
+// Skróty trzymamy w pamięci podręcznej według (urządzenie, i-węzeł) i ważne są tylko dla
+// zapamiętanego rozmiaru i mtime, więc niezmieniony plik nie jest czytany ponownie.
+#define HASH_CACHE_MAX (1 << 20)    // Największa liczba wpisów pamięci podręcznej (po przepełnieniu ją czyścimy)
+
+// Wynik porównania pliku źródłowego z docelowym
+#define FILE_SAME 0     // Cel jest aktualny
+#define FILE_COPY 1     // Zawartość się różni - trzeba skopiować
+#define FILE_META 2     // Zawartość jest taka sama - wystarczy poprawić metadane (czasy, uprawnienia, właściciela, atrybuty)
+
+typedef struct {
+    dev_t dev;          // Urządzenie (0 razem z ino 0 - wolne miejsce)
+    ino_t ino;          // Numer i-węzła
+    off_t size;         // Rozmiar pliku w chwili liczenia skrótu
+    int64_t mtime_ns;   // mtime pliku w chwili liczenia skrótu
+    uint64_t hash;      // Skrót XXH64 zawartości
+} HashCacheEntry;
+
+pthread_mutex_t hash_cache_lock = PTHREAD_MUTEX_INITIALIZER; // Chroni pamięć podręczną (wątki puli)
+HashCacheEntry *hash_cache = NULL;  // Tablica z adresowaniem otwartym (liniowe próbkowanie)
+size_t hash_cache_cap = 0;          // Pojemność tablicy (potęga dwójki)
+size_t hash_cache_used = 0;         // Liczba zajętych miejsc
+
+// Funkcja zwracająca miejsce dla (dev, ino) - zajęte przez ten plik albo pierwsze wolne
+// Wywołujący musi trzymać hash_cache_lock, a tablica musi mieć wolne miejsca
+HashCacheEntry *hash_cache_slot(dev_t dev, ino_t ino) {
+    size_t i = (size_t)((ino * 0x9e3779b97f4a7c15ULL) ^ dev) & (hash_cache_cap - 1);
+    while (hash_cache[i].ino || hash_cache[i].dev) {
+        if (hash_cache[i].ino == ino && hash_cache[i].dev == dev) break;
+        i = (i + 1) & (hash_cache_cap - 1);
+    }
+    return &hash_cache[i];
+}
+
+// Funkcja szukająca skrótu pliku st w pamięci podręcznej
+// Zwraca 1 i skrót w out, jeśli zapamiętany skrót dotyczy tego samego rozmiaru i mtime
+int hash_cache_get(const Stat *st, uint64_t *out) {
+    int found = 0;
+    pthread_mutex_lock(&hash_cache_lock);
+    if (hash_cache) {
+        HashCacheEntry *e = hash_cache_slot(st->st_dev, st->st_ino);
+        if (e->ino && e->size == st->st_size && e->mtime_ns == stat_mtime_ns(st)) {
+            *out = e->hash;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+    return found;
+}
+
+// Funkcja zapisująca skrót pliku st w pamięci podręcznej (zastępuje nieaktualny wpis tego i-węzła)
+void hash_cache_put(const Stat *st, uint64_t hash) {
+    pthread_mutex_lock(&hash_cache_lock);
+    // Utrzymujemy zapełnienie poniżej 50% - powiększamy tablicę albo (po osiągnięciu limitu) czyścimy ją
+    if (2 * (hash_cache_used + 1) > hash_cache_cap) {
+        size_t cap = hash_cache_cap ? hash_cache_cap * 2 : 4096;
+        HashCacheEntry *old = hash_cache;
+        size_t old_cap = hash_cache_cap;
+        if (cap > 2 * HASH_CACHE_MAX) {
+            cap = hash_cache_cap;
+            old_cap = 0; // Nie przenosimy starych wpisów
+        }
+        hash_cache = calloc(cap, sizeof(HashCacheEntry));
+        hash_cache_cap = cap;
+        hash_cache_used = 0;
+        for (size_t i = 0; hash_cache && i < old_cap; i++) {
+            if (!old[i].ino && !old[i].dev) continue;
+            *hash_cache_slot(old[i].dev, old[i].ino) = old[i];
+            hash_cache_used++;
+        }
+        free(old);
+    }
+    if (hash_cache) {
+        HashCacheEntry *e = hash_cache_slot(st->st_dev, st->st_ino);
+        if (!e->ino && !e->dev) hash_cache_used++;
+        e->dev = st->st_dev;
+        e->ino = st->st_ino;
+        e->size = st->st_size;
+        e->mtime_ns = stat_mtime_ns(st);
+        e->hash = hash;
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+}
+
+// Funkcja obliczająca (lub biorąca z pamięci podręcznej) skrót zawartości pliku name w katalogu dfd
+// st - metadane pliku; jeśli plik zmienił się od ich pobrania, skrót nie jest obliczany
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int content_hash(int dfd, const char *name, const Stat *st, uint64_t *out) {
+    if (hash_cache_get(st, out)) {
+        atomic_fetch_add(&hash_cache_hits, 1);
+        return 0;
+    }
+
+    int fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return -1;
+    Stat now;
+    if (fstat(fd, &now) == -1 || now.st_ino != st->st_ino || now.st_size != st->st_size ||
+        stat_mtime_ns(&now) != stat_mtime_ns(st)) {
+        close(fd);
+        return -1;
+    }
+    if (st->st_size == 0) {
+        *out = xxh64(NULL, 0, 0);
+    } else {
+        void *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(data, st->st_size, MADV_SEQUENTIAL);
+        long long start = now_ns();
+        *out = xxh64(data, st->st_size, 0);
+        munmap(data, st->st_size);
+        // Skrót liczymy jednym wywołaniem, więc limit tempa egzekwujemy po całym pliku
+        throttle_bytes(st->st_size, now_ns() - start);
+        if (nice_mode) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+
+    atomic_fetch_add(&files_hashed, 1);
+    hash_cache_put(st, *out);
+    return 0;
+}
+
+// Funkcja porównująca plik name w źródle (dir->src_fd) z plikiem w celu (dir->dst_fd)
+// Zwraca FILE_SAME, FILE_COPY lub FILE_META
+int compare_files(DirJob *dir, const char *name, const Stat *src, const Stat *dst) {
+    if (!S_ISREG(dst->st_mode) || src->st_size != dst->st_size) return FILE_COPY;
+    if (stat_mtime_ns(src) == stat_mtime_ns(dst))
+        return metadata_differs(dir->src_fd, dir->dst_fd, name, src, dst) ? FILE_META : FILE_SAME;
+    if (!hash_mode) return FILE_COPY;
+
+    // Ten sam rozmiar, inny mtime - porównujemy zawartość
+    uint64_t src_hash, dst_hash;
+    if (content_hash(dir->src_fd, name, src, &src_hash) == -1 ||
+        content_hash(dir->dst_fd, name, dst, &dst_hash) == -1)
+        return FILE_COPY;
+    return src_hash == dst_hash ? FILE_META : FILE_COPY;
+}
+
+// Pula wątków roboczych (-j N)
+// Każdy wątek ma własną kolejkę dwustronną (deque): nowe zadania dokłada i pobiera
+// z jej końca, a bezczynne wątki "kradną" najstarsze zadania z początku cudzych kolejek.
+// Zadania to skanowanie katalogu albo skopiowanie pojedynczego pliku.
+
+// Zadanie dla puli wątków
+typedef struct {
+    DirJob *dir;            // Katalog pliku (kopiowanie) lub katalog nadrzędny (skanowanie; NULL dla korzenia)
+    const char *name;       // Nazwa wpisu w katalogu dir
+    const char *src, *dst;  // Pełne ścieżki źródła i celu (w arenie katalogu dir)
+    Stat st;                // Informacje o pliku źródłowym (tylko dla kopiowania)
+    int copy;               // 1 - kopiowanie pliku, 0 - skanowanie katalogu
+} Task;
+
+// Kolejka dwustronna zadań jednego wątku
+typedef struct {
+    pthread_mutex_t lock;   // Chroni kolejkę (właściciel i złodzieje)
+    Task **items;           // Bufor zadań
+    size_t head, tail, cap; // Początek (kradzież), koniec (właściciel) i pojemność bufora
+} Deque;
+
+Deque *deques = NULL;               // Kolejki wątków roboczych (jobs elementów)
+pthread_t *workers = NULL;          // Wątki robocze (uruchamiane przy pierwszej synchronizacji)
+atomic_long queued_tasks = 0;       // Liczba zadań czekających w kolejkach
+atomic_long outstanding_tasks = 0;  // Liczba zadań zleconych, ale jeszcze niezakończonych
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // Chroni oczekiwanie na zmiennych warunkowych
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;   // Sygnalizuje pojawienie się nowego zadania
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;   // Sygnalizuje zakończenie wszystkich zadań
+__thread int worker_id = 0;         // Numer kolejki bieżącego wątku (wątek główny korzysta z kolejki 0)
+
+void sync_directories(const char *src, const char *dst);
+void scan_directory(DirJob *job);
+int submit_task(int copy, DirJob *dir, const char *name, const char *src, const char *dst, const Stat *st);
+void run_task(Task *t);
+
+// Funkcja kopiująca plik i zapisująca jego metadane w indeksie po udanym kopiowaniu
+void sync_file(const PathAt *src, const PathAt *dst, const Stat *src_stat) {
+    if (copy_file(src, dst, src_stat) == 0) {
+        atomic_fetch_add(&files_copied, 1);
+        atomic_fetch_add(&bytes_copied, src_stat->st_size);
+        index_record(src->path, src_stat);
+    }
+}
+
+// Asynchroniczne wejście/wyjście przez io_uring (-U)
+// Każdy wątek ma własny pierścień io_uring (bez liburing - bezpośrednio przez wywołania systemowe).
+// Wykorzystujemy go do:
+//  - hurtowego pobierania metadanych (statx) wszystkich wpisów katalogu w źródle i w celu,
+//  - kopiowania małych plików partiami: dla każdego pliku łańcuch openat -> openat -> read -> write
+//    -> close -> close, z plikami otwieranymi bezpośrednio w tablicy stałych deskryptorów (fixed files)
+//    i danymi w zarejestrowanych buforach (READ_FIXED/WRITE_FIXED).
+// Jeśli jądro nie obsługuje io_uring (lub blokuje go seccomp), wracamy do zwykłych wywołań systemowych.
+
+#define URING_ENTRIES 256           // Rozmiar kolejki zgłoszeń pierścienia
+#define URING_BATCH 32              // Liczba małych plików kopiowanych w jednej partii
+#define URING_BUF_SIZE (64 * 1024)  // Rozmiar zarejestrowanego bufora (= maksymalny rozmiar "małego" pliku)
+
+// Wpis katalogu z pobranymi z wyprzedzeniem metadanymi źródła i celu
+typedef struct {
+    Stat src, dst;                  // Metadane wpisu w źródle i w celu
+    int src_err, dst_err;           // Kod błędu (0 - metadane poprawne)
+} EntryStat;
+
+// Plik oczekujący na skopiowanie w partii (nazwy i ścieżki w arenie jego katalogu)
+typedef struct {
+    PathAt src, dst;                // Plik źródłowy i docelowy
+    Stat st;                        // Metadane pliku źródłowego
+    char tmp[64];                   // Nazwa pliku tymczasowego w katalogu celu (podmienianego po zapisie)
+} BatchFile;
+
+// Pierścień io_uring jednego wątku
+typedef struct {
+    int state;                      // 0 - nieutworzony, 1 - gotowy, -1 - niedostępny
+    int fd;                         // Deskryptor pierścienia
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries, to_submit; // Pojemność kolejki i liczba przygotowanych zgłoszeń
+    struct io_uring_sqe *sqes;      // Tablica zgłoszeń
+    struct io_uring_cqe *cqes;      // Tablica zakończeń
+    char *bufs;                     // Zarejestrowane bufory (URING_BATCH x URING_BUF_SIZE)
+    int batching;                   // Czy scan_directory zbiera obecnie małe pliki do partii
+    BatchFile batch[URING_BATCH];   // Partia małych plików
+    int batch_count;
+} Ring;
+
+int uring_mode = 0;                 // Flaga (0 lub 1), czy używamy io_uring
+__thread Ring ring;                 // Pierścień bieżącego wątku
+
+// Funkcja tworząca pierścień io_uring bieżącego wątku
+// Zwraca 1, jeśli pierścień jest gotowy do użycia
+int uring_init(void) {
+    if (ring.state) return ring.state == 1;
+    ring.state = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd == -1) {
+        syslog(LOG_WARNING, "io_uring niedostępne (%s) - zwykłe wywołania systemowe", strerror(errno));
+        return 0;
+    }
+
+    // Mapujemy kolejkę zgłoszeń, kolejkę zakończeń i tablicę zgłoszeń
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size) sq_size = cq_size;
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return 0;
+    }
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sq_entries = p.sq_entries;
+
+    // Rejestrujemy bufory danych i pustą tablicę stałych deskryptorów (po dwa na plik w partii)
+    ring.bufs = mmap(NULL, URING_BATCH * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec iov[URING_BATCH];
+    int files[2 * URING_BATCH];
+    for (int i = 0; i < URING_BATCH; i++) {
+        iov[i].iov_base = ring.bufs + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    for (int i = 0; i < 2 * URING_BATCH; i++) files[i] = -1;
+    if (ring.bufs == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, URING_BATCH) == -1 ||
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2 * URING_BATCH) == -1) {
+        syslog(LOG_WARNING, "Nie można zarejestrować buforów io_uring: %s", strerror(errno));
+        close(ring.fd);
+        return 0;
+    }
+
+    ring.state = 1;
+    return 1;
+}
+
+// Funkcja zwracająca wolne zgłoszenie (wyzerowane) albo NULL, gdy kolejka jest pełna
+struct io_uring_sqe *uring_sqe(void) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring.sq_head, memory_order_acquire);
+    unsigned tail = *ring.sq_tail + ring.to_submit;
+    if (tail - head >= ring.sq_entries) return NULL;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.to_submit++;
+    return sqe;
+}
+
+// Funkcja przekazująca przygotowane zgłoszenia do jądra i czekająca na wait_nr zakończeń
+int uring_submit(unsigned wait_nr) {
+    atomic_store_explicit((_Atomic unsigned *)ring.sq_tail, *ring.sq_tail + ring.to_submit, memory_order_release);
+    unsigned n = ring.to_submit;
+    ring.to_submit = 0;
+    while (1) {
+        int r = syscall(__NR_io_uring_enter, ring.fd, n, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r >= 0 || errno != EINTR) return r;
+        n = 0; // Zgłoszenia zostały już przyjęte - czekamy tylko na zakończenia
+    }
+}
+
+// Funkcja sprawdzająca, czy w kolejce jest miejsce na n zgłoszeń (wtedy kolejne n wywołań uring_sqe
+// nie zwróci NULL). Przy pełnej kolejce przekazuje przygotowane zgłoszenia jądru (io_uring_enter
+// bez SQPOLL pobiera je od razu) i sprawdza ponownie; zakończenia odbiera potem wywołujący.
+// Zwraca 1, jeśli jest miejsce, 0 - jeśli nie (wywołujący wraca do zwykłych wywołań systemowych)
+int uring_room(unsigned n) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        unsigned head = atomic_load_explicit((_Atomic unsigned *)ring.sq_head, memory_order_acquire);
+        if (*ring.sq_tail + ring.to_submit - head + n <= ring.sq_entries) return 1;
+        if (!ring.to_submit || uring_submit(0) < 0) return 0;
+    }
+    return 0;
+}
+
+// Funkcja odbierająca jedno zakończenie (zwraca 0, jeśli żadne nie czeka)
+int uring_reap(uint64_t *user_data, int *res) {
+    unsigned head = *ring.cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)ring.cq_tail, memory_order_acquire)) return 0;
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Konwersja wyniku statx na struct stat
+void statx_to_stat(const struct statx *x, Stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_ino = x->stx_ino;
+    st->st_mode = x->stx_mode;
+    st->st_nlink = x->stx_nlink;
+    st->st_uid = x->stx_uid;
+    st->st_gid = x->stx_gid;
+    st->st_size = x->stx_size;
+    st->st_blksize = x->stx_blksize;
+    st->st_blocks = x->stx_blocks;
+    st->st_atim.tv_sec = x->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = x->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+// Funkcja pobierająca hurtowo metadane wpisów entries[0..count) w katalogach src_fd i dst_fd
+// Wyniki trafiają do out; zwraca 0 w przypadku powodzenia, -1 gdy trzeba użyć zwykłego fstatat
+int uring_stat_batch(int src_fd, int dst_fd, const DirEntry *entries, size_t count, EntryStat *out) {
+    struct statx *bufs = malloc(2 * count * sizeof(struct statx));
+    if (!bufs) return -1;
+
+    size_t next = 0, done = 0;
+    while (done < count) {
+        // Wypełniamy kolejkę parami zgłoszeń statx (źródło i cel)
+        // (najwyżej sq_entries naraz, więc zakończenia zmieszczą się w kolejce zakończeń)
+        size_t inflight = 0;
+        while (next < count && inflight + 2 <= ring.sq_entries && uring_room(2)) {
+            for (int side = 0; side < 2; side++) {
+                struct io_uring_sqe *sqe = uring_sqe(); // Miejsce sprawdziło uring_room
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = side ? dst_fd : src_fd;
+                sqe->addr = (uint64_t)(uintptr_t)entries[next].name;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+                sqe->off = (uint64_t)(uintptr_t)&bufs[2 * next + side];
+                sqe->user_data = 2 * next + side;
+            }
+            next++;
+            inflight += 2;
+        }
+        if (!inflight || uring_submit(inflight) < 0) {
+            free(bufs);
+            return -1;
+        }
+
+        uint64_t id;
+        int res;
+        while (inflight > 0 && uring_reap(&id, &res)) {
+            EntryStat *e = &out[id / 2];
+            if (id % 2 == 0) {
+                e->src_err = res < 0 ? -res : 0;
+                if (!e->src_err) statx_to_stat(&bufs[id], &e->src);
+            } else {
+                e->dst_err = res < 0 ? -res : 0;
+                if (!e->dst_err) statx_to_stat(&bufs[id], &e->dst);
+            }
+            inflight--;
+        }
+        done = next;
+    }
+    free(bufs);
+    return 0;
+}
+
+// Funkcja kopiująca wszystkie pliki z partii bieżącego wątku
+// Pliki, których nie udało się skopiować przez io_uring (lub nie zmieściły się w kolejce zgłoszeń),
+// kopiujemy zwykłą ścieżką (copy_file)
+void uring_flush_batch(void) {
+    int count = ring.batch_count;
+    if (!count) return;
+    ring.batch_count = 0;
+
+    long long start = now_ns();
+    int copied[URING_BATCH] = {0};
+    int queued = 0; // Pliki, których łańcuchy zgłoszeń trafiły do kolejki
+    for (int i = 0; i < count; i++)
+        ring.batch[i].tmp[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        BatchFile *f = &ring.batch[i];
+        unsigned src_slot = 2 * i, dst_slot = 2 * i + 1;
+        struct io_uring_sqe *sqe;
+
+        // Łańcuch 6 powiązanych zgłoszeń musi trafić do kolejki w całości (uring_sqe nie zwróci NULL)
+        if (!uring_room(6)) break;
+        queued++;
+
+        // openat źródła bezpośrednio do slotu src_slot tablicy stałych deskryptorów
+        // (O_NOFOLLOW - źródło mogło zostać podmienione na link symboliczny po skanowaniu)
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = f->src.dfd;
+        sqe->addr = (uint64_t)(uintptr_t)f->src.name;
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+        sqe->file_index = src_slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = UINT64_MAX;
+
+        // openat nowego pliku tymczasowego w katalogu celu do slotu dst_slot
+        // (O_TMPFILE nie da się tu użyć - plik w stałym slocie nie ma deskryptora dla linkat)
+        temp_name(f->tmp, sizeof(f->tmp));
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = f->dst.dfd;
+        sqe->addr = (uint64_t)(uintptr_t)f->tmp;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+        sqe->len = 0600;
+        sqe->file_index = dst_slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = UINT64_MAX;
+
+        // Odczyt całego pliku do zarejestrowanego bufora i-tego pliku
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = src_slot;
+        sqe->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)i * URING_BUF_SIZE);
+        sqe->len = f->st.st_size;
+        sqe->buf_index = i;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = UINT64_MAX;
+
+        // Zapis bufora do celu; zamknięcia wykonujemy nawet po błędzie (twarde powiązanie)
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = dst_slot;
+        sqe->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)i * URING_BUF_SIZE);
+        sqe->len = f->st.st_size;
+        sqe->buf_index = i;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->user_data = i;
+
+        for (unsigned slot = src_slot; slot <= dst_slot; slot++) {
+            sqe = uring_sqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot + 1;
+            sqe->flags = slot == src_slot ? IOSQE_IO_HARDLINK : 0;
+            sqe->user_data = UINT64_MAX;
+        }
+    }
+
+    // Czekamy na wszystkie zakończenia (6 na plik) - interesuje nas tylko wynik zapisu
+    int pending = 6 * queued;
+    if (queued && uring_submit(pending) >= 0) {
+        uint64_t id;
+        int res;
+        while (pending > 0) {
+            if (!uring_reap(&id, &res)) {
+                if (uring_submit(1) < 0) break;
+                continue;
+            }
+            if (id != UINT64_MAX && res == ring.batch[id].st.st_size) copied[id] = 1;
+            pending--;
+        }
+    }
+
+    // Czas partii rozkładamy w metrykach równo na jej pliki
+    long long elapsed = now_ns() - start, per_file = elapsed / count, batch_bytes = 0;
+    for (int i = 0; i < count; i++)
+        if (copied[i]) batch_bytes += ring.batch[i].st.st_size;
+    throttle_bytes(batch_bytes, elapsed);
+    for (int i = 0; i < count; i++) {
+        BatchFile *f = &ring.batch[i];
+        // Zapisany plik tymczasowy dostaje metadane źródła i atomowo zastępuje cel
+        if (copied[i]) {
+            preserve_metadata_at(f->src.dfd, f->src.name, f->dst.dfd, f->tmp, &f->st);
+            if (renameat(f->dst.dfd, f->tmp, f->dst.dfd, f->dst.name) == -1) copied[i] = 0;
+        }
+        if (copied[i]) {
+            metrics_copy(STRATEGY_URING, f->st.st_size, per_file);
+            log_file("Skopiowano plik (io_uring): %s -> %s", f->src.path, f->dst.path);
+            atomic_fetch_add(&files_copied, 1);
+            atomic_fetch_add(&bytes_copied, f->st.st_size);
+            index_record(f->src.path, &f->st);
+        } else {
+            if (f->tmp[0]) unlinkat(f->dst.dfd, f->tmp, 0); // Niepełny plik tymczasowy (jeśli powstał)
+            sync_file(&f->src, &f->dst, &f->st); // Zwykła ścieżka kopiowania
+        }
+    }
+}
+
+// Funkcja dodająca mały plik do partii kopiowania bieżącego wątku
+// Zwraca 1, jeśli plik został przyjęty (skopiujemy go przy opróżnianiu partii)
+// (katalogi src->dfd i dst->dfd muszą pozostać otwarte do opróżnienia partii)
+int uring_batch_file(const PathAt *src, const PathAt *dst, const Stat *st) {
+    if (!ring.batching || st->st_size > URING_BUF_SIZE) return 0;
+    BatchFile *f = &ring.batch[ring.batch_count++];
+    f->src = *src;
+    f->dst = *dst;
+    f->st = *st;
+    if (ring.batch_count == URING_BATCH) uring_flush_batch();
+    return 1;
+}
+
+// Funkcja sprawdzająca, czy kopia pliku name w celu nadal odpowiada źródłu src (rozmiar i mtime w ns)
+// Indeks opisuje tylko źródło - bez tego pliku usuniętego lub zmienionego w celu nie skopiowalibyśmy
+// ponownie, dopóki nie zmieni się źródło (kosztuje jedno fstatat, przy io_uring nic)
+int dest_matches(DirJob *dir, const char *name, const EntryStat *pre, const Stat *src) {
+    Stat dst;
+    if (pre) {
+        if (pre->dst_err) return 0;
+        dst = pre->dst;
+    } else if (fstatat(dir->dst_fd, name, &dst, AT_SYMLINK_NOFOLLOW) == -1) {
+        return 0;
+    }
+    return S_ISREG(dst.st_mode) && dst.st_size == src->st_size && stat_mtime_ns(&dst) == stat_mtime_ns(src);
+}
+
+// Funkcja synchronizująca pojedynczy wpis katalogu źródłowego
+// dir - otwarta para katalogów, w której leży wpis; jeśli synchronizuje ją pula wątków,
+//       podkatalogi i kopie plików zlecamy jako osobne zadania, w przeciwnym razie
+//       wykonujemy je od razu w bieżącym wątku
+// e - wpis katalogu (nazwa i d_type z getdents64)
+// pre - metadane pobrane z wyprzedzeniem (io_uring) albo NULL, jeśli trzeba je pobrać samodzielnie
+// Jeśli wpis zniknął ze źródła, usuwamy go również z katalogu docelowego
+void sync_entry(DirJob *dir, const DirEntry *e, const EntryStat *pre) {
+    // Linki symboliczne i (bez rekurencji) katalogi pomijamy na podstawie d_type, bez stat
+    if (e->type == DT_LNK || (e->type == DT_DIR && !recursive)) return;
+    throttle_op();
+
+    // Pełna ścieżka źródła jest potrzebna indeksowi; ścieżkę celu tworzymy dopiero, gdy trzeba
+    const char *src_path = arena_join(&dir->arena, dir->src, e->name);
+    Stat src_stat, dst_stat;
+    int src_err = 0;
+    // Pobieramy informacje o pliku/katalogu w źródle
+    if (pre) {
+        src_stat = pre->src;
+        src_err = pre->src_err;
+    } else if (fstatat(dir->src_fd, e->name, &src_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+        src_err = errno;
+    }
+    if (src_err) {
+        // Wpisu nie ma już w źródle - usuwamy go z katalogu docelowego
+        if (src_err == ENOENT) {
+            remove_entry(dir->dst_fd, e->name, DT_UNKNOWN, arena_join(&dir->arena, dir->dst, e->name));
+            index_remove(src_path);
+        }
+        return;
+    }
+    // Pomijamy linki symboliczne
+    if (S_ISLNK(src_stat.st_mode)) return;
+
+    // Jeśli wpis jest katalogiem i mamy włączoną rekurencję
+    if (S_ISDIR(src_stat.st_mode)) {
+        if (recursive) {
+            const char *dst_path = arena_join(&dir->arena, dir->dst, e->name);
+            // Tworzymy katalog docelowy, jeśli nie istnieje - z uprawnieniami źródła, ale z prawem
+            // zapisu dla nas do czasu skopiowania zawartości (pełne metadane ustawia finish_directory)
+            // Wpis innego typu (również dowiązanie symboliczne do katalogu) najpierw usuwamy
+            int exists = fstatat(dir->dst_fd, e->name, &dst_stat, AT_SYMLINK_NOFOLLOW) == 0;
+            if (exists && !S_ISDIR(dst_stat.st_mode)) {
+                remove_entry(dir->dst_fd, e->name, DT_UNKNOWN, dst_path);
+                exists = 0;
+            }
+            if (!exists) mkdirat(dir->dst_fd, e->name, (src_stat.st_mode & 07777) | S_IRWXU);
+            // Oznaczamy katalog jako obecny w źródle, zanim katalog nadrzędny zacznie szukać zbędnych wpisów
+            index_record(src_path, &src_stat);
+            // Rekurencyjnie synchronizujemy podkatalogi (w puli - jako osobne zadanie,
+            // które otworzy się względem deskryptorów tego katalogu)
+            if (dir->pooled) {
+                atomic_fetch_add(&dir->pending, 1);
+                if (submit_task(0, dir, e->name, src_path, dst_path, NULL) == -1) {
+                    // Brak pamięci na zadanie - skanujemy podkatalog w bieżącym wątku
+                    Task t = { .dir = dir, .name = e->name, .src = src_path, .dst = dst_path };
+                    run_task(&t);
+                }
+            } else if (jobs > 1) {
+                sync_directories(src_path, dst_path); // Zmiana z inotify - całe nowe poddrzewo w puli
+            } else {
+                // Podkatalog odwiedzi walk_subdirs po zakończeniu tego katalogu (bez rekurencji)
+                names_append(&dir->subdirs, &dir->subdirs_len, &dir->subdirs_cap, e->name);
+            }
+        }
+    }
+    // Jeśli wpis jest plikiem, który według indeksu nie zmienił się od ostatniej synchronizacji,
+    // a jego kopia w celu jest na miejscu - pomijamy go
+    else if (index_file_unchanged(src_path, &src_stat) && dest_matches(dir, e->name, pre, &src_stat)) {
+        atomic_fetch_add(&files_skipped, 1);
+        return;
+    }
+    // Plik: porównujemy go z celem (rozmiar, mtime w ns, w trybie -H również zawartość)
+    else {
+        int result;
+        if (pre) {
+            dst_stat = pre->dst;
+            result = pre->dst_err ? FILE_COPY : compare_files(dir, e->name, &src_stat, &dst_stat);
+        } else if (fstatat(dir->dst_fd, e->name, &dst_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            result = FILE_COPY; // Pliku nie ma w celu
+        } else {
+            result = compare_files(dir, e->name, &src_stat, &dst_stat);
+        }
+
+        if (result == FILE_COPY) {
+            PathAt src = {dir->src_fd, e->name, src_path};
+            PathAt dst = {dir->dst_fd, e->name, arena_join(&dir->arena, dir->dst, e->name)};
+            // Małe pliki kopiujemy partiami przez io_uring
+            if (uring_batch_file(&src, &dst, &src_stat)) return;
+            if (dir->pooled) {
+                atomic_fetch_add(&dir->pending, 1); // Katalog czeka również na tę kopię
+                if (submit_task(1, dir, e->name, src.path, dst.path, &src_stat) == -1) {
+                    atomic_fetch_sub(&dir->pending, 1); // Brak pamięci na zadanie - kopiujemy od razu
+                    sync_file(&src, &dst, &src_stat);
+                }
+            } else {
+                sync_file(&src, &dst, &src_stat);
+            }
+            return;
+        }
+        // Zawartość w celu jest aktualna - ewentualnie poprawiamy tylko metadane
+        if (result == FILE_META) {
+            preserve_metadata_at(dir->src_fd, e->name, dir->dst_fd, e->name, &src_stat);
+            atomic_fetch_add(&files_touched, 1);
+            log_file("Zaktualizowano metadane: %s", arena_join(&dir->arena, dir->dst, e->name));
+        }
+        atomic_fetch_add(&files_skipped, 1);
+        index_record(src_path, &src_stat);
+    }
+}
+
+// Funkcja rejestrująca obserwację inotify dla katalogu źródłowego
+// src - ścieżka do katalogu źródłowego
+// dst - ścieżka do odpowiadającego mu katalogu docelowego
+// inotify zwraca ten sam wd dla tego samego katalogu (i-węzła), więc ponowne
+// wywołanie przy kolejnym pełnym skanowaniu jedynie odświeża zapisane ścieżki
+// Wywołujący musi trzymać watch_lock
+void add_watch_locked(const char *src, const char *dst) {
+    int wd = inotify_add_watch(inotify_fd, src,
+                               IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_ATTRIB |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd == -1) {
+        // Np. ENOSPC po przekroczeniu fs.inotify.max_user_watches - zmiany w tym
+        // katalogu wykryje dopiero okresowe pełne skanowanie
+        syslog(LOG_WARNING, "Nie można obserwować katalogu %s: %s", src, strerror(errno));
+        return;
+    }
+
+    // Szukamy istniejącego wpisu o tym samym wd (katalog mógł zostać przeniesiony)
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            if (strcmp(watches[i].src, src)) {
+                free(watches[i].src);
+                free(watches[i].dst);
+                watches[i].src = strdup(src);
+                watches[i].dst = strdup(dst);
+            }
+            watches[i].pair = current_pair;
+            return;
+        }
+    }
+
+    // Powiększamy tablicę, jeśli jest pełna
+    if (watch_count == watch_cap) {
+        size_t cap = watch_cap ? watch_cap * 2 : 64;
+        Watch *tmp = realloc(watches, cap * sizeof(Watch));
+        if (!tmp) return;
+        watches = tmp;
+        watch_cap = cap;
+    }
+    watches[watch_count].wd = wd;
+    watches[watch_count].src = strdup(src);
+    watches[watch_count].dst = strdup(dst);
+    watches[watch_count].pair = current_pair;
+    watch_count++;
+}
+
+// Funkcja rejestrująca obserwację inotify (z blokadą - katalogi mogą skanować wątki puli)
+void add_watch(const char *src, const char *dst) {
+    pthread_mutex_lock(&watch_lock);
+    add_watch_locked(src, dst);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Funkcja rejestrująca obserwację katalogu rel pary src -> dst (rel == "" - korzeń pary)
+// Dla przebiegów, które przeglądają źródło bez scan_directory (magazyn -S, plan -P)
+void add_watch_rel(const char *src, const char *dst, const char *rel) {
+    char *src_dir, *dst_dir;
+    if (asprintf(&src_dir, "%s%s%s", src, *rel ? "/" : "", rel) == -1) return;
+    if (asprintf(&dst_dir, "%s%s%s", dst, *rel ? "/" : "", rel) == -1) {
+        free(src_dir);
+        return;
+    }
+    add_watch(src_dir, dst_dir);
+    free(src_dir);
+    free(dst_dir);
+}
+
+// Funkcja zwracająca wpis tablicy obserwacji dla danego wd (lub NULL)
+Watch *find_watch(int wd) {
+    for (size_t i = 0; i < watch_count; i++)
+        if (watches[i].wd == wd) return &watches[i];
+    return NULL;
+}
+
+// Funkcja usuwająca wpis z tablicy obserwacji (po zdarzeniu IN_IGNORED,
+// czyli gdy katalog został usunięty lub odmontowany)
+void drop_watch(int wd) {
+    for (size_t i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            free(watches[i].src);
+            free(watches[i].dst);
+            watches[i] = watches[--watch_count]; // Przenosimy ostatni element na zwolnione miejsce
+            return;
+        }
+    }
+}
+
+// Funkcja synchronizująca wpisy katalogu z użyciem io_uring
+// Metadane źródła i celu pobieramy jedną partią zgłoszeń statx,
+// a małe pliki do skopiowania zbieramy w partie (uring_batch_file)
+void scan_directory_uring(DirJob *job) {
+    EntryStat *stats = calloc(job->count ? job->count : 1, sizeof(EntryStat));
+    int have_stats = uring_stat_batch(job->src_fd, job->dst_fd, job->entries, job->count, stats) == 0;
+
+    // Zbieramy małe pliki w partie (zapamiętujemy poprzedni stan - katalogi mogą się zagnieżdżać)
+    int was_batching = ring.batching;
+    ring.batching = 1;
+    for (size_t i = 0; i < job->count; i++)
+        sync_entry(job, &job->entries[i], have_stats ? &stats[i] : NULL);
+    uring_flush_batch();
+    ring.batching = was_batching;
+
+    free(stats);
+}
+
+// Funkcja przeglądająca jeden katalog źródłowy i synchronizująca jego wpisy
+// job - otwarta para katalogów (dir_open); jeśli job->pooled, usunięcie zbędnych wpisów
+// wykona ostatnia zakończona operacja katalogu (dir_job_release)
+void scan_directory(DirJob *job) {
+    // W trybie obserwacji rejestrujemy każdy odwiedzany katalog
+    if (inotify_fd != -1) add_watch(job->src, job->dst);
+
+    // Sprawdzamy w indeksie, czy lista nazw katalogu mogła się zmienić (przed czytaniem wpisów)
+    job->state = DIR_NEW;
+    if (fstat(job->src_fd, &job->st) == 0)
+        job->state = index_dir_state(job->src, &job->st);
+
+    // Czytamy katalog partiami po DIR_BATCH wpisów (zwykle jedna partia), więc katalog z milionami
+    // plików nie trafia do pamięci w całości. Poza pulą po każdej partii cofamy arenę - jej pliki są
+    // już skopiowane, a podkatalogi odłożone; w puli nazwy są potrzebne do zakończenia zadań.
+    ArenaMark mark = arena_mark(&job->arena);
+    do {
+        if (job->wide && !job->pooled) arena_rewind(&job->arena, mark);
+        job->count = read_dir_batch(job->src_fd, &job->arena, &job->entries, DIR_BATCH);
+        if (job->count == READ_DIR_ERROR) {
+            syslog(LOG_ERR, "Nie można przeczytać katalogu %s: %s - pomijamy go w tym cyklu", job->src, strerror(errno));
+            job->incomplete = 1;
+            job->count = 0;
+            break;
+        }
+        if (job->count == DIR_BATCH) job->wide = 1;
+        // stat wykonujemy w kolejności i-węzłów
+        qsort(job->entries, job->count, sizeof(DirEntry), compare_inodes);
+
+        if (uring_mode && uring_init()) {
+            // Tryb io_uring: metadane pobieramy hurtowo i dopiero potem synchronizujemy
+            scan_directory_uring(job);
+        } else {
+            // Przeglądamy wszystkie wpisy w katalogu źródłowym
+            for (size_t i = 0; i < job->count; i++)
+                sync_entry(job, &job->entries[i], NULL);
+        }
+    } while (job->count == DIR_BATCH);
+
+    // Sortujemy wpisy po nazwie - remove_extraneous_files szuka w nich nazw z celu
+    if (!job->wide && !job->incomplete) qsort(job->entries, job->count, sizeof(DirEntry), compare_entries);
+
+    // Usuwamy zbędne pliki/katalogi z katalogu docelowego
+    // (w puli - dopiero po zakończeniu wszystkich kopii, zob. dir_job_release)
+    if (!job->pooled) finish_directory(job);
+}
+
+// Funkcja zwalniająca jedną operację katalogu w puli
+// Ostatnia zakończona operacja usuwa zbędne wpisy z katalogu docelowego,
+// zamyka deskryptory i zwalnia DirJob
+void dir_job_release(DirJob *job) {
+    if (atomic_fetch_sub(&job->pending, 1) != 1) return;
+    finish_directory(job);
+    dir_close(job);
+    free(job);
+}
+
+// Funkcja dokładająca zadanie na koniec kolejki (powiększa bufor w razie potrzeby)
+int deque_push(Deque *q, Task *t) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            // Przesuwamy zadania na początek bufora zamiast go powiększać
+            memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(Task *));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->cap) {
+            size_t cap = q->cap ? q->cap * 2 : 256;
+            Task **items = realloc(q->items, cap * sizeof(Task *));
+            if (!items) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->items = items;
+            q->cap = cap;
+        }
+    }
+    q->items[q->tail++] = t;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Funkcja pobierająca zadanie z kolejki
+// steal == 0 - właściciel bierze najnowsze zadanie z końca (dobra lokalność danych)
+// steal == 1 - inny wątek kradnie najstarsze zadanie z początku (zwykle największy fragment drzewa)
+Task *deque_take(Deque *q, int steal) {
+    Task *t = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        t = steal ? q->items[q->head++] : q->items[--q->tail];
+        if (q->head == q->tail) q->head = q->tail = 0;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+// Funkcja zlecająca zadanie puli wątków
+// copy - 1: skopiowanie pliku name z katalogu dir, 0: skanowanie podkatalogu name katalogu dir
+// (dla korzenia dir == NULL, a name, src i dst to pełne ścieżki)
+// Napisy nie są kopiowane - katalog dir żyje, dopóki zadanie nie zwolni swojej operacji
+// Zwraca 0 w przypadku powodzenia, -1, jeśli zabrakło pamięci (zadanie nie trafiło do kolejki -
+// wywołujący wykonuje je sam w bieżącym wątku)
+int submit_task(int copy, DirJob *dir, const char *name, const char *src, const char *dst, const Stat *st) {
+    Task *t = malloc(sizeof(Task));
+    if (!t) return -1;
+    t->copy = copy;
+    t->dir = dir;
+    t->name = name;
+    t->src = src;
+    t->dst = dst;
+    if (st) t->st = *st;
+
+    atomic_fetch_add(&outstanding_tasks, 1);
+    long depth = atomic_fetch_add(&queued_tasks, 1) + 1;
+    if (deque_push(&deques[worker_id], t) == -1) {
+        atomic_fetch_sub(&queued_tasks, 1);
+        atomic_fetch_sub(&outstanding_tasks, 1);
+        free(t);
+        return -1;
+    }
+
+    // Zapamiętujemy największą głębokość kolejek (metryka queue_depth_max)
+    long max = atomic_load(&queue_depth_max);
+    while (depth > max && !atomic_compare_exchange_weak(&queue_depth_max, &max, depth));
+
+    // Budzimy jeden bezczynny wątek
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+// Funkcja wykonująca zadanie z puli
+void run_task(Task *t) {
+    if (t->copy) {
+        // Kopiowanie pliku należącego do skanowanego katalogu
+        PathAt src = {t->dir->src_fd, t->name, t->src};
+        PathAt dst = {t->dir->dst_fd, t->name, t->dst};
+        sync_file(&src, &dst, &t->st);
+        dir_job_release(t->dir);
+        return;
+    }
+
+    // Skanowanie katalogu - otwieramy go względem deskryptorów katalogu nadrzędnego
+    // (korzeń względem bieżącego katalogu), po czym zwalniamy katalog nadrzędny
+    DirJob *job = malloc(sizeof(DirJob));
+    if (!job) {
+        // Zadanie uznajemy za zakończone (worker_main je odliczy) - katalog pominiemy w tym cyklu
+        syslog(LOG_ERR, "Brak pamięci na skanowanie katalogu %s", t->src);
+        if (t->dir) dir_job_release(t->dir);
+        return;
+    }
+    int parent_src = t->dir ? t->dir->src_fd : AT_FDCWD;
+    int parent_dst = t->dir ? t->dir->dst_fd : AT_FDCWD;
+    int opened = dir_open(job, parent_src, parent_dst, t->name, t->dir ? t->name : t->dst, t->src, t->dst) == 0;
+    if (t->dir) dir_job_release(t->dir);
+    if (!opened) {
+        free(job);
+        return;
+    }
+
+    // Kopie plików i podkatalogi trafiają do kolejki jako nowe zadania
+    job->pooled = 1;
+    atomic_init(&job->pending, 1); // Samo skanowanie też jest operacją katalogu
+    scan_directory(job);
+    dir_job_release(job);
+}
+
+// Główna pętla wątku roboczego
+void *worker_main(void *arg) {
+    worker_id = (int)(long)arg;
+    while (1) {
+        // Najpierw własna kolejka, potem kradzież z kolejek pozostałych wątków
+        Task *t = deque_take(&deques[worker_id], 0);
+        for (int i = 1; !t && i < jobs; i++)
+            t = deque_take(&deques[(worker_id + i) % jobs], 1);
+
+        if (!t) {
+            // Brak pracy - czekamy, aż ktoś zleci nowe zadanie
+            pthread_mutex_lock(&pool_lock);
+            while (atomic_load(&queued_tasks) == 0)
+                pthread_cond_wait(&work_cond, &pool_lock);
+            pthread_mutex_unlock(&pool_lock);
+            continue;
+        }
+        atomic_fetch_sub(&queued_tasks, 1);
+
+        run_task(t);
+        free(t);
+
+        // Ostatnie zakończone zadanie budzi wątek czekający na koniec synchronizacji
+        if (atomic_fetch_sub(&outstanding_tasks, 1) == 1) {
+            pthread_mutex_lock(&pool_lock);
+            pthread_cond_broadcast(&done_cond);
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+    return NULL;
+}
+
+// Funkcja uruchamiająca wątki robocze (tylko przy pierwszym wywołaniu)
+// Wątki uruchamiamy dopiero przy pierwszej synchronizacji (po fork() w daemonize, bo wątki nie przetrwałyby fork)
+// Jeśli nie wszystkie wątki wystartowały, obniżamy jobs do liczby działających (przy jednym lub
+// żadnym - synchronizacja w bieżącym wątku)
+void pool_start(void) {
+    if (workers) return;
+    deques = calloc(jobs, sizeof(Deque));
+    workers = calloc(jobs, sizeof(pthread_t));
+    if (!deques || !workers) {
+        free(deques);
+        free(workers);
+        deques = NULL;
+        workers = NULL; // Spróbujemy ponownie przy następnej synchronizacji
+        return;
+    }
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+    int started = 0;
+    int err = 0;
+    while (started < jobs && (err = pthread_create(&workers[started], NULL, worker_main, (void *)(long)started)) == 0)
+        started++;
+    if (started == jobs) return;
+    syslog(LOG_ERR, "Uruchomiono %d z %d wątków roboczych: %s", started, jobs, strerror(err));
+    jobs = started > 1 ? started : 1;
+}
+
+// Funkcja synchronizująca drzewo katalogów przy użyciu puli wątków
+void pool_sync(const char *src, const char *dst) {
+    pool_start();
+    if (!workers || submit_task(0, NULL, src, src, dst, NULL) == -1) {
+        syslog(LOG_ERR, "Brak pamięci na zadania puli wątków: %s -> %s", src, dst);
+        return;
+    }
+
+    // Czekamy, aż wszystkie zadania (również zlecone przez wątki robocze) się zakończą
+    pthread_mutex_lock(&pool_lock);
+    while (atomic_load(&outstanding_tasks) > 0)
+        pthread_cond_wait(&done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+Walk sync_walk = { .nfd = 2 };      // Stos przejścia w bieżącym wątku (tylko wątek główny)
+
+// Funkcja kładąca na stos sync_walk katalog job, jeśli odłożył podkatalogi
+// (ramka przejmuje deskryptory i nazwy - dir_close ich już nie zamyka)
+void walk_adopt(DirJob *job) {
+    if (!job->subdirs_len) return;
+    WalkFrame *f = walk_push(&sync_walk, job->src_fd, job->dst_fd);
+    job->src_fd = job->dst_fd = -1;
+    if (!f) return;
+    f->src = strdup(job->src);
+    f->dst = strdup(job->dst);
+    f->names = job->subdirs;
+    f->names_len = job->subdirs_len;
+    f->names_cap = job->subdirs_cap;
+    job->subdirs = NULL;
+    job->subdirs_len = job->subdirs_cap = 0;
+}
+
+// Funkcja synchronizująca podkatalogi odłożone w katalogu job (i całe ich poddrzewa) w bieżącym wątku
+// Każdy katalog jest przeglądany w całości (scan_directory), zanim zejdziemy do jego podkatalogów,
+// więc na stosie są tylko deskryptory i nazwy podkatalogów - bez wpisów i ścieżek plików
+void walk_subdirs(DirJob *job) {
+    Walk *w = &sync_walk;
+    walk_adopt(job);
+    while (w->depth) {
+        WalkFrame *f = &w->frames[w->depth - 1];
+        if (f->next == f->names_len) {
+            walk_pop(w);
+            continue;
+        }
+        const char *name = f->names + f->next;
+        f->next += strlen(name) + 1;
+
+        DirJob child;
+        Arena paths = {0};
+        int opened = dir_open(&child, f->fd[0], f->fd[1], name, name, arena_join(&paths, f->src, name),
+                              arena_join(&paths, f->dst, name)) == 0;
+        arena_free(&paths);
+        if (!opened) continue;
+        scan_directory(&child);
+        walk_adopt(&child);
+        dir_close(&child);
+    }
+}
+
+// Funkcja synchronizująca zawartość katalogu źródłowego z docelowym
+// src - ścieżka do katalogu źródłowego
+// dst - ścieżka do katalogu docelowego
+void sync_directories(const char *src, const char *dst) {
+    if (jobs > 1) pool_start(); // Może obniżyć jobs, jeśli nie wystartowały wszystkie wątki
+    if (jobs > 1) {
+        pool_sync(src, dst); // Równoległa synchronizacja w puli wątków
+        return;
+    }
+    // Synchronizacja w bieżącym wątku
+    DirJob job;
+    if (dir_open(&job, AT_FDCWD, AT_FDCWD, src, dst, src, dst) == -1) {
+        syslog(LOG_ERR, "Nie można otworzyć katalogów: %s -> %s: %s", src, dst, strerror(errno));
+        return;
+    }
+    scan_directory(&job);
+    walk_subdirs(&job);
+    dir_close(&job);
+}
+
+// Plan synchronizacji (-n, -P, polecenie "plan")
+// Planista porównuje drzewo źródłowe z docelowym, niczego nie zmieniając, i zapisuje jawną listę
+// operacji (delete, mkdir, meta, copy, delta) z szacowaną liczbą bajtów. Plan można wypisać
+// (próba na sucho) albo wykonać. Po posortowaniu (plan_sort) wykonanie przebiega etapami:
+//  - usunięcia (najpierw zwalniamy miejsce; wpis innego typu w celu znika przed utworzeniem nowego),
+//  - tworzenie katalogów (rodzic przed dzieckiem) i poprawki samych metadanych,
+//  - małe pliki pogrupowane po katalogach - deskryptory katalogu otwieramy raz na grupę,
+//  - duże pliki (od PLAN_SMALL) od największego, każdy strumieniowo w całości,
+//  - na końcu metadane utworzonych i zmienionych katalogów (wcześniej zmieniłyby je kopie).
+// Kopie wykonuje jobs wątków, które biorą kolejne operacje z listy.
+// Ścieżki operacji są względne (względem katalogów pary), więc obowiązuje je limit PATH_MAX.
+#define PLAN_SMALL (1024 * 1024)    // Granica między małymi i dużymi plikami
+
+enum { OP_DELETE, OP_MKDIR, OP_META, OP_COPY, OP_DELTA, OP_TYPES };
+
+const char *const plan_op_names[OP_TYPES] = { "delete", "mkdir", "meta", "copy", "delta" };
+
+typedef struct {
+    int type;               // OP_*
+    unsigned char dtype;    // Typ usuwanego wpisu (d_type, tylko OP_DELETE)
+    const char *path;       // Ścieżka względna (w arenie planu)
+    size_t dir_len;         // Długość części katalogowej ścieżki (0 - korzeń pary)
+    off_t bytes;            // Szacunek: bajty do zapisania (delta: górna granica), przy usuwaniu - zwalniane miejsce
+    Stat st;                // Stan źródła (mkdir, meta, copy, delta)
+} PlanOp;
+
+typedef struct {
+    PlanOp *ops;            // Operacje (po plan_sort w kolejności wykonania)
+    size_t count, cap;
+    Arena arena;            // Ścieżki operacji i katalogów do porównania
+    long counts[OP_TYPES];  // Liczba operacji według typu
+    long long bytes[OP_TYPES]; // Szacowane bajty według typu
+    long scanned;           // Liczba porównanych wpisów źródła
+    int failed;             // Zabrakło pamięci - plan jest niepełny (plan_build zwraca błąd)
+} Plan;
+
+// Funkcja dopisująca operację na wpisie name katalogu rel (rel == "" - korzeń)
+// Zwraca 0 w przypadku powodzenia, -1, jeśli zabrakło pamięci (plan oznaczamy jako niepełny)
+int plan_add(Plan *p, int type, const char *rel, const char *name, const Stat *st, off_t bytes, unsigned char dtype) {
+    if (p->count == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 256;
+        PlanOp *ops = realloc(p->ops, cap * sizeof(PlanOp));
+        if (!ops) {
+            p->failed = 1;
+            return -1;
+        }
+        p->ops = ops;
+        p->cap = cap;
+    }
+    PlanOp *op = &p->ops[p->count++];
+    op->type = type;
+    op->dtype = dtype;
+    op->path = *rel ? arena_join(&p->arena, rel, name) : arena_strdup(&p->arena, name);
+    op->dir_len = strlen(rel);
+    op->bytes = bytes;
+    if (st) op->st = *st;
+    p->counts[type]++;
+    p->bytes[type] += bytes;
+    return 0;
+}
+
+// Funkcja planująca usunięcie wpisu name z katalogu docelowego dfd (wpisu nie ma w źródle)
+// Tak jak remove_entry: katalogi usuwamy tylko w trybie rekurencyjnym
+int plan_delete(Plan *p, int dfd, const char *rel, const DirEntry *e) {
+    unsigned char type = entry_type(dfd, e->name, e->type);
+    if (type == DT_UNKNOWN || (type == DT_DIR && !recursive)) return 0;
+    Stat st;
+    off_t bytes = type != DT_DIR && fstatat(dfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? st.st_blocks * 512 : 0;
+    return plan_add(p, OP_DELETE, rel, e->name, NULL, bytes, type);
+}
+
+void plan_free(Plan *p) {
+    free(p->ops);
+    arena_free(&p->arena);
+    memset(p, 0, sizeof(*p));
+}
+
+// Funkcja budująca plan synchronizacji src -> dst (nic nie zmienia w celu)
+// Katalogi porównujemy po kolei z jawnego stosu ścieżek względnych; wpisy źródła i celu
+// scalamy po posortowaniu po nazwie, więc każdą nazwę sprawdzamy raz
+// Zwraca 0 w przypadku powodzenia, -1, jeśli nie można otworzyć katalogów pary albo zabrakło
+// pamięci na plan (niepełny plan zaniżałby szacunki -n, a wykonany pomijałby operacje)
+int plan_build(Plan *p, const char *src, const char *dst) {
+    memset(p, 0, sizeof(*p));
+    int src_root = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_root = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC); // -1 - cel jeszcze nie istnieje (-n)
+    if (src_root == -1 || (dst_root == -1 && errno != ENOENT)) {
+        syslog(LOG_ERR, "Nie można otworzyć katalogów: %s -> %s: %s", src, dst, strerror(errno));
+        if (src_root != -1) close(src_root);
+        if (dst_root != -1) close(dst_root);
+        return -1;
+    }
+
+    const char **stack = malloc(sizeof(char *));
+    size_t depth = 0, cap = 1;
+    if (stack) stack[depth++] = "";
+    else p->failed = 1;
+    while (depth && !p->failed) {
+        const char *rel = stack[--depth];
+        int src_fd = openat(src_root, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int dst_fd = openat(dst_root, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC); // -1 - nowy katalog
+        if (src_fd == -1) {
+            if (dst_fd != -1) close(dst_fd);
+            continue;
+        }
+        if (inotify_fd != -1) add_watch_rel(src, dst, rel); // Tryb obserwacji (-W) - jak w scan_directory
+        Arena arena = {0};
+        DirEntry *src_entries, *dst_entries = NULL;
+        size_t src_count = read_dir(src_fd, &arena, &src_entries);
+        size_t dst_count = dst_fd == -1 || src_count == READ_DIR_ERROR ? 0 : read_dir(dst_fd, &arena, &dst_entries);
+        if (src_count == READ_DIR_ERROR || dst_count == READ_DIR_ERROR) {
+            // Z niepełnej listy wyszłyby fałszywe usunięcia i kopie - katalog (z poddrzewem) pomijamy w tym planie
+            syslog(LOG_ERR, "Nie można przeczytać katalogu %s/%s: %s - pomijamy go w planie", src, rel, strerror(errno));
+            arena_free(&arena);
+            close(src_fd);
+            if (dst_fd != -1) close(dst_fd);
+            continue;
+        }
+        qsort(src_entries, src_count, sizeof(DirEntry), compare_entries);
+        qsort(dst_entries, dst_count, sizeof(DirEntry), compare_entries);
+        DirJob dir = { .src_fd = src_fd, .dst_fd = dst_fd }; // Dla compare_files (-H)
+
+        for (size_t i = 0, j = 0; !p->failed && (i < src_count || j < dst_count);) {
+            int c = i == src_count ? 1 : j == dst_count ? -1 : strcmp(src_entries[i].name, dst_entries[j].name);
+            if (c > 0) {
+                plan_delete(p, dst_fd, rel, &dst_entries[j++]); // Tylko w celu
+                continue;
+            }
+            const DirEntry *e = &src_entries[i++];
+            const DirEntry *d = c == 0 ? &dst_entries[j++] : NULL;
+            // Linki symboliczne, a bez rekurencji również katalogi, pomijamy (ich odpowiedników w celu nie ruszamy)
+            if (e->type == DT_LNK || (e->type == DT_DIR && !recursive)) continue;
+            throttle_op();
+            p->scanned++;
+            Stat st, dst_st;
+            if (fstatat(src_fd, e->name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+            int have = d && fstatat(dst_fd, e->name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0;
+
+            if (S_ISDIR(st.st_mode) && recursive) {
+                // Wpis innego typu w celu trzeba najpierw usunąć
+                if (have && !S_ISDIR(dst_st.st_mode)) plan_delete(p, dst_fd, rel, d);
+                if (!have || !S_ISDIR(dst_st.st_mode)) plan_add(p, OP_MKDIR, rel, e->name, &st, 0, DT_DIR);
+                else if (stat_mtime_ns(&st) != stat_mtime_ns(&dst_st) || metadata_differs(src_fd, dst_fd, e->name, &st, &dst_st))
+                    plan_add(p, OP_META, rel, e->name, &st, 0, DT_DIR);
+                if (depth == cap) {
+                    const char **tmp = realloc(stack, cap * 2 * sizeof(char *));
+                    if (!tmp) {
+                        p->failed = 1; // Bez poddrzewa plan byłby niepełny
+                        continue;
+                    }
+                    stack = tmp;
+                    cap *= 2;
+                }
+                stack[depth++] = *rel ? arena_join(&p->arena, rel, e->name) : arena_strdup(&p->arena, e->name);
+            } else if (S_ISREG(st.st_mode)) {
+                if (have && S_ISDIR(dst_st.st_mode)) {
+                    if (!recursive) continue; // Katalogu w celu bez -R nie usuwamy
+                    plan_delete(p, dst_fd, rel, d);
+                    have = 0;
+                }
+                int result = have ? compare_files(&dir, e->name, &st, &dst_st) : FILE_COPY;
+                if (result == FILE_META) {
+                    plan_add(p, OP_META, rel, e->name, &st, 0, DT_REG);
+                } else if (result == FILE_COPY) {
+                    // Kopiowanie różnicowe wybierze copy_file - szacujemy je z góry rozmiarem pliku
+                    // Plik z dziurami copy_file kopiuje zawsze w całości (bez delty), zapisując tylko
+                    // zajęte bloki - szacujemy go według st_blocks
+                    int sparse = file_has_holes(-1, &st);
+                    int delta = !sparse && delta_threshold && st.st_size >= delta_threshold && have && S_ISREG(dst_st.st_mode) && dst_st.st_size > 0;
+                    off_t bytes = sparse ? (off_t)st.st_blocks * 512 : st.st_size;
+                    plan_add(p, delta ? OP_DELTA : OP_COPY, rel, e->name, &st, bytes, DT_REG);
+                }
+            }
+        }
+        arena_free(&arena);
+        close(src_fd);
+        if (dst_fd != -1) close(dst_fd);
+    }
+    free(stack);
+    close(src_root);
+    if (dst_root != -1) close(dst_root);
+    if (p->failed) {
+        syslog(LOG_ERR, "Brak pamięci na plan %s -> %s - pomijamy parę w tym cyklu", src, dst);
+        plan_free(p);
+        return -1;
+    }
+    return 0;
+}
+
+// Etap wykonania operacji (kolejność plan_sort)
+int plan_stage(const PlanOp *op) {
+    if (op->type == OP_COPY || op->type == OP_DELTA) return op->st.st_size < PLAN_SMALL ? OP_COPY : OP_TYPES;
+    return op->type;
+}
+
+// Porównanie operacji: etap, potem katalog i nazwa (duże pliki - od największego)
+int compare_ops(const void *x, const void *y) {
+    const PlanOp *a = x, *b = y;
+    int sa = plan_stage(a), sb = plan_stage(b);
+    if (sa != sb) return sa - sb;
+    if (sa == OP_TYPES && a->st.st_size != b->st.st_size) return a->st.st_size > b->st.st_size ? -1 : 1;
+    size_t n = a->dir_len < b->dir_len ? a->dir_len : b->dir_len;
+    int c = memcmp(a->path, b->path, n);
+    if (!c) c = (a->dir_len > b->dir_len) - (a->dir_len < b->dir_len);
+    return c ? c : strcmp(a->path, b->path);
+}
+
+void plan_sort(Plan *p) {
+    qsort(p->ops, p->count, sizeof(PlanOp), compare_ops);
+}
+
+// Funkcja wypisująca plan: operacje w kolejności wykonania i podsumowanie według typu
+void plan_print(FILE *f, const Plan *p, const char *src, const char *dst) {
+    fprintf(f, "# plan: %s -> %s\n", src, dst);
+    for (size_t i = 0; i < p->count; i++) {
+        const PlanOp *op = &p->ops[i];
+        fprintf(f, "%-6s %14lld  %s%s\n", plan_op_names[op->type], (long long)op->bytes, op->path,
+                op->dtype == DT_DIR ? "/" : "");
+    }
+    fprintf(f, "# porównano wpisów: %ld", p->scanned);
+    for (int t = 0; t < OP_TYPES; t++)
+        fprintf(f, ", %s: %ld (%lld B)", plan_op_names[t], p->counts[t], p->bytes[t]);
+    fputc('\n', f);
+}
+
+// Deskryptory katalogu bieżącej grupy operacji (jeden zestaw na wątek)
+typedef struct {
+    const char *path;       // Ścieżka operacji, której część katalogowa opisuje otwarty katalog
+    size_t len;             // Długość części katalogowej (path == NULL - nic nie otwarto)
+    int src_fd, dst_fd;     // Deskryptory katalogu w źródle i w celu (-1, jeśli nie istnieje)
+} PlanDir;
+
+// Funkcja ustawiająca deskryptory katalogu operacji op (otwiera je tylko przy zmianie katalogu)
+void plan_dir(PlanDir *c, int src_root, int dst_root, const PlanOp *op) {
+    if (c->path && c->len == op->dir_len && !memcmp(c->path, op->path, op->dir_len)) return;
+    if (c->path) {
+        if (c->src_fd != -1) close(c->src_fd);
+        if (c->dst_fd != -1) close(c->dst_fd);
+    }
+    char *dir = op->dir_len ? strndup(op->path, op->dir_len) : NULL;
+    c->src_fd = openat(src_root, dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    c->dst_fd = openat(dst_root, dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    free(dir);
+    c->path = op->path;
+    c->len = op->dir_len;
+}
+
+void plan_dir_close(PlanDir *c) {
+    if (!c->path) return;
+    if (c->src_fd != -1) close(c->src_fd);
+    if (c->dst_fd != -1) close(c->dst_fd);
+    c->path = NULL;
+}
+
+// Wspólny stan wątków wykonujących plan
+typedef struct {
+    Plan *plan;
+    const char *src, *dst;  // Katalogi pary (do pełnych ścieżek w logach i indeksie)
+    int src_root, dst_root;
+    atomic_size_t next;     // Następna operacja do wykonania
+    size_t end;             // Koniec zakresu operacji
+    int final;              // Etap końcowy - metadane katalogów (po wszystkich zmianach ich zawartości)
+} PlanWork;
+
+// Funkcja wykonująca jedną operację planu
+void plan_run_op(PlanWork *work, PlanDir *dir, const PlanOp *op) {
+    plan_dir(dir, work->src_root, work->dst_root, op);
+    if (dir->dst_fd == -1) return; // Katalog docelowy zniknął od zaplanowania
+    const char *name = op->path + (op->dir_len ? op->dir_len + 1 : 0);
+    Arena arena = {0};
+    const char *dst_path = arena_join(&arena, work->dst, op->path);
+    switch (op->type) {
+    case OP_DELETE: {
+        // Jak remove_extraneous_files potwierdzamy w źródle, że wpis trzeba usunąć: nie ma go tam
+        // (mógł powstać po zaplanowaniu) albo ma inny typ (katalog w miejscu pliku lub odwrotnie)
+        // Bez katalogu źródłowego nie usuwamy niczego - wykona to następny przebieg
+        Stat st;
+        if (dir->src_fd == -1) break;
+        int stale = fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1
+                        ? errno == ENOENT
+                        : S_ISDIR(st.st_mode) ? op->dtype != DT_DIR : S_ISREG(st.st_mode) && op->dtype == DT_DIR;
+        if (stale) remove_entry(dir->dst_fd, name, op->dtype, dst_path);
+        break;
+    }
+    case OP_MKDIR:
+        throttle_op();
+        // Do końca wykonania z prawem zapisu dla nas - pełne metadane dostaje w etapie końcowym
+        if (work->final)
+            preserve_metadata_at(dir->src_fd, name, dir->dst_fd, name, &op->st);
+        else if (mkdirat(dir->dst_fd, name, (op->st.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)
+            syslog(LOG_ERR, "Nie można utworzyć katalogu %s: %s", dst_path, strerror(errno));
+        break;
+    case OP_META:
+        if ((op->dtype == DT_DIR) != work->final) break; // Metadane katalogów - w etapie końcowym
+        throttle_op();
+        preserve_metadata_at(dir->src_fd, name, dir->dst_fd, name, &op->st);
+        atomic_fetch_add(&files_touched, 1);
+        log_file("Zaktualizowano metadane: %s", dst_path);
+        break;
+    default: {
+        throttle_op();
+        if (dir->src_fd == -1) break;
+        PathAt src = {dir->src_fd, name, arena_join(&arena, work->src, op->path)};
+        PathAt dst = {dir->dst_fd, name, dst_path};
+        sync_file(&src, &dst, &op->st);
+    }
+    }
+    arena_free(&arena);
+}
+
+// Wątek wykonujący kopie z planu: kolejne operacje bierze ze wspólnego licznika
+void *plan_worker(void *arg) {
+    PlanWork *work = arg;
+    PlanDir dir = {0};
+    for (size_t i; (i = atomic_fetch_add(&work->next, 1)) < work->end;)
+        plan_run_op(work, &dir, &work->plan->ops[i]);
+    plan_dir_close(&dir);
+    arena_pool_drain(); // Pula wątku zginęłaby razem z nim
+    free(xattr_buffer);
+    xattr_buffer = NULL;
+    return NULL;
+}
+
+// Funkcja wykonująca posortowany plan p dla pary src -> dst
+void plan_execute(Plan *p, const char *src, const char *dst) {
+    PlanWork work = { .plan = p, .src = src, .dst = dst };
+    work.src_root = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    work.dst_root = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (work.src_root == -1 || work.dst_root == -1) {
+        syslog(LOG_ERR, "Nie można otworzyć katalogów: %s -> %s: %s", src, dst, strerror(errno));
+        if (work.src_root != -1) close(work.src_root);
+        if (work.dst_root != -1) close(work.dst_root);
+        return;
+    }
+
+    // Usunięcia, katalogi i metadane po kolei w bieżącym wątku (kolejność ma znaczenie)
+    size_t first_copy = 0;
+    PlanDir dir = {0};
+    while (first_copy < p->count && plan_stage(&p->ops[first_copy]) < OP_COPY)
+        plan_run_op(&work, &dir, &p->ops[first_copy++]);
+    plan_dir_close(&dir);
+
+    // Kopie równolegle (jobs wątków, w tym bieżący)
+    atomic_init(&work.next, first_copy);
+    work.end = p->count;
+    pthread_t *threads = malloc((jobs > 1 ? jobs - 1 : 1) * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < jobs - 1 && first_copy + started + 1 < p->count &&
+           pthread_create(&threads[started], NULL, plan_worker, &work) == 0)
+        started++;
+    plan_worker(&work);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Metadane utworzonych i zmienionych katalogów (kopie i usunięcia zmieniały ich mtime)
+    work.final = 1;
+    for (size_t i = 0; i < p->count; i++)
+        if (p->ops[i].dtype == DT_DIR && (p->ops[i].type == OP_MKDIR || p->ops[i].type == OP_META))
+            plan_run_op(&work, &dir, &p->ops[i]);
+    plan_dir_close(&dir);
+    Stat root_st;
+    if (fstat(work.src_root, &root_st) == 0) preserve_dir_metadata(work.src_root, work.dst_root, &root_st);
+    close(work.src_root);
+    close(work.dst_root);
+}
+
+// Funkcja wykonująca przebieg pary według planu (-P): plan, podsumowanie w syslogu, wykonanie
+void plan_pass(const char *src, const char *dst) {
+    Plan p;
+    if (plan_build(&p, src, dst) == -1) return;
+    plan_sort(&p);
+    syslog(LOG_INFO, "Plan %s -> %s: kopie %ld (%lld B), delta %ld (do %lld B), usunięcia %ld, katalogi %ld, metadane %ld",
+           src, dst, p.counts[OP_COPY], p.bytes[OP_COPY], p.counts[OP_DELTA], p.bytes[OP_DELTA],
+           p.counts[OP_DELETE], p.counts[OP_MKDIR], p.counts[OP_META]);
+    plan_execute(&p, src, dst);
+    plan_free(&p);
+}
+
+// Stan liczników na początku cyklu (do podsumowania cyklu w syslogu)
+typedef struct {
+    long long start;        // Początek cyklu (now_ns)
+    long copied, skipped, deleted, errors, touched;
+    long long bytes;
+} CycleSnapshot;
+
+CycleSnapshot cycle_start;  // Wypełniane przez metrics_cycle_begin (tylko wątek główny)
+
+// Funkcja rozpoczynająca cykl synchronizacji (pełny przebieg lub partię zmian inotify)
+void metrics_cycle_begin(void) {
+    atomic_store(&cycle_log_count, 0); // Nowy limit komunikatów o plikach
+    cycle_start.start = now_ns();
+    cycle_start.copied = atomic_load(&files_copied);
+    cycle_start.skipped = atomic_load(&files_skipped);
+    cycle_start.deleted = atomic_load(&files_deleted) + atomic_load(&dirs_deleted);
+    cycle_start.errors = atomic_load(&copy_errors);
+    cycle_start.touched = atomic_load(&files_touched);
+    cycle_start.bytes = atomic_load(&bytes_copied);
+}
+
+// Funkcja sprawdzająca, czy bieżący cykl zmienił cokolwiek w celu (kopie, usunięcia, metadane)
+int cycle_changed(void) {
+    return atomic_load(&files_copied) != cycle_start.copied ||
+           atomic_load(&files_deleted) + atomic_load(&dirs_deleted) != cycle_start.deleted ||
+           atomic_load(&files_touched) != cycle_start.touched;
+}
+
+// Funkcja utrwalająca na dysku zmiany cyklu w systemie plików katalogu dst
+// Zamiast fsync po każdym pliku wykonujemy jeden syncfs na cykl (i tylko, jeśli cykl coś zmienił),
+// więc bezpieczeństwo po awarii nie spowalnia kopiowania wielu małych plików
+void cycle_sync(const char *dst) {
+    if (!cycle_changed()) return;
+    int fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    if (syncfs(fd) == -1) syslog(LOG_ERR, "Nie można utrwalić zmian w %s: %s", dst, strerror(errno));
+    close(fd);
+}
+
+// Funkcja kończąca cykl: zapisuje w syslogu jego podsumowanie, a dla pełnego przebiegu (full)
+// również czas w metrykach i ostrzeżenie, jeśli przebieg trwał dłużej niż sleep_time
+void metrics_cycle_end(int full) {
+    long long us = (now_ns() - cycle_start.start) / 1000;
+    long copied = atomic_load(&files_copied) - cycle_start.copied;
+    long skipped = atomic_load(&files_skipped) - cycle_start.skipped;
+    long deleted = atomic_load(&files_deleted) + atomic_load(&dirs_deleted) - cycle_start.deleted;
+    long errors = atomic_load(&copy_errors) - cycle_start.errors;
+    long long bytes = atomic_load(&bytes_copied) - cycle_start.bytes;
+    long suppressed = atomic_load(&cycle_log_count) - log_limit;
+
+    if (full) {
+        atomic_fetch_add(&cycles, 1);
+        atomic_store(&last_cycle_us, us);
+        histogram_add(&cycle_duration, us);
+        if (us > (long long)sleep_time * 1000000) {
+            atomic_fetch_add(&cycles_overrun, 1);
+            syslog(LOG_WARNING, "Przebieg synchronizacji trwał %.1f s - dłużej niż czas oczekiwania (%u s)",
+                   us / 1e6, sleep_time);
+        }
+    }
+    // Partie zmian bez żadnej operacji nie zaśmiecają sysloga
+    if (!full && !copied && !deleted && !errors) return;
+
+    char extra[64] = "";
+    if (suppressed > 0) snprintf(extra, sizeof(extra), ", pominięte komunikaty: %ld", suppressed);
+    syslog(LOG_INFO, "%s: skopiowano %ld plików (%lld B), aktualne %ld, usunięto %ld, błędy %ld, czas %.3f s%s",
+           full ? "Pełna synchronizacja" : "Synchronizacja zmian", copied, bytes, skipped, deleted, errors,
+           us / 1e6, extra);
+}
+
+// Funkcja wypisująca licznik lub wskaźnik w formacie Prometheus
+void metrics_value(FILE *f, const char *name, const char *type, const char *help, double value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+// Funkcja wypisująca histogram (przedziały w sekundach, skumulowane) w formacie Prometheus
+void metrics_histogram(FILE *f, const char *name, const char *help, Histogram *h) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    long cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load(&h->buckets[i]);
+        fprintf(f, "%s_bucket{le=\"%.6f\"} %ld\n", name, (1LL << i) / 1e6, cumulative);
+    }
+    cumulative += atomic_load(&h->buckets[HISTOGRAM_BUCKETS]);
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %ld\n", name, cumulative);
+    fprintf(f, "%s_sum %.6f\n%s_count %ld\n", name, atomic_load(&h->sum_us) / 1e6, name, atomic_load(&h->count));
+}
+
+// Funkcja wypisująca wszystkie metryki w formacie tekstowym Prometheus
+void metrics_format(FILE *f) {
+    metrics_value(f, "syncdir_files_copied_total", "counter", "Liczba skopiowanych plików", atomic_load(&files_copied));
+    metrics_value(f, "syncdir_bytes_copied_total", "counter", "Łączny rozmiar skopiowanych plików (B)", atomic_load(&bytes_copied));
+    metrics_value(f, "syncdir_files_skipped_total", "counter", "Liczba plików pominiętych, bo cel był aktualny", atomic_load(&files_skipped));
+    metrics_value(f, "syncdir_files_deleted_total", "counter", "Liczba plików usuniętych z celu", atomic_load(&files_deleted));
+    metrics_value(f, "syncdir_dirs_deleted_total", "counter", "Liczba katalogów usuniętych z celu", atomic_load(&dirs_deleted));
+    metrics_value(f, "syncdir_copy_errors_total", "counter", "Liczba nieudanych kopiowań", atomic_load(&copy_errors));
+    metrics_value(f, "syncdir_files_touched_total", "counter", "Liczba plików, w których poprawiono tylko metadane", atomic_load(&files_touched));
+    metrics_value(f, "syncdir_files_hashed_total", "counter", "Liczba obliczonych skrótów zawartości", atomic_load(&files_hashed));
+    metrics_value(f, "syncdir_hash_cache_hits_total", "counter", "Liczba skrótów wziętych z pamięci podręcznej", atomic_load(&hash_cache_hits));
+    metrics_value(f, "syncdir_store_chunks_written_total", "counter", "Liczba nowych fragmentów zapisanych w magazynie", atomic_load(&store_chunks_written));
+    metrics_value(f, "syncdir_store_chunks_reused_total", "counter", "Liczba fragmentów, które już były w magazynie", atomic_load(&store_chunks_reused));
+    metrics_value(f, "syncdir_store_bytes_written_total", "counter", "Liczba bajtów zapisanych w fragmentach po kompresji", atomic_load(&store_bytes_written));
+
+    // Przepustowość każdej strategii to bytes_total / seconds_total
+    static const struct { const char *name, *help; } strategy_series[] = {
+        {"syncdir_copy_strategy_files_total", "Liczba plików skopiowanych strategią"},
+        {"syncdir_copy_strategy_bytes_total", "Liczba bajtów zapisanych strategią"},
+        {"syncdir_copy_strategy_seconds_total", "Łączny czas kopiowania strategią"},
+    };
+    for (int m = 0; m < 3; m++) {
+        const char *name = strategy_series[m].name;
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, strategy_series[m].help, name);
+        for (size_t i = 0; i < STRATEGY_SLOTS; i++) {
+            StrategyMetrics *sm = &strategy_metrics[i];
+            double value = m == 0 ? atomic_load(&sm->files) : m == 1 ? atomic_load(&sm->bytes) : atomic_load(&sm->nanos) / 1e9;
+            fprintf(f, "%s{strategy=\"%s\"} %.15g\n", name, strategy_name(i), value);
+        }
+    }
+
+    metrics_histogram(f, "syncdir_copy_duration_seconds", "Czas kopiowania pojedynczego pliku", &copy_latency);
+    metrics_histogram(f, "syncdir_cycle_duration_seconds", "Czas pełnego przebiegu synchronizacji", &cycle_duration);
+    metrics_value(f, "syncdir_cycles_total", "counter", "Liczba pełnych przebiegów synchronizacji", atomic_load(&cycles));
+    metrics_value(f, "syncdir_cycles_overrun_total", "counter", "Liczba przebiegów dłuższych niż czas oczekiwania", atomic_load(&cycles_overrun));
+    metrics_value(f, "syncdir_last_cycle_duration_seconds", "gauge", "Czas ostatniego pełnego przebiegu", atomic_load(&last_cycle_us) / 1e6);
+    metrics_value(f, "syncdir_sleep_time_seconds", "gauge", "Czas oczekiwania między przebiegami", sleep_time);
+    metrics_value(f, "syncdir_queue_depth", "gauge", "Liczba zadań czekających w kolejkach puli", atomic_load(&queued_tasks));
+    metrics_value(f, "syncdir_queue_depth_max", "gauge", "Największa liczba zadań w kolejkach puli", atomic_load(&queue_depth_max));
+    metrics_value(f, "syncdir_throttle_wait_seconds_total", "counter", "Łączny czas uśpienia wątków przez ogranicznik tempa", atomic_load(&throttle_wait_us) / 1e6);
+    pthread_mutex_lock(&throttle_lock);
+    double duty = io_duty;
+    pthread_mutex_unlock(&throttle_lock);
+    metrics_value(f, "syncdir_io_duty_ratio", "gauge", "Wypełnienie w trybie adaptacyjnym (1 - bez przerw)", duty);
+}
+
+// Funkcja zapisująca metryki do sysloga (po SIGUSR1), jeśli o to poproszono
+// Zwraca 1, jeśli przyszedł SIGUSR1 (demon synchronizuje wtedy od razu wszystkie pary)
+int metrics_dump_requested(void) {
+    if (!stats_requested) return 0;
+    stats_requested = 0;
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (!f) return 1;
+    metrics_format(f);
+    fclose(f);
+    syslog(LOG_INFO, "Zrzut metryk (SIGUSR1):");
+    char *save, *line;
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+        if (line[0] != '#') syslog(LOG_INFO, "%s", line); // Bez komentarzy HELP/TYPE
+    free(text);
+    return 1;
+}
+
+// Wątek serwera metryk: każde połączenie dostaje bieżące metryki i jest zamykane
+// Jeśli klient w ciągu 100 ms wyśle żądanie HTTP (np. curl --unix-socket), odpowiadamy
+// z nagłówkami HTTP; w przeciwnym razie (np. nc -U, socat) wysyłamy sam tekst
+#define METRICS_BACKOFF_MS 100  // Przerwa przed ponowieniem accept4 po EMFILE, ENFILE, ENOBUFS lub ENOMEM
+
+void *metrics_main(void *arg) {
+    int server = (int)(long)arg;
+    int starved = 0; // Ostatnie accept4 zawiodło z braku deskryptorów lub pamięci
+    while (1) {
+        int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Połączenie czeka w kolejce gniazda, a accept4 od razu zawiódłby ponownie -
+                // ponawiamy po chwili zamiast kręcić się w pętli (komunikat raz na epizod)
+                if (!starved) syslog(LOG_WARNING, "Serwer metryk nie przyjmuje połączeń: %s", strerror(errno));
+                starved = 1;
+                poll(NULL, 0, METRICS_BACKOFF_MS);
+            } else if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+                syslog(LOG_ERR, "Serwer metryk zatrzymany: %s", strerror(errno));
+                break; // Gniazdo nie nadaje się do użytku - ponowienie nic nie zmieni
+            }
+            continue; // EINTR, ECONNABORTED itp. - kolejne połączenie
+        }
+        starved = 0;
+
+        char request[1024];
+        struct pollfd pfd = { .fd = client, .events = POLLIN };
+        ssize_t n = poll(&pfd, 1, 100) == 1 ? read(client, request, sizeof(request)) : 0;
+        int http = n >= 4 && !memcmp(request, "GET ", 4);
+
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+        if (f) {
+            metrics_format(f);
+            fclose(f);
+            if (http) {
+                char header[160];
+                int header_len = snprintf(header, sizeof(header),
+                                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                          "Content-Length: %zu\r\n\r\n", len);
+                write_all(client, header, header_len);
+            }
+            write_all(client, text, len);
+            free(text);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+// Funkcja uruchamiająca serwer metryk na gnieździe uniksowym path
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int metrics_start(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Za długa ścieżka gniazda metryk: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    unlink(path); // Gniazdo po poprzednim uruchomieniu
+    pthread_t thread;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1 ||
+        pthread_create(&thread, NULL, metrics_main, (void *)(long)fd) != 0) {
+        syslog(LOG_ERR, "Nie można uruchomić serwera metryk %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    syslog(LOG_INFO, "Metryki dostępne na gnieździe %s", path);
+    return 0;
+}
+
+// Magazyn fragmentów (-S)
+// Zamiast kopii lustrzanej cel przechowuje zawartość plików jako fragmenty wyznaczane przez treść
+// (content-defined chunking): granice fragmentów wyznacza przesuwny skrót "gear" po ostatnich 64
+// bajtach, więc wstawienie danych w środku pliku przesuwa tylko sąsiednie granice. Fragmenty
+// identyfikujemy 128-bitowym skrótem (dwa XXH64) - każdy jest zapisany najwyżej raz (deduplikacja),
+// skompresowany wbudowanym kodekiem w formacie bloków LZ4. Strukturę drzewa opisuje manifest.
+// Układ celu:
+//   manifest                   - nagłówek StoreHeader, potem dla każdego wpisu StoreRecord, ścieżka
+//                                względna (bez '\0') i identyfikatory fragmentów (ChunkId)
+//   chunks/ab/abcd...(32 hex)  - fragment: bajt kodeka, długość danych (uint32), dane
+// Kolejność zapisu gwarantuje spójność po awarii: nowe fragmenty -> syncfs -> manifest (plik tymczasowy,
+// fsync, rename) -> usunięcie fragmentów, do których nowy manifest już się nie odwołuje.
+// Pliki bez zmian (rozmiar, mtime w ns, uprawnienia jak w manifeście) nie są czytane ponownie,
+// a zmienione dzielimy i kompresujemy równolegle w jobs wątkach.
+#define STORE_CHUNK_MIN (16 * 1024)         // Najmniejszy fragment (poza końcówką pliku)
+#define STORE_CHUNK_MAX (256 * 1024)        // Największy fragment
+#define STORE_CHUNK_BITS 16                 // Granica, gdy 16 najstarszych bitów skrótu to zera (średnio 64 KB ponad minimum)
+#define STORE_BUFFER (4 * STORE_CHUNK_MAX)  // Bufor odczytu pliku źródłowego
+#define STORE_SEED 0x9e3779b97f4a7c15ULL    // Ziarno drugiej połowy identyfikatora fragmentu
+#define STORE_MAGIC 0x54534453u             // "SDST"
+#define STORE_VERSION 2                     // 2 - właściciel pliku w StoreRecord (wersję 1 nadal czytamy)
+#define STORE_HOLE_BLOCK 4096               // Bloki zer tego rozmiaru odtwarzamy jako dziury
+#define STORE_RAW 0                         // Fragment zapisany bez kompresji (kompresja nic nie dała)
+#define STORE_LZ4 1                         // Fragment skompresowany (format bloków LZ4)
+#define STORE_CHUNK_HEADER 5                // Bajt kodeka i długość danych po rozpakowaniu
+#define LZ4_HASH_BITS 12                    // Rozmiar tablicy dopasowań kompresora (4096 pozycji)
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16) // Największy możliwy rozmiar po "kompresji"
+
+typedef struct {
+    uint64_t hi, lo;        // Identyfikator fragmentu: XXH64 z ziarnem 0 i STORE_SEED
+} ChunkId;
+
+typedef struct {
+    uint32_t magic, version;
+    uint64_t count;         // Liczba wpisów
+} StoreHeader;
+
+typedef struct {
+    uint32_t mode;          // Typ i uprawnienia (st_mode)
+    uint32_t path_len;      // Długość ścieżki względnej
+    int64_t mtime_ns;       // Czas modyfikacji w ns
+    uint64_t size;          // Rozmiar pliku
+    uint64_t chunks;        // Liczba fragmentów
+    uint32_t uid, gid;      // Właściciel (UINT32_MAX - nieznany, manifest w wersji 1)
+} StoreRecord;
+
+// Wpis manifestu w pamięci
+typedef struct {
+    char *path;             // Ścieżka względem katalogu źródłowego
+    StoreRecord rec;
+    ChunkId *ids;           // Fragmenty pliku w kolejności
+    int todo;               // Plik trzeba podzielić na fragmenty w tym przebiegu
+} StoreEntry;
+
+typedef struct {
+    StoreEntry *entries;
+    size_t count, cap;
+    size_t *slots;          // Tablica mieszająca ścieżek (numer wpisu + 1, 0 - wolny slot)
+    size_t slot_count;
+} Manifest;
+
+// Zbiór identyfikatorów fragmentów (adresowanie otwarte, wspólny dla wątków)
+typedef struct {
+    ChunkId *slots;         // Wolny slot ma identyfikator {0, 0}
+    size_t cap, used;
+    pthread_mutex_t lock;
+} ChunkSet;
+
+uint64_t store_gear[256];               // Losowe wartości bajtów dla skrótu "gear"
+pthread_once_t store_gear_once = PTHREAD_ONCE_INIT;
+
+// Funkcja wypełniająca tablicę gear (stałe ziarno - granice fragmentów muszą być powtarzalne)
+void store_gear_init(void) {
+    uint64_t x = STORE_SEED;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL); // splitmix64
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        store_gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Funkcja zwracająca długość fragmentu zaczynającego się w p (n - dostępne bajty; na końcu pliku
+// n może być mniejsze niż STORE_CHUNK_MAX, w przeciwnym razie musi być co najmniej tyle)
+size_t store_cut(const unsigned char *p, size_t n) {
+    if (n <= STORE_CHUNK_MIN) return n;
+    size_t max = n < STORE_CHUNK_MAX ? n : STORE_CHUNK_MAX;
+    uint64_t h = 0;
+    for (size_t i = STORE_CHUNK_MIN; i < max; i++) {
+        h = (h << 1) + store_gear[p[i]];
+        if (!(h >> (64 - STORE_CHUNK_BITS))) return i + 1;
+    }
+    return max;
+}
+
+// Kompresor w formacie bloków LZ4: sekwencje (token, literały, przesunięcie 16-bitowe, długość dopasowania)
+// Dopasowania szukamy zachłannie przez tablicę mieszającą 4-bajtowych ciągów; ostatnie 5 bajtów
+// to zawsze literały, a ostatnie dopasowanie zaczyna się co najmniej 12 bajtów przed końcem (jak w LZ4)
+// Zwraca rozmiar danych skompresowanych lub 0, jeśli nie mieszczą się w cap bajtach
+
+// Funkcja zapisująca długość ponad 15 (kolejne bajty 255 i reszta)
+unsigned char *lz4_put_length(unsigned char *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint32_t table[1 << LZ4_HASH_BITS] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    const unsigned char *mflimit = n > 12 ? end - 12 : src, *matchlimit = n > 5 ? end - 5 : src;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < mflimit) {
+        uint32_t seq;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        const unsigned char *ref = src + table[h];
+        table[h] = ip - src;
+        uint32_t cand;
+        memcpy(&cand, ref, 4);
+        if (ref >= ip || ip - ref > 65535 || cand != seq) {
+            ip++;
+            continue;
+        }
+        const unsigned char *m = ip + 4, *r = ref + 4;
+        while (m < matchlimit && *m == *r) m++, r++;
+        size_t lit = ip - anchor, mlen = m - ip - 4;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op = lz4_put_length(op, lit);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen >= 15) op = lz4_put_length(op, mlen);
+        ip = anchor = m;
+    }
+    // Ostatnia sekwencja - same literały
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = lz4_put_length(op, lit);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+// Dekompresor bloków LZ4 (sprawdza granice - fragment mógł zostać uszkodzony)
+// Zwraca 0, jeśli rozpakowano dokładnie out_len bajtów, -1 w przypadku błędnych danych
+int lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t out_len) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + out_len;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, b;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) return -1;
+                lit += b = *ip++;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // Ostatnia sekwencja nie ma dopasowania
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8, mlen = token & 15;
+        ip += 2;
+        if (!off || off > (size_t)(op - dst)) return -1;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) return -1;
+                mlen += b = *ip++;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const unsigned char *m = op - off;
+        while (mlen--) *op++ = *m++; // Bajt po bajcie - dopasowanie może nachodzić na zapisywane dane
+    }
+    return op == oend ? 0 : -1;
+}
+
+// Funkcja dodająca identyfikator do zbioru
+// Zwraca 1, jeśli go nie było (fragment trzeba zapisać), 0, jeśli już był
+int chunk_set_add(ChunkSet *s, ChunkId id) {
+    pthread_mutex_lock(&s->lock);
+    if ((s->used + 1) * 10 > s->cap * 7) {
+        // Powiększamy tablicę i przenosimy identyfikatory
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        ChunkId *slots = calloc(cap, sizeof(ChunkId));
+        if (slots) {
+            for (size_t i = 0; i < s->cap; i++) {
+                if (!s->slots[i].hi && !s->slots[i].lo) continue;
+                size_t j = s->slots[i].hi & (cap - 1);
+                while (slots[j].hi || slots[j].lo) j = (j + 1) & (cap - 1);
+                slots[j] = s->slots[i];
+            }
+            free(s->slots);
+            s->slots = slots;
+            s->cap = cap;
+        }
+    }
+    int added = 0;
+    if (s->slots && s->used + 1 < s->cap) {
+        size_t i = id.hi & (s->cap - 1);
+        while ((s->slots[i].hi || s->slots[i].lo) && (s->slots[i].hi != id.hi || s->slots[i].lo != id.lo))
+            i = (i + 1) & (s->cap - 1);
+        if (!s->slots[i].hi && !s->slots[i].lo) {
+            s->slots[i] = id;
+            s->used++;
+            added = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return added;
+}
+
+// Funkcja sprawdzająca, czy identyfikator jest w zbiorze
+int chunk_set_has(ChunkSet *s, ChunkId id) {
+    if (!s->cap) return 0;
+    size_t i = id.hi & (s->cap - 1);
+    while (s->slots[i].hi || s->slots[i].lo) {
+        if (s->slots[i].hi == id.hi && s->slots[i].lo == id.lo) return 1;
+        i = (i + 1) & (s->cap - 1);
+    }
+    return 0;
+}
+
+// Funkcja tworząca nazwę pliku fragmentu względem katalogu chunks ("ab/abcd...")
+void chunk_name(char *buf, size_t size, ChunkId id) {
+    snprintf(buf, size, "%02x/%016llx%016llx", (unsigned)(id.hi >> 56), (unsigned long long)id.hi, (unsigned long long)id.lo);
+}
+
+// Funkcja wyszukująca wpis o ścieżce path w manifeście (NULL, jeśli go nie ma)
+StoreEntry *manifest_find(Manifest *m, const char *path) {
+    if (!m->slot_count) return NULL;
+    for (size_t i = path_key(path) & (m->slot_count - 1); m->slots[i]; i = (i + 1) & (m->slot_count - 1))
+        if (!strcmp(m->entries[m->slots[i] - 1].path, path)) return &m->entries[m->slots[i] - 1];
+    return NULL;
+}
+
+// Funkcja budująca tablicę mieszającą ścieżek manifestu (po dodaniu wszystkich wpisów)
+void manifest_index(Manifest *m) {
+    m->slot_count = 16;
+    while (m->slot_count < m->count * 2) m->slot_count *= 2;
+    m->slots = calloc(m->slot_count, sizeof(size_t));
+    if (!m->slots) {
+        m->slot_count = 0;
+        return;
+    }
+    for (size_t e = 0; e < m->count; e++) {
+        size_t i = path_key(m->entries[e].path) & (m->slot_count - 1);
+        while (m->slots[i]) i = (i + 1) & (m->slot_count - 1);
+        m->slots[i] = e + 1;
+    }
+}
+
+// Funkcja dodająca wpis na końcu manifestu (zwraca NULL, jeśli zabrakło pamięci)
+StoreEntry *manifest_add(Manifest *m, const char *path, const Stat *st) {
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 256;
+        StoreEntry *entries = realloc(m->entries, cap * sizeof(StoreEntry));
+        if (!entries) return NULL;
+        m->entries = entries;
+        m->cap = cap;
+    }
+    StoreEntry *e = &m->entries[m->count++];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    e->rec.mode = st->st_mode;
+    e->rec.path_len = strlen(path);
+    e->rec.mtime_ns = stat_mtime_ns(st);
+    e->rec.size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    e->rec.uid = st->st_uid;
+    e->rec.gid = st->st_gid;
+    return e;
+}
+
+void manifest_free(Manifest *m) {
+    for (size_t i = 0; i < m->count; i++) {
+        free(m->entries[i].path);
+        free(m->entries[i].ids);
+    }
+    free(m->entries);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+// Funkcja wczytująca manifest magazynu (katalog dfd)
+// Zwraca 0 w przypadku powodzenia (również gdy manifestu jeszcze nie ma), -1 w przypadku błędu
+int manifest_load(int dfd, Manifest *m) {
+    memset(m, 0, sizeof(*m));
+    int fd = openat(dfd, "manifest", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return errno == ENOENT ? 0 : -1;
+    FILE *f = fdopen(fd, "r");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+    StoreHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == STORE_MAGIC && (h.version == 1 || h.version == STORE_VERSION);
+    // Rekord wersji 1 nie ma właściciela (uid, gid na końcu struktury)
+    size_t rec_size = h.version == 1 ? offsetof(StoreRecord, uid) : sizeof(StoreRecord);
+    for (uint64_t i = 0; ok && i < h.count; i++) {
+        StoreRecord rec = { .uid = UINT32_MAX, .gid = UINT32_MAX };
+        char *path;
+        ok = fread(&rec, rec_size, 1, f) == 1 && rec.path_len < 65536 && (path = malloc(rec.path_len + 1));
+        if (!ok) break;
+        ok = fread(path, 1, rec.path_len, f) == rec.path_len;
+        path[ok ? rec.path_len : 0] = '\0';
+        Stat st = { .st_mode = rec.mode };
+        StoreEntry *e = ok ? manifest_add(m, path, &st) : NULL;
+        free(path);
+        if (!(ok = e != NULL)) break;
+        e->rec = rec;
+        if (rec.chunks) {
+            e->ids = malloc(rec.chunks * sizeof(ChunkId));
+            ok = e->ids && fread(e->ids, sizeof(ChunkId), rec.chunks, f) == rec.chunks;
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        manifest_free(m);
+        return -1;
+    }
+    manifest_index(m);
+    return 0;
+}
+
+// Funkcja zapisująca manifest atomowo (plik tymczasowy, fsync, rename, fsync katalogu)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int manifest_save(int dfd, Manifest *m) {
+    char tmp[64];
+    temp_name(tmp, sizeof(tmp));
+    int fd = openat(dfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlinkat(dfd, tmp, 0);
+        return -1;
+    }
+    StoreHeader h = { STORE_MAGIC, STORE_VERSION, m->count };
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < m->count; i++) {
+        StoreEntry *e = &m->entries[i];
+        ok = fwrite(&e->rec, sizeof(e->rec), 1, f) == 1 && fwrite(e->path, 1, e->rec.path_len, f) == e->rec.path_len &&
+             (!e->rec.chunks || fwrite(e->ids, sizeof(ChunkId), e->rec.chunks, f) == e->rec.chunks);
+    }
+    ok = fflush(f) == 0 && ok && fsync(fd) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (ok && renameat(dfd, tmp, dfd, "manifest") == 0) {
+        fsync(dfd);
+        return 0;
+    }
+    unlinkat(dfd, tmp, 0);
+    return -1;
+}
+
+Walk store_stack = { .nfd = 1 };    // Stos przejścia drzewa źródłowego magazynu (tylko wątek główny)
+
+// Funkcja dopisująca do manifestu m wpisy katalogu ramki f (ścieżka względna f->src) i zapamiętująca
+// w ramce jego podkatalogi. Pliki, które według manifestu old się nie zmieniły, przejmują jego
+// fragmenty; pozostałe oznaczamy do podziału (todo).
+// Zwraca 0 w przypadku powodzenia, -1, jeśli katalogu nie udało się przeczytać w całości
+int store_dir(WalkFrame *f, const char *src, const char *dst, Manifest *m, Manifest *old) {
+    const char *rel = f->src;
+    if (inotify_fd != -1) add_watch_rel(src, dst, rel);
+    Arena arena = {0};
+    DirEntry *entries;
+    size_t count = read_dir(f->fd[0], &arena, &entries);
+    int ret = 0;
+    if (count == READ_DIR_ERROR) {
+        syslog(LOG_ERR, "Nie można przeczytać katalogu %s/%s: %s", src, rel, strerror(errno));
+        arena_free(&arena);
+        return -1;
+    }
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        const char *name = entries[i].name;
+        if (entries[i].type == DT_LNK || (entries[i].type == DT_DIR && !recursive)) continue;
+        throttle_op();
+        Stat st;
+        if (fstatat(f->fd[0], name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (!S_ISREG(st.st_mode) && !(S_ISDIR(st.st_mode) && recursive)) continue;
+        const char *path = *rel ? arena_join(&arena, rel, name) : name;
+
+        StoreEntry *e = manifest_add(m, path, &st);
+        if (!e) {
+            ret = -1; // Brak pamięci - manifest bez tego wpisu byłby niepełny
+            continue;
+        }
+        StoreEntry *prev = manifest_find(old, path);
+        if (S_ISDIR(st.st_mode)) {
+            // Katalog nie ma fragmentów - nowy katalog i każda zmiana jego metadanych (uprawnienia,
+            // mtime, właściciel) liczy się jako zmiana, żeby store_pass zapisał manifest
+            if (!prev || prev->rec.mode != e->rec.mode || prev->rec.mtime_ns != e->rec.mtime_ns ||
+                prev->rec.uid != e->rec.uid || prev->rec.gid != e->rec.gid)
+                atomic_fetch_add(&files_touched, 1);
+            size_t len = f->names_len;
+            names_append(&f->names, &f->names_len, &f->names_cap, name);
+            if (f->names_len == len) ret = -1; // Brak pamięci - poddrzewo nie trafiłoby do manifestu
+            continue;
+        }
+        // Sama zmiana właściciela (lub manifest w wersji 1) też wymaga zapisania manifestu
+        if (prev && prev->rec.mode == e->rec.mode && (prev->rec.uid != e->rec.uid || prev->rec.gid != e->rec.gid))
+            atomic_fetch_add(&files_touched, 1);
+        if (prev && prev->rec.mode == e->rec.mode && prev->rec.mtime_ns == e->rec.mtime_ns && prev->rec.size == e->rec.size) {
+            e->rec.chunks = prev->rec.chunks;
+            e->ids = prev->ids; // Przejmujemy tablicę (stary manifest jej nie zwolni)
+            prev->ids = NULL;
+            atomic_fetch_add(&files_skipped, 1);
+        } else {
+            e->todo = 1;
+        }
+    }
+    arena_free(&arena);
+    return ret;
+}
+
+// Funkcja dopisująca do manifestu m wpisy drzewa źródłowego (katalog dfd) bez rekurencji - jawny
+// stos store_stack z budżetem deskryptorów (zob. walk_push). Katalog zawsze poprzedza swoją
+// zawartość (ważne przy odtwarzaniu).
+// src, dst - katalogi pary (rejestracja obserwacji inotify w trybie -W)
+// Zwraca 0 w przypadku powodzenia, -1, jeśli któregoś katalogu nie udało się przeczytać w całości
+// (manifest z takiego przejścia pominąłby pliki, a store_collect usunąłby ich fragmenty)
+int store_walk(int dfd, const char *src, const char *dst, Manifest *m, Manifest *old) {
+    Walk *w = &store_stack;
+    int fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); // Ramka zamyka swój deskryptor
+    WalkFrame *f = fd == -1 ? NULL : walk_push(w, fd, -1);
+    if (f) f->src = strdup("");
+    if (!f || !f->src) {
+        syslog(LOG_ERR, "Nie można rozpocząć przejścia drzewa %s: %s", src, strerror(errno));
+        if (f) walk_pop(w);
+        return -1;
+    }
+    int ret = store_dir(f, src, dst, m, old);
+
+    while (w->depth) {
+        f = &w->frames[w->depth - 1];
+        if (ret == -1 || f->next == f->names_len) {
+            // Po błędzie tylko zdejmujemy ramki - manifestu i tak nie zapiszemy
+            if (walk_pop(w) == -1) ret = -1; // Pominięte podkatalogi nie trafiłyby do manifestu
+            continue;
+        }
+        const char *name = f->names + f->next;
+        f->next += strlen(name) + 1;
+        char *path; // walk_push może przenieść tablicę ramek (i bufor nazw f)
+        if (asprintf(&path, "%s%s%s", f->src, *f->src ? "/" : "", name) == -1) {
+            ret = -1;
+            continue;
+        }
+        int cfd = openat(f->fd[0], name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (cfd == -1) {
+            if (errno != ENOENT) { // ENOENT - katalog zniknął w trakcie przejścia
+                syslog(LOG_ERR, "Nie można otworzyć katalogu %s/%s: %s", src, path, strerror(errno));
+                ret = -1;
+            }
+            free(path);
+            continue;
+        }
+        WalkFrame *c = walk_push(w, cfd, -1);
+        if (!c) {
+            free(path);
+            ret = -1;
+            continue;
+        }
+        c->src = path;
+        ret = store_dir(c, src, dst, m, old);
+    }
+    return ret;
+}
+
+// Funkcja zapisująca nowy fragment (jeśli jeszcze go nie ma na dysku)
+// buf - bufor roboczy na STORE_CHUNK_HEADER + LZ4_BOUND(len) bajtów
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu zapisu
+int store_write_chunk(int chunks_fd, ChunkId id, const unsigned char *data, uint32_t len, unsigned char *buf) {
+    char name[64], tmp[128];
+    chunk_name(name, sizeof(name), id);
+    Stat st;
+    if (fstatat(chunks_fd, name, &st, 0) == 0) return 0; // Zapisany w przerwanym przebiegu (rename jest atomowy)
+
+    long long start = now_ns();
+    size_t packed = lz4_compress(data, len, buf + STORE_CHUNK_HEADER, len);
+    buf[0] = packed ? STORE_LZ4 : STORE_RAW;
+    memcpy(buf + 1, &len, 4);
+    if (!packed) {
+        memcpy(buf + STORE_CHUNK_HEADER, data, len);
+        packed = len;
+    }
+    name[2] = '\0';
+    mkdirat(chunks_fd, name, DEFAULT_MODE); // Podkatalog według pierwszego bajtu (mógł już istnieć)
+    name[2] = '/';
+    memcpy(tmp, name, 3);
+    temp_name(tmp + 3, sizeof(tmp) - 3);
+    int fd = openat(chunks_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    int ok = write_all(fd, (char *)buf, STORE_CHUNK_HEADER + packed) == 0;
+    close(fd);
+    if (!ok || renameat(chunks_fd, tmp, chunks_fd, name) == -1) {
+        unlinkat(chunks_fd, tmp, 0);
+        return -1;
+    }
+    atomic_fetch_add(&store_chunks_written, 1);
+    atomic_fetch_add(&store_bytes_written, STORE_CHUNK_HEADER + packed);
+    throttle_bytes(STORE_CHUNK_HEADER + packed, now_ns() - start);
+    return 0;
+}
+
+// Wspólny stan wątków dzielących pliki na fragmenty
+typedef struct {
+    Manifest *m;
+    int src_fd;             // Katalog źródłowy
+    int chunks_fd;          // Katalog chunks magazynu
+    ChunkSet *known;        // Fragmenty obecne w magazynie (ze starego manifestu i zapisane w tym przebiegu)
+    atomic_size_t next;     // Następny wpis manifestu do sprawdzenia
+    atomic_int write_failed; // Nie udało się zapisać fragmentu - manifestu nie zapisujemy
+} StoreWork;
+
+// Funkcja dzieląca plik e na fragmenty i zapisująca nowe fragmenty
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu (odczytu lub zapisu - work->write_failed)
+int store_file(StoreWork *work, StoreEntry *e, unsigned char *buf, unsigned char *out) {
+    int fd = openat(work->src_fd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    size_t cap = 0, count = 0, len = 0, pos = 0;
+    uint64_t size = 0;
+    ChunkId *ids = NULL;
+    int eof = 0, ret = 0;
+    while (ret == 0) {
+        // Dbamy, żeby od pos było co najmniej STORE_CHUNK_MAX bajtów (lub reszta pliku)
+        if (!eof && len - pos < STORE_CHUNK_MAX) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            while (!eof && len < STORE_BUFFER) {
+                long long start = now_ns();
+                ssize_t r = read(fd, buf + len, STORE_BUFFER - len);
+                if (r == -1 && errno == EINTR) continue;
+                if (r == -1) ret = -1;
+                if (r <= 0) {
+                    eof = 1;
+                    break;
+                }
+                len += r;
+                throttle_bytes(r, now_ns() - start);
+            }
+            if (ret) break;
+        }
+        if (pos == len) break;
+        size_t n = store_cut(buf + pos, len - pos);
+        ChunkId id = { xxh64(buf + pos, n, 0), xxh64(buf + pos, n, STORE_SEED) };
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            ChunkId *tmp = realloc(ids, cap * sizeof(ChunkId));
+            if (!tmp) {
+                ret = -1;
+                break;
+            }
+            ids = tmp;
+        }
+        ids[count++] = id;
+        if (chunk_set_add(work->known, id)) {
+            if (store_write_chunk(work->chunks_fd, id, buf + pos, n, out) == -1) {
+                atomic_store(&work->write_failed, 1);
+                ret = -1;
+            }
+        } else {
+            atomic_fetch_add(&store_chunks_reused, 1);
+        }
+        pos += n;
+        size += n;
+    }
+    if (nice_mode) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (ret) {
+        free(ids);
+        return -1;
+    }
+    free(e->ids);
+    e->ids = ids;
+    e->rec.chunks = count;
+    e->rec.size = size; // Plik mógł się zmienić od stat - zapisujemy to, co przeczytaliśmy
+    return 0;
+}
+
+// Wątek dzielący pliki: kolejne wpisy do zrobienia bierze ze wspólnego licznika
+void *store_worker(void *arg) {
+    StoreWork *work = arg;
+    unsigned char *buf = malloc(STORE_BUFFER), *out = malloc(STORE_CHUNK_HEADER + LZ4_BOUND(STORE_CHUNK_MAX));
+    for (size_t i; buf && out && (i = atomic_fetch_add(&work->next, 1)) < work->m->count;) {
+        StoreEntry *e = &work->m->entries[i];
+        if (!e->todo) continue;
+        long long start = now_ns();
+        if (store_file(work, e, buf, out) == 0) {
+            e->todo = 0;
+            metrics_copy(STRATEGY_STORE, e->rec.size, now_ns() - start);
+            atomic_fetch_add(&files_copied, 1);
+            atomic_fetch_add(&bytes_copied, e->rec.size);
+            log_file("Zapisano plik w magazynie (%llu fragmentów): %s", (unsigned long long)e->rec.chunks, e->path);
+        } else {
+            atomic_fetch_add(&copy_errors, 1);
+            syslog(LOG_ERR, "Błąd zapisu pliku w magazynie: %s: %s", e->path, strerror(errno));
+        }
+    }
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+// Funkcja usuwająca fragmenty, do których nie odwołuje się manifest m (oraz pozostałości plików tymczasowych)
+void store_collect(int chunks_fd, Manifest *m) {
+    ChunkSet used = {0};
+    pthread_mutex_init(&used.lock, NULL);
+    for (size_t i = 0; i < m->count; i++)
+        for (uint64_t c = 0; c < m->entries[i].rec.chunks; c++)
+            chunk_set_add(&used, m->entries[i].ids[c]);
+
+    Arena arena = {0};
+    DirEntry *dirs;
+    size_t count = read_dir(chunks_fd, &arena, &dirs);
+    if (count == READ_DIR_ERROR) count = 0; // Nieużywane fragmenty usunie następny przebieg
+    for (size_t d = 0; d < count; d++) {
+        int fd = openat(chunks_fd, dirs[d].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) continue;
+        DirEntry *files;
+        size_t n = read_dir(fd, &arena, &files);
+        if (n == READ_DIR_ERROR) n = 0;
+        for (size_t i = 0; i < n; i++) {
+            unsigned long long hi, lo;
+            char rest;
+            if (sscanf(files[i].name, "%16llx%16llx%c", &hi, &lo, &rest) == 2 &&
+                chunk_set_has(&used, (ChunkId){hi, lo}))
+                continue;
+            throttle_op();
+            unlinkat(fd, files[i].name, 0);
+        }
+        close(fd);
+    }
+    arena_free(&arena);
+    free(used.slots);
+    pthread_mutex_destroy(&used.lock);
+}
+
+// Funkcja wykonująca przebieg synchronizacji katalogu src do magazynu dst
+void store_pass(const char *src, const char *dst) {
+    pthread_once(&store_gear_once, store_gear_init);
+    int src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd != -1) mkdirat(dst_fd, "chunks", DEFAULT_MODE);
+    int chunks_fd = dst_fd == -1 ? -1 : openat(dst_fd, "chunks", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    Manifest old, m = {0};
+    if (src_fd == -1 || chunks_fd == -1 || manifest_load(dst_fd, &old) == -1) {
+        syslog(LOG_ERR, "Nie można otworzyć magazynu: %s -> %s: %s", src, dst, strerror(errno));
+        if (src_fd != -1) close(src_fd);
+        if (dst_fd != -1) close(dst_fd);
+        if (chunks_fd != -1) close(chunks_fd);
+        return;
+    }
+
+    // Fragmenty obecne w magazynie to te, do których odwołuje się poprzedni manifest
+    ChunkSet known = {0};
+    pthread_mutex_init(&known.lock, NULL);
+    for (size_t i = 0; i < old.count; i++)
+        for (uint64_t c = 0; c < old.entries[i].rec.chunks; c++)
+            chunk_set_add(&known, old.entries[i].ids[c]);
+
+    if (store_walk(src_fd, src, dst, &m, &old) == -1) {
+        // Z niepełnego przejścia nie wolno zapisać manifestu (ani liczyć usunięć) - ponowi następny przebieg
+        syslog(LOG_ERR, "Nie przeczytano całego drzewa %s - manifest %s pozostaje bez zmian", src, dst);
+        goto out;
+    }
+    manifest_index(&m);
+    // Wpisy, których nie ma już w źródle, znikają z manifestu
+    for (size_t i = 0; i < old.count; i++) {
+        if (manifest_find(&m, old.entries[i].path)) continue;
+        atomic_fetch_add(S_ISDIR(old.entries[i].rec.mode) ? &dirs_deleted : &files_deleted, 1);
+        log_file("Usunięto z magazynu: %s", old.entries[i].path);
+    }
+
+    // Zmienione pliki dzielimy równolegle (jobs wątków, w tym bieżący)
+    StoreWork work = { .m = &m, .src_fd = src_fd, .chunks_fd = chunks_fd, .known = &known };
+    pthread_t *threads = malloc((jobs > 1 ? jobs - 1 : 1) * sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < jobs - 1 && pthread_create(&threads[started], NULL, store_worker, &work) == 0) started++;
+    store_worker(&work);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Plik, którego nie udało się przeczytać, zostaje w starej wersji (o ile była)
+    for (size_t i = 0; i < m.count; i++) {
+        StoreEntry *e = &m.entries[i], *prev;
+        if (!e->todo) continue;
+        if ((prev = manifest_find(&old, e->path)) && prev->ids) {
+            e->rec = prev->rec;
+            e->ids = prev->ids;
+            prev->ids = NULL;
+        } else {
+            e->rec.chunks = 0;
+            e->rec.size = 0;
+            e->rec.mode = 0; // Wpis pomijany przy odtwarzaniu
+        }
+    }
+
+    if (atomic_load(&work.write_failed)) {
+        syslog(LOG_ERR, "Nie zapisano wszystkich fragmentów w %s - manifest pozostaje bez zmian", dst);
+    } else if (cycle_changed()) {
+        // Fragmenty muszą być na dysku, zanim odwoła się do nich manifest
+        syncfs(dst_fd);
+        if (manifest_save(dst_fd, &m) == 0)
+            store_collect(chunks_fd, &m);
+        else
+            syslog(LOG_ERR, "Nie można zapisać manifestu %s: %s", dst, strerror(errno));
+    }
+
+out:
+    free(known.slots);
+    pthread_mutex_destroy(&known.lock);
+    manifest_free(&m);
+    manifest_free(&old);
+    close(chunks_fd);
+    close(dst_fd);
+    close(src_fd);
+}
+
+// Funkcja sprawdzająca ścieżkę z manifestu przed odtworzeniem: musi być względna i bez pustych
+// składników, "." i ".." - uszkodzony lub spreparowany manifest nie może pisać poza katalogiem docelowym
+int store_path_safe(const char *path) {
+    if (*path == '/' || *path == '\0') return 0;
+    for (const char *p = path;; p++) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        p += len;
+        if (*p == '\0') return 1;
+    }
+}
+
+// Funkcja otwierająca katalog nadrzędny ścieżki path względem root składnik po składniku, bez
+// podążania za dowiązaniami symbolicznymi (cel odtwarzania mógł już zawierać dowiązania)
+// *name - ostatni składnik ścieżki
+// Zwraca deskryptor katalogu lub -1 w przypadku błędu
+int store_open_parent(int root, const char *path, const char **name) {
+    int fd = dup(root);
+    const char *p = path;
+    for (const char *slash; fd != -1 && (slash = strchr(p, '/')); p = slash + 1) {
+        char part[NAME_MAX + 1];
+        size_t len = slash - p;
+        int next = -1;
+        if (len <= NAME_MAX) {
+            memcpy(part, p, len);
+            part[len] = '\0';
+            next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        close(fd);
+        fd = next;
+    }
+    *name = p;
+    return fd;
+}
+
+// Funkcja zapisująca len bajtów data na pozycji off pliku fd z pominięciem wyrównanych bloków zer
+// (zostają dziurami - rozmiar pliku ustala na końcu ftruncate)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu zapisu
+int store_write_sparse(int fd, const unsigned char *data, size_t len, off_t off) {
+    static const unsigned char zero[STORE_HOLE_BLOCK];
+    while (len > 0) {
+        size_t n = STORE_HOLE_BLOCK - off % STORE_HOLE_BLOCK;
+        if (n > len) n = len;
+        if (n < STORE_HOLE_BLOCK || memcmp(data, zero, n)) {
+            for (size_t done = 0; done < n;) {
+                ssize_t w = pwrite(fd, data + done, n - done, off + done);
+                if (w == -1 && errno == EINTR) continue;
+                if (w <= 0) return -1;
+                done += w;
+            }
+        }
+        data += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Funkcja przepisująca metadane wpisu manifestu do struktury Stat (dla preserve_metadata)
+void store_stat(const StoreRecord *rec, Stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = rec->mode;
+    st->st_uid = rec->uid; // UINT32_MAX (nieznany) - fchown zostawia właściciela bez zmian
+    st->st_gid = rec->gid;
+    st->st_mtim.tv_sec = rec->mtime_ns / 1000000000LL;
+    st->st_mtim.tv_nsec = rec->mtime_ns % 1000000000LL;
+    st->st_atim = st->st_mtim;
+}
+
+// Funkcja odtwarzająca drzewo z magazynu store w katalogu target (--restore)
+// Każdy fragment jest sprawdzany skrótem po rozpakowaniu. Bloki zer stają się dziurami, a właściciela
+// odtwarzamy tylko jako root. Rozszerzonych atrybutów magazyn nie przechowuje.
+// Zwraca EXIT_SUCCESS lub EXIT_FAILURE, jeśli któregoś pliku nie udało się odtworzyć
+int store_restore(const char *store, const char *target) {
+    int dst_fd = open(store, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int chunks_fd = dst_fd == -1 ? -1 : openat(dst_fd, "chunks", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    Manifest m;
+    if (chunks_fd == -1 || manifest_load(dst_fd, &m) == -1 || !m.count) {
+        fprintf(stderr, "Nie można wczytać magazynu %s\n", store);
+        return EXIT_FAILURE;
+    }
+    mkdir(target, DEFAULT_MODE);
+    int out_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    unsigned char *packed = malloc(STORE_CHUNK_HEADER + LZ4_BOUND(STORE_CHUNK_MAX)), *data = malloc(STORE_CHUNK_MAX);
+    if (out_fd == -1 || !packed || !data) {
+        fprintf(stderr, "Nie można utworzyć katalogu %s: %s\n", target, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    long files = 0, errors = 0;
+    long long bytes = 0;
+    for (size_t i = 0; i < m.count; i++) {
+        StoreEntry *e = &m.entries[i];
+        if (!S_ISDIR(e->rec.mode) && !S_ISREG(e->rec.mode)) continue;
+        const char *name;
+        int parent = store_path_safe(e->path) ? store_open_parent(out_fd, e->path, &name) : -1;
+        if (parent == -1) {
+            errors++;
+            fprintf(stderr, "Pominięto wpis o niedozwolonej lub niebezpiecznej ścieżce: %s\n", e->path);
+            continue;
+        }
+        if (S_ISDIR(e->rec.mode)) {
+            mkdirat(parent, name, 0700); // Właściwe uprawnienia po odtworzeniu zawartości
+            close(parent);
+            continue;
+        }
+        int fd = openat(parent, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+        close(parent);
+        int ok = fd != -1;
+        off_t off = 0;
+        for (uint64_t c = 0; ok && c < e->rec.chunks; c++) {
+            char chunk[64];
+            chunk_name(chunk, sizeof(chunk), e->ids[c]);
+            int cfd = openat(chunks_fd, chunk, O_RDONLY | O_CLOEXEC);
+            ssize_t n = cfd == -1 ? -1 : read(cfd, packed, STORE_CHUNK_HEADER + LZ4_BOUND(STORE_CHUNK_MAX));
+            if (cfd != -1) close(cfd);
+            uint32_t len = 0;
+            if (n >= STORE_CHUNK_HEADER) memcpy(&len, packed + 1, 4);
+            ok = n >= STORE_CHUNK_HEADER && len <= STORE_CHUNK_MAX &&
+                 (packed[0] == STORE_LZ4 ? lz4_decompress(packed + STORE_CHUNK_HEADER, n - STORE_CHUNK_HEADER, data, len) == 0
+                                         : packed[0] == STORE_RAW && (size_t)(n - STORE_CHUNK_HEADER) == len &&
+                                               memcpy(data, packed + STORE_CHUNK_HEADER, len)) &&
+                 xxh64(data, len, 0) == e->ids[c].hi && xxh64(data, len, STORE_SEED) == e->ids[c].lo &&
+                 store_write_sparse(fd, data, len, off) == 0;
+            off += len;
+            if (!ok) fprintf(stderr, "Uszkodzony lub brakujący fragment %s pliku %s\n", chunk, e->path);
+        }
+        if (ok && ftruncate(fd, off) == -1) ok = 0; // Pełny rozmiar (również z dziurą na końcu)
+        if (fd != -1) {
+            Stat st;
+            store_stat(&e->rec, &st);
+            if (ok) preserve_metadata(-1, fd, &st);
+            close(fd);
+        }
+        if (ok) {
+            files++;
+            bytes += e->rec.size;
+        } else {
+            errors++;
+            fprintf(stderr, "Nie można odtworzyć pliku %s\n", e->path);
+        }
+    }
+    // Metadane katalogów na końcu, od najgłębszych (tworzenie plików zmienia mtime katalogu)
+    for (size_t i = m.count; i-- > 0;) {
+        StoreEntry *e = &m.entries[i];
+        const char *name;
+        int parent = S_ISDIR(e->rec.mode) && store_path_safe(e->path) ? store_open_parent(out_fd, e->path, &name) : -1;
+        if (parent == -1) continue;
+        Stat st;
+        store_stat(&e->rec, &st);
+        preserve_metadata_at(-1, NULL, parent, name, &st);
+        close(parent);
+    }
+    printf("Odtworzono %ld plików (%lld B) z %s w %s, błędy: %ld\n", files, bytes, store, target, errors);
+
+    free(packed);
+    free(data);
+    manifest_free(&m);
+    close(out_fd);
+    close(chunks_fd);
+    close(dst_fd);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-// Globalne zmienne konfiguracyjne
-unsigned int sleep_time = 0;        // Czas (w sekundach) pomiędzy kolejnymi synchronizacjami katalogów (domyślnie 0, ustawiany później)
-int recursive = 0;                  // Flaga (0 lub 1), czy kopiowanie ma być rekurencyjne (czyli czy kopiować podkatalogi)
-int mmap_threshold = 10 * 1024 * 1024;  // Próg rozmiaru pliku (w bajtach), od którego używamy mmap zamiast zwykłego kopiowania (domyślnie 10MB)
+// Funkcja wykonująca pełny przebieg synchronizacji całego drzewa
+// (nowa generacja indeksu, a po przebiegu zapis indeksu na dysk; magazyn fragmentów ma własny manifest)
+void sync_pass(const char *src, const char *dst) {
+    metrics_cycle_begin();
+    if (store_mode) {
+        store_pass(src, dst);
+        metrics_cycle_end(1);
+        return;
+    }
+    index_begin_pass();
+    if (plan_mode) plan_pass(src, dst);
+    else sync_directories(src, dst);
+    cycle_sync(dst); // Utrwalamy kopie przed zapisem indeksu, który je potwierdza
+    index_end_pass();
+    metrics_cycle_end(1);
+}
 
-// Funkcja obsługująca sygnał SIGUSR1
-// Sygnały to specjalne powiadomienia wysyłane do procesu przez system lub inne procesy
-// SIGUSR1 to jeden z sygnałów użytkownika, można go użyć np. do "obudzenia" demona
-void handle_signal(int sig) {
-    if (sig == SIGUSR1) // Sprawdzamy, czy otrzymany sygnał to SIGUSR1
-        printf("Demon obudzony po sygnale SIGUSR1.\n"); // Wyświetlamy komunikat na ekranie
+// Pary katalogów (-c plik konfiguracyjny)
+// Jeden demon obsługuje wiele par źródło -> cel, każdą z własnym czasem, rekurencją, progami
+// i indeksem. Ustawienia pary przepisujemy do zmiennych globalnych (pair_activate) na czas jej
+// synchronizacji. Przebiegi par wykonujemy po kolei we wspólnej puli wątków, więc łączna liczba
+// równoczesnych operacji wejścia/wyjścia nie przekracza -j, a planista rozkłada terminy par
+// równomiernie w ich okresach, żeby nie startowały jednocześnie.
+typedef struct {
+    const char *src, *dst;          // Katalog źródłowy i docelowy
+    unsigned int sleep_time;        // Czas (w sekundach) między pełnymi przebiegami
+    int recursive;                  // Rekurencyjne kopiowanie (-R)
+    int hash_mode;                  // Porównywanie zawartości skrótami (-H)
+    int store_mode;                 // Magazyn fragmentów (-S)
+    int plan_mode;                  // Wykonanie według planu (-P)
+    int mmap_threshold;             // Próg mmap
+    off_t delta_threshold;          // Próg kopiowania różnicowego (-D)
+    const char *index_path;         // Plik indeksu (-I) lub NULL
+    IndexHeader *index_map;         // Zmapowany indeks pary (między przebiegami)
+    size_t index_map_size;          // Rozmiar mapowania indeksu
+    long long next_run;             // Termin następnego pełnego przebiegu (now_ms)
+} Pair;
+
+Pair *pairs = NULL;         // Tablica par katalogów
+size_t pair_count = 0;      // Liczba par
+Pair pair_defaults;         // Ustawienia z wiersza poleceń (domyślne dla par przy przeładowaniu konfiguracji)
+const char *config_path = NULL; // Plik konfiguracyjny (-c) lub NULL
+
+// Funkcja zwracająca bieżący czas monotoniczny w milisekundach
+long long now_ms(void) {
+    return now_ns() / 1000000;
 }
 
-// Funkcja kopiująca plik z lokalizacji src do dst
-// src - ścieżka do pliku źródłowego (skąd kopiujemy)
-// dst - ścieżka do pliku docelowego (dokąd kopiujemy)
-// size - rozmiar pliku źródłowego (w bajtach)
-// Jeśli plik jest duży (>= mmap_threshold), używamy mmap (mapowanie pliku do pamięci, szybsze dla dużych plików)
-// W przeciwnym razie kopiujemy tradycyjnie, buforując dane w tablicy
-void copy_file(const char *src, const char *dst, off_t size) {
-    if (size >= mmap_threshold) { // Jeśli plik jest duży
-        // Otwieramy plik źródłowy do odczytu (O_RDONLY)
-        int src_fd = open(src, O_RDONLY);
-        // Otwieramy plik docelowy do odczytu i zapisu, tworzymy jeśli nie istnieje, nadpisujemy jeśli istnieje
-        int dst_fd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
-        if (src_fd == -1 || dst_fd == -1) return; // Jeśli nie udało się otworzyć plików, kończymy funkcję
-
-        // Mapujemy plik źródłowy do pamięci (tylko do odczytu)
-        void *src_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
-        // Mapujemy plik docelowy do pamięci (do odczytu i zapisu)
-        void *dst_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, 0);
-        if (src_map == MAP_FAILED || dst_map == MAP_FAILED) {
-            // Jeśli mapowanie się nie powiodło, zamykamy pliki i kończymy funkcję
-            close(src_fd);
-            close(dst_fd);
-            return;
+// Funkcja zapisująca bieżące ustawienia globalne w parze p
+void pair_store(Pair *p) {
+    p->sleep_time = sleep_time;
+    p->recursive = recursive;
+    p->hash_mode = hash_mode;
+    p->store_mode = store_mode;
+    p->plan_mode = plan_mode;
+    p->mmap_threshold = mmap_threshold;
+    p->delta_threshold = delta_threshold;
+    p->index_path = index_path;
+}
+
+// Funkcja ustawiająca zmienne globalne na ustawienia pary p
+void pair_load(const Pair *p) {
+    sleep_time = p->sleep_time;
+    recursive = p->recursive;
+    hash_mode = p->hash_mode;
+    store_mode = p->store_mode;
+    plan_mode = p->plan_mode;
+    mmap_threshold = p->mmap_threshold;
+    delta_threshold = p->delta_threshold;
+    index_path = p->index_path;
+    index_map = p->index_map;
+    index_map_size = p->index_map_size;
+}
+
+// Funkcja zapisująca bieżące ustawienia globalne jako nową parę src -> dst
+// Zwraca 0 w przypadku powodzenia, -1, jeśli zabrakło pamięci (tablica par pozostaje bez zmian)
+int pair_capture(const char *src, const char *dst) {
+    Pair *tmp = realloc(pairs, (pair_count + 1) * sizeof(Pair));
+    if (!tmp) {
+        fprintf(stderr, "Brak pamięci na parę %s -> %s\n", src, dst);
+        return -1;
+    }
+    pairs = tmp;
+    Pair *p = &pairs[pair_count++];
+    memset(p, 0, sizeof(*p));
+    p->src = src;
+    p->dst = dst;
+    pair_store(p);
+    return 0;
+}
+
+// Funkcja ustawiająca zmienne globalne na ustawienia pary i (przed jej synchronizacją)
+void pair_activate(size_t i) {
+    current_pair = i;
+    pair_load(&pairs[i]);
+}
+
+// Funkcja zapamiętująca w bieżącej parze stan indeksu (przebudowa mogła zmienić mapowanie)
+void pair_save(void) {
+    pairs[current_pair].index_map = index_map;
+    pairs[current_pair].index_map_size = index_map_size;
+}
+
+// Funkcja wykonująca pełny przebieg synchronizacji pary i
+void sync_pair(size_t i) {
+    pair_activate(i);
+    sync_pass(pairs[i].src, pairs[i].dst);
+    pair_save();
+}
+
+// Funkcja wypisująca do f plany synchronizacji wszystkich par (-n, polecenie "plan"), niczego nie zmieniając
+// Zwraca 0 w przypadku powodzenia, -1, jeśli planu którejś pary nie udało się zbudować
+int plan_report(FILE *f) {
+    int ret = 0;
+    for (size_t i = 0; i < pair_count; i++) {
+        pair_activate(i);
+        if (store_mode) {
+            fprintf(f, "# plan: %s -> %s: magazyn fragmentów (-S) - plan nie dotyczy\n", pairs[i].src, pairs[i].dst);
+            continue;
+        }
+        Plan p;
+        if (plan_build(&p, pairs[i].src, pairs[i].dst) == -1) {
+            fprintf(f, "# plan: %s -> %s: nie można zbudować planu (szczegóły w syslogu)\n", pairs[i].src, pairs[i].dst);
+            ret = -1;
+            continue;
+        }
+        plan_sort(&p);
+        plan_print(f, &p, pairs[i].src, pairs[i].dst);
+        plan_free(&p);
+    }
+    fflush(f);
+    return ret;
+}
+
+// Pojedyncza zmiana zgłoszona przez inotify, czekająca na przetworzenie
+typedef struct {
+    int wd;         // Katalog, w którym zaszła zmiana
+    char *name;     // Nazwa zmienionego wpisu
+} Change;
+
+// Funkcja odczytująca zgłoszone zmiany w katalogach źródłowych i synchronizująca tylko zmienione wpisy
+// (wywoływana, gdy deskryptor inotify jest gotowy do odczytu - wait_events)
+// Zwraca 1, jeśli należy wykonać pełne skanowanie wszystkich par (kolejka jądra się
+// przepełniła lub przeniesiono katalog), 0 w przeciwnym razie
+int process_changes(void) {
+    int full_rescan = 0;
+    Change *queue = NULL;
+    size_t queued = 0, cap = 0;
+    // Bufor wyrównany do struktury inotify_event, mieszczący wiele zdarzeń
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    // Odczytujemy wszystkie oczekujące zdarzenia (deskryptor jest nieblokujący)
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) { full_rescan = 1; continue; } // Utracono zdarzenia
+            if (ev->mask & IN_IGNORED) { drop_watch(ev->wd); continue; } // Katalog przestał istnieć
+            // Przeniesiony katalog zmienia ścieżki całego poddrzewa - zapisane ścieżki są nieaktualne
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO))) full_rescan = 1;
+            if (!ev->len || full_rescan) continue;
+
+            // Pomijamy duplikaty (np. IN_CREATE i IN_CLOSE_WRITE tego samego pliku)
+            size_t i;
+            for (i = 0; i < queued; i++)
+                if (queue[i].wd == ev->wd && !strcmp(queue[i].name, ev->name)) break;
+            if (i < queued) continue;
+
+            if (queued == cap) {
+                cap = cap ? cap * 2 : 64;
+                Change *tmp = realloc(queue, cap * sizeof(Change));
+                if (!tmp) { full_rescan = 1; continue; }
+                queue = tmp;
+            }
+            queue[queued].wd = ev->wd;
+            queue[queued].name = strdup(ev->name);
+            queued++;
+        }
+    }
+
+    // Synchronizujemy tylko zmienione wpisy (chyba że i tak czeka nas pełne skanowanie)
+    char *touched = calloc(pair_count ? pair_count : 1, 1); // Pary, w których coś synchronizowaliśmy
+    char *stores = calloc(pair_count ? pair_count : 1, 1);  // Magazyny (-S) do aktualizacji w całości
+    metrics_cycle_begin();
+    for (size_t i = 0; i < queued; i++) {
+        Watch *w = full_rescan ? NULL : find_watch(queue[i].wd);
+        DirJob dir;
+        // Otwieramy katalog zdarzenia (dir_open kopiuje ścieżki - sync_entry może zmienić tablicę obserwacji)
+        // i synchronizujemy wpis z ustawieniami pary, do której należy
+        size_t pair = w ? w->pair : 0;
+        if (w && pairs[pair].store_mode) {
+            // Manifest magazynu powstaje tylko w pełnym przebiegu - jeden na parę dla całej partii zdarzeń
+            if (stores) stores[pair] = 1;
+            else full_rescan = 1;
+            w = NULL;
+        }
+        if (w) pair_activate(pair);
+        if (w && dir_open(&dir, AT_FDCWD, AT_FDCWD, w->src, w->dst, w->src, w->dst) == 0) {
+            DirEntry e = {queue[i].name, DT_UNKNOWN, 0};
+            sync_entry(&dir, &e, NULL);
+            walk_subdirs(&dir); // Nowy podkatalog (bez puli)
+            dir_close(&dir);
+            pair_save();
+            if (touched) touched[pair] = 1;
+        }
+        free(queue[i].name);
+    }
+    free(queue);
+    // Jeden syncfs na każdą zmienioną parę dla całej partii zdarzeń
+    for (size_t i = 0; touched && i < pair_count; i++)
+        if (touched[i]) cycle_sync(pairs[i].dst);
+    free(touched);
+    metrics_cycle_end(0);
+    for (size_t i = 0; stores && !full_rescan && i < pair_count; i++)
+        if (stores[i]) sync_pair(i);
+    free(stores);
+
+    if (full_rescan) syslog(LOG_INFO, "Utracono zdarzenia inotify - pełne skanowanie");
+    return full_rescan;
+}
+
+// Kanał sterujący
+// Sygnały odbieramy przez signalfd w tej samej pętli poll co zdarzenia inotify i gniazdo sterujące,
+// więc obsługujemy je poza procedurą obsługi sygnału (można w niej logować i synchronizować):
+//   SIGUSR1 - zrzut metryk do sysloga i natychmiastowa synchronizacja wszystkich par
+//   SIGHUP - ponowne wczytanie pliku konfiguracyjnego (-c)
+//   SIGTERM, SIGINT - łagodne zatrzymanie: trwający przebieg kończy się normalnie, potem demon wychodzi
+// Gniazdo sterujące (-C) przyjmuje jedno polecenie tekstowe na połączenie i odpowiada "OK" albo
+// "ERR ..." dopiero po jego wykonaniu (np. po zakończeniu synchronizacji):
+//   sync              - pełna synchronizacja wszystkich par
+//   sync <ścieżka>    - synchronizacja jednego pliku lub poddrzewa (ścieżka w katalogu źródłowym pary)
+//   reload            - jak SIGHUP
+//   set <opcje>       - zmiana ustawień wszystkich par i limitów (np. "set -D 1048576 -B 50000000 60")
+//   stop              - jak SIGTERM
+// Polecenia wykonuje wątek demona między przebiegami, więc nie przerywają trwającej synchronizacji.
+int parse_options(char **args, int count, int pair_only);
+int load_config(const char *path);
+
+int signal_fd = -1;         // Deskryptor signalfd (-1 - sygnały przez procedurę obsługi)
+int control_fd = -1;        // Gniazdo sterujące nasłuchujące na połączenia (-1 - wyłączone)
+int stop_requested = 0;     // Poproszono o zatrzymanie demona (SIGTERM, SIGINT, "stop")
+
+// Funkcja kierująca sygnały sterujące do signalfd (blokujemy je przed utworzeniem wątków,
+// które dziedziczą maskę - dzięki temu trafiają wyłącznie do deskryptora)
+void signals_init(void) {
+    // Klient gniazda sterującego lub metryk może się rozłączyć przed odczytem odpowiedzi -
+    // zapis zwróci wtedy EPIPE zamiast zabić demona
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        // Bez signalfd zostaje sam SIGUSR1 przez procedurę obsługi (przerywa oczekiwanie w poll)
+        syslog(LOG_WARNING, "signalfd niedostępne (%s) - obsługiwany jest tylko SIGUSR1", strerror(errno));
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        signal(SIGUSR1, handle_signal);
+    }
+}
+
+// Funkcja przenosząca bieżące ustawienia par do nowej konfiguracji po jej przeładowaniu
+// old - poprzednia tablica par (old_count elementów); pary rozpoznajemy po źródle i celu
+// Zwraca 0 w przypadku powodzenia, -1, jeśli zabrakło pamięci (niczego jeszcze nie zmieniono -
+// wywołujący przywraca old)
+int pair_merge(Pair *old, size_t old_count) {
+    long long now = now_ms();
+    size_t *moved = malloc((old_count ? old_count : 1) * sizeof(size_t)); // Nowy numer starej pary
+    char *known = calloc(pair_count ? pair_count : 1, 1);                // Para istniała przed przeładowaniem
+    if (!moved || !known) {
+        free(moved);
+        free(known);
+        return -1;
+    }
+    for (size_t i = 0; i < old_count; i++) {
+        moved[i] = SIZE_MAX;
+        for (size_t j = 0; j < pair_count && moved[i] == SIZE_MAX; j++)
+            if (!known[j] && !strcmp(old[i].src, pairs[j].src) && !strcmp(old[i].dst, pairs[j].dst)) moved[i] = j;
+        if (moved[i] == SIZE_MAX) {
+            // Para zniknęła z konfiguracji - zamykamy jej indeks (obserwacje usuwamy niżej)
+            if (old[i].index_map) munmap(old[i].index_map, old[i].index_map_size);
+            syslog(LOG_INFO, "Usunięto parę %s -> %s", old[i].src, old[i].dst);
+            continue;
+        }
+        Pair *p = &pairs[moved[i]];
+        known[moved[i]] = 1;
+        // Otwarty indeks zostaje przy parze (inny plik indeksu wymaga restartu)
+        if (p->index_path != old[i].index_path && (!p->index_path || !old[i].index_path || strcmp(p->index_path, old[i].index_path)))
+            syslog(LOG_WARNING, "Zmiana indeksu pary %s -> %s wymaga restartu demona", p->src, p->dst);
+        p->index_path = old[i].index_path;
+        p->index_map = old[i].index_map;
+        p->index_map_size = old[i].index_map_size;
+        // Termin zachowujemy, ale nie później niż za nowy okres
+        p->next_run = old[i].next_run;
+        if (p->next_run > now + p->sleep_time * 1000LL) p->next_run = now + p->sleep_time * 1000LL;
+    }
+    // Nowe pary: indeks i pierwszy przebieg od razu (rejestruje też obserwacje inotify)
+    for (size_t j = 0; j < pair_count; j++) {
+        if (known[j]) continue;
+        pair_activate(j);
+        if (index_path) index_open(pairs[j].src, pairs[j].dst);
+        pair_save();
+        pairs[j].next_run = now;
+        syslog(LOG_INFO, "Dodano parę %s -> %s", pairs[j].src, pairs[j].dst);
+    }
+    // Obserwacje inotify wskazują pary numerami - przenumerowujemy je, a usuniętych par wyrejestrowujemy
+    pthread_mutex_lock(&watch_lock);
+    for (size_t i = 0; i < watch_count;) {
+        size_t to = moved[watches[i].pair];
+        if (to == SIZE_MAX) {
+            inotify_rm_watch(inotify_fd, watches[i].wd);
+            drop_watch(watches[i].wd); // Na miejsce i trafia ostatni element - sprawdzamy je ponownie
+            continue;
         }
+        watches[i++].pair = to;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    free(moved);
+    free(known);
+    return 0;
+}
+
+// Funkcja ponownie wczytująca plik konfiguracyjny (SIGHUP, "reload")
+// Opcje z wiersza poleceń pozostają domyślnymi ustawieniami par
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu (obowiązuje wtedy poprzednia konfiguracja)
+int reload_config(void) {
+    if (!config_path) {
+        syslog(LOG_WARNING, "Przeładowanie: demon nie używa pliku konfiguracyjnego (-c)");
+        return -1;
+    }
+    Pair *old = pairs;
+    size_t old_count = pair_count;
+    pairs = NULL;
+    pair_count = 0;
+    pair_load(&pair_defaults);
+    if (load_config(config_path) == -1) {
+        free(pairs);
+        pairs = old;
+        pair_count = old_count;
+        syslog(LOG_ERR, "Błędny plik konfiguracyjny %s - pozostaje poprzednia konfiguracja", config_path);
+        return -1;
+    }
+    if (pair_merge(old, old_count) == -1) {
+        free(pairs);
+        pairs = old;
+        pair_count = old_count;
+        syslog(LOG_ERR, "Brak pamięci przy przeładowaniu %s - pozostaje poprzednia konfiguracja", config_path);
+        return -1;
+    }
+    free(old);
+    syslog(LOG_INFO, "Wczytano ponownie %s (%zu par)", config_path, pair_count);
+    return 0;
+}
 
-        // Kopiujemy dane z pamięci źródłowej do docelowej (cały plik naraz)
-        memcpy(dst_map, src_map, size);
+// Funkcja zmieniająca ustawienia działającego demona (polecenie "set")
+// args - opcje jak w wierszu poleceń; zmieniają ustawienia wszystkich par (i domyślne dla przeładowania)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędnej lub niezmiennej opcji
+int control_set(char **args, int count) {
+    // Zmieniamy tylko liczby i limity: czas, próg mmap, -D, -L, -B, -O oraz -A. Tryby par (-R, -H,
+    // -S, -P) zmieniłyby znaczenie istniejących celów (np. -S zamieniłby kopię w magazyn fragmentów),
+    // a pozostałe opcje wymagają restartu (wątki, gniazda, inotify, priorytet, indeksy, -c, -n)
+    static const char *const valued[] = {"-D", "-L", "-B", "-O"};
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(args[i], "-A")) continue;
+        for (size_t v = 0; v < sizeof(valued) / sizeof(valued[0]); v++)
+            if (!strcmp(args[i], valued[v]) && i + 1 < count) {
+                i++; // Wartość opcji sprawdzamy jak liczbę niżej
+                break;
+            }
+        if (!*args[i] || args[i][strspn(args[i], "0123456789")]) return -1; // Tylko liczby bez znaku
+    }
+
+    pair_load(&pair_defaults);
+    if (parse_options(args, count, 0) == -1) return -1;
+    pair_store(&pair_defaults);
+    long long now = now_ms();
+    for (size_t i = 0; i < pair_count; i++) {
+        pair_activate(i);
+        parse_options(args, count, 0);
+        pair_store(&pairs[i]);
+        if (pairs[i].next_run > now + sleep_time * 1000LL) pairs[i].next_run = now + sleep_time * 1000LL;
+    }
+    return 0;
+}
+
+// Funkcja synchronizująca wpis name katalogu src_dir z katalogiem dst_dir bieżącej pary
+// (katalog - razem z całym poddrzewem); jeden syncfs celu jak w przebiegu zmian inotify
+// src_fd, dst_fd - otwarte katalogi src_dir i dst_dir (ścieżki służą tylko do logów i obserwacji)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int sync_one(int src_fd, int dst_fd, const char *src_dir, const char *dst_dir, const char *name) {
+    DirJob dir;
+    if (dir_open(&dir, src_fd, dst_fd, ".", ".", src_dir, dst_dir) == -1) return -1;
+    metrics_cycle_begin();
+    DirEntry e = {name, DT_UNKNOWN, 0};
+    sync_entry(&dir, &e, NULL);
+    walk_subdirs(&dir);
+    dir_close(&dir);
+    pair_save();
+    cycle_sync(pairs[current_pair].dst);
+    metrics_cycle_end(0);
+    return 0;
+}
+
+// Funkcja synchronizująca plik lub poddrzewo path ("sync <ścieżka>")
+// path musi leżeć w katalogu źródłowym którejś pary (wybieramy najgłębszy pasujący katalog)
+// Katalogi nadrzędne, których brakuje w celu, powstają przez synchronizację najwyższego z nich
+// Schodzimy po deskryptorach bez podążania za dowiązaniami symbolicznymi (jak pełny przebieg),
+// więc dowiązanie w źródle lub celu nie wyprowadzi synchronizacji poza katalogi pary
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int sync_subtree(const char *path) {
+    size_t best = SIZE_MAX, best_len = 0;
+    for (size_t i = 0; i < pair_count; i++) {
+        size_t len = strlen(pairs[i].src);
+        while (len > 1 && pairs[i].src[len - 1] == '/') len--;
+        if (!strncmp(path, pairs[i].src, len) && (path[len] == '\0' || path[len] == '/') && (best == SIZE_MAX || len > best_len)) {
+            best = i;
+            best_len = len;
+        }
+    }
+    if (best == SIZE_MAX) {
+        syslog(LOG_WARNING, "Ścieżka %s nie leży w żadnym katalogu źródłowym", path);
+        return -1;
+    }
+    const char *rel = path + best_len;
+    while (*rel == '/') rel++;
+    if (!*rel || pairs[best].store_mode) {
+        sync_pair(best); // Cały katalog źródłowy pary (magazyn zawsze aktualizujemy w całości)
+        return 0;
+    }
 
-        // Odmapowujemy pliki z pamięci (zwalniamy zasoby)
-        munmap(src_map, size);
-        munmap(dst_map, size);
-        // Zamykamy deskryptory plików
+    pair_activate(best);
+    char *copy = strdup(rel), *save;
+    char *src_dir = strdup(pairs[best].src), *dst_dir = strdup(pairs[best].dst);
+    int src_fd = open(pairs[best].src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_fd = open(pairs[best].dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int ret = -1;
+    for (char *name = strtok_r(copy, "/", &save), *next; name && src_fd != -1 && dst_fd != -1; name = next) {
+        next = strtok_r(NULL, "/", &save);
+        if (!strcmp(name, ".") || !strcmp(name, "..")) break;
+        if (next && !recursive) break; // Para bez -R nie synchronizuje podkatalogów
+        // Schodzimy tylko do katalogu, który w źródle i w celu jest katalogiem (nie dowiązaniem);
+        // w przeciwnym razie wpis synchronizujemy z tego poziomu jak w pełnym przebiegu
+        Stat st;
+        int src_child = -1, dst_child = -1;
+        if (next && fstatat(dst_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            src_child = openat(src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            dst_child = src_child == -1 ? -1 : openat(dst_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        char *src_path = NULL, *dst_path = NULL;
+        if (dst_child == -1 || asprintf(&src_path, "%s/%s", src_dir, name) == -1 ||
+            asprintf(&dst_path, "%s/%s", dst_dir, name) == -1) {
+            if (src_child != -1) close(src_child);
+            if (dst_child != -1) close(dst_child);
+            free(src_path);
+            if (dst_child == -1) ret = sync_one(src_fd, dst_fd, src_dir, dst_dir, name);
+            break;
+        }
         close(src_fd);
         close(dst_fd);
+        src_fd = src_child;
+        dst_fd = dst_child;
+        free(src_dir);
+        free(dst_dir);
+        src_dir = src_path;
+        dst_dir = dst_path;
+    }
+    if (src_fd != -1) close(src_fd);
+    if (dst_fd != -1) close(dst_fd);
+    free(copy);
+    free(src_dir);
+    free(dst_dir);
+    if (ret == -1) syslog(LOG_WARNING, "Nie można zsynchronizować %s", path);
+    return ret;
+}
 
-        // Zapisujemy informację o skopiowaniu pliku do sysloga (systemowy dziennik zdarzeń)
-        syslog(LOG_INFO, "Skopiowano plik (mmap): %s -> %s", src, dst);
+// Funkcja obsługująca jedno połączenie z gniazdem sterującym (polecenie w jednym wierszu)
+void control_client(int client) {
+    char line[4096];
+    size_t len = 0;
+    struct pollfd pfd = { .fd = client, .events = POLLIN };
+    // Na polecenie czekamy najwyżej sekundę - demon nie może utknąć na milczącym kliencie
+    while (len < sizeof(line) - 1 && poll(&pfd, 1, 1000) == 1) {
+        ssize_t n = read(client, line + len, sizeof(line) - 1 - len);
+        if (n <= 0) break;
+        len += n;
+        if (memchr(line, '\n', len)) break;
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    // Polecenie i argumenty (ścieżka w "sync" może zawierać spacje)
+    char *cmd = line + strspn(line, " \t"), *rest = cmd + strcspn(cmd, " \t");
+    if (*rest) *rest++ = '\0';
+    rest += strspn(rest, " \t");
+    int ok = 0;
+    if (!strcmp(cmd, "sync") && !*rest) {
+        for (size_t i = 0; i < pair_count; i++)
+            sync_pair(i);
+    } else if (!strcmp(cmd, "sync")) {
+        ok = sync_subtree(rest);
+    } else if (!strcmp(cmd, "plan")) {
+        // Plan wypisujemy klientowi przed odpowiedzią OK/ERR
+        FILE *f = fdopen(dup(client), "w");
+        ok = f ? plan_report(f) : -1;
+        if (f) fclose(f);
+    } else if (!strcmp(cmd, "reload")) {
+        ok = reload_config();
+    } else if (!strcmp(cmd, "set")) {
+        char *args[64], *save;
+        int count = 0;
+        for (char *tok = strtok_r(rest, " \t", &save); tok && count < 64; tok = strtok_r(NULL, " \t", &save))
+            args[count++] = tok;
+        ok = count ? control_set(args, count) : -1;
+    } else if (!strcmp(cmd, "stop")) {
+        stop_requested = 1;
     } else {
-        // Jeśli plik jest mały, kopiujemy tradycyjnie
-        int src_fd = open(src, O_RDONLY); // Otwieramy plik źródłowy do odczytu
-        int dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644); // Otwieramy plik docelowy do zapisu
-        if (src_fd == -1 || dst_fd == -1) return; // Jeśli nie udało się otworzyć plików, kończymy funkcję
-
-        char buffer[4096]; // Bufor na dane (4KB)
-        ssize_t r; // Liczba przeczytanych bajtów
-        // Czytamy dane z pliku źródłowego i zapisujemy do docelowego, aż do końca pliku
-        while ((r = read(src_fd, buffer, sizeof(buffer))) > 0) 
-            write(dst_fd, buffer, r);
-
-        // Zamykamy pliki
-        close(src_fd); 
-        close(dst_fd);
+        ok = -1;
+    }
+    syslog(LOG_INFO, "Polecenie sterujące \"%s\": %s", cmd, ok == 0 ? "wykonano" : "błąd");
+    const char *reply = ok == 0 ? "OK\n" : "ERR szczegóły w syslogu\n";
+    write_all(client, reply, strlen(reply));
+    close(client);
+}
+
+// Funkcja tworząca gniazdo sterujące path (obsługuje je pętla demona, nie osobny wątek)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int control_start(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Za długa ścieżka gniazda sterującego: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    unlink(path); // Gniazdo po poprzednim uruchomieniu
+    // Gniazdo pozwala synchronizować i zmieniać ustawienia - tylko dla właściciela
+    fchmod(fd, 0600);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1 || listen(fd, 16) == -1) {
+        syslog(LOG_ERR, "Nie można utworzyć gniazda sterującego %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    control_fd = fd;
+    return 0;
+}
+
+// Funkcja odczytująca sygnały z signalfd
+void handle_signals(void) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            stats_requested = 1; // Zrzut metryk i synchronizacja wszystkich par (metrics_dump_requested)
+        } else if (info.ssi_signo == SIGHUP) {
+            reload_config();
+        } else {
+            syslog(LOG_INFO, "Otrzymano sygnał %s - zatrzymanie", strsignal(info.ssi_signo));
+            stop_requested = 1;
+        }
+    }
+}
 
-        // Logujemy operację kopiowania do sysloga
-        syslog(LOG_INFO, "Skopiowano plik: %s -> %s", src, dst);
+// Funkcja czekająca (najwyżej timeout ms) na sygnały, polecenia sterujące i zdarzenia inotify
+// Zwraca 1, jeśli należy wykonać pełne skanowanie wszystkich par (process_changes)
+int wait_events(int timeout) {
+    // poll pomija wpisy z ujemnym deskryptorem (wyłączone źródła zdarzeń)
+    struct pollfd pfd[3] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = control_fd, .events = POLLIN },
+        { .fd = inotify_fd, .events = POLLIN },
+    };
+    if (poll(pfd, 3, timeout) <= 0) return 0; // Timeout albo przerwanie sygnałem (bez signalfd)
+    if (pfd[0].revents) handle_signals();
+    if (pfd[1].revents) {
+        int client;
+        while (!stop_requested && (client = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+            control_client(client);
     }
+    return pfd[2].revents && !stop_requested ? process_changes() : 0;
+}
+
+// Funkcja kończąca pracę demona po łagodnym zatrzymaniu (żaden przebieg już nie trwa)
+void daemon_stop(void) {
+    for (size_t i = 0; i < pair_count; i++)
+        if (pairs[i].index_map) msync(pairs[i].index_map, pairs[i].index_map_size, MS_SYNC);
+    if (control_fd != -1) unlink(control_path);
+    if (metrics_path) unlink(metrics_path);
+    syslog(LOG_INFO, "Demon zatrzymany");
+    closelog();
+    exit(EXIT_SUCCESS);
 }
 
+// Funkcja demonizująca, która synchronizuje wszystkie pary katalogów co ich sleep_time sekund
+// Planista wybiera parę o najbliższym terminie; pierwsze terminy rozkładamy równomiernie
+// (para i z n startuje po (i + 1) / n swojego okresu), więc pary o tym samym czasie nie
+// synchronizują się jednocześnie. SIGUSR1 zrzuca metryki i synchronizuje od razu wszystkie pary.
+// Między przebiegami pętla czeka na sygnały, polecenia sterujące i zdarzenia inotify (wait_events);
+// po prośbie o zatrzymanie kończy się dopiero po trwającym przebiegu.
+void daemonize(void) {
+    if (fork() > 0) exit(0);  // Tworzymy proces potomny i kończymy proces macierzysty (dzięki temu program działa w tle jako demon)
+    signals_init();  // Sygnały sterujące odbieramy przez signalfd (przed utworzeniem wątków - dziedziczą maskę)
+    // Wczytujemy indeksy metadanych z poprzedniego uruchomienia
+    for (size_t i = 0; i < pair_count; i++) {
+        pair_activate(i);
+        if (index_path) index_open(pairs[i].src, pairs[i].dst);
+        pair_save();
+    }
+    if (metrics_path) metrics_start(metrics_path);  // Uruchamiamy serwer metryk (-M)
+    if (control_path) control_start(control_path);  // Tworzymy gniazdo sterujące (-C)
+
+    if (watch_mode) {
+        // Tworzymy instancję inotify; jeśli się nie uda, wracamy do zwykłego trybu
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            syslog(LOG_WARNING, "inotify niedostępne (%s) - tylko okresowa synchronizacja", strerror(errno));
+        } else {
+            // Pierwsze pełne skanowanie rejestruje obserwacje wszystkich katalogów
+            for (size_t i = 0; i < pair_count; i++)
+                sync_pair(i);
+        }
+    }
+
+    long long start = now_ms();
+    for (size_t i = 0; i < pair_count; i++)
+        pairs[i].next_run = start + pairs[i].sleep_time * 1000LL * (i + 1) / pair_count;
 
-// Funkcja usuwająca katalog i całą jego zawartość (rekurencyjnie)
-// path - ścieżka do katalogu do usunięcia
-void remove_directory(const char *path) {
-    DIR *dir = opendir(path); // Otwieramy katalog do przeglądania
-    if (!dir) return; // Jeśli nie udało się otworzyć katalogu, kończymy funkcję
-    
-    struct dirent *entry; // Struktura opisująca wpis w katalogu (plik lub podkatalog)
-    char full_path[1024]; // Bufor na pełną ścieżkę do pliku/podkatalogu
-    struct stat statbuf;  // Struktura na informacje o pliku
+    while (!stop_requested) {
+        // Para o najbliższym terminie
+        size_t next = 0;
+        for (size_t i = 1; i < pair_count; i++)
+            if (pairs[i].next_run < pairs[next].next_run) next = i;
 
-    // Przeglądamy wszystkie wpisy w katalogu
-    while ((entry = readdir(dir)) != NULL) {
-        // Pomijamy wpisy "." (katalog bieżący) i ".." (katalog nadrzędny)
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        long long wait = pairs[next].next_run - now_ms();
+        if (wait > 0) {
+            if (wait > 1000000) wait = 1000000; // poll przyjmuje int
+            // Do terminu obsługujemy sygnały i polecenia, a w trybie -W synchronizujemy tylko zmienione wpisy
+            int full = wait_events((int)wait);
+            // Po SIGUSR1 lub utracie zdarzeń inotify synchronizujemy od razu wszystkie pary
+            if (metrics_dump_requested() || full)
+                for (size_t i = 0; i < pair_count; i++)
+                    pairs[i].next_run = now_ms();
             continue;
-        
-        // Tworzymy pełną ścieżkę do wpisu (np. /katalog/plik.txt)
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-        
-        // Pobieramy informacje o wpisie (czy to plik, katalog, itp.)
-        if (lstat(full_path, &statbuf) == 0) {
-            if (S_ISDIR(statbuf.st_mode)) {
-                // Jeśli to katalog, usuwamy go rekurencyjnie (czyli najpierw jego zawartość)
-                remove_directory(full_path);
-            } else {
-                // Jeśli to plik, usuwamy go
-                unlink(full_path);
-            }
         }
+
+        sync_pair(next);  // Synchronizujemy katalogi (kopiujemy nowe pliki, usuwamy zbędne)
+        // Kolejny termin liczymy od poprzedniego (zachowujemy rozłożenie par), chyba że przebieg się spóźnił
+        pairs[next].next_run += pairs[next].sleep_time * 1000LL;
+        long long now = now_ms();
+        if (pairs[next].next_run < now) pairs[next].next_run = now + pairs[next].sleep_time * 1000LL;
     }
-    
-    closedir(dir); // Zamykamy katalog
-    // Usuwamy pusty już katalog
-    rmdir(path);
+    daemon_stop();
 }
 
+// Tryb testu wydajności (--bench)
+// Generujemy powtarzalne (stałe ziarno) syntetyczne drzewa katalogów, wykonujemy na nich
+// pojedynczy przebieg synchronizacji i wypisujemy: pliki/s, MB/s, wywołania systemowe na plik
+// oraz szczytowe RSS - osobno z zimnym i ciepłym cache stron.
+// Używane są te same opcje co w demonie (-j, -U, -I, -D, próg mmap), więc można je porównywać.
 
-// Funkcja usuwająca zbędne pliki i katalogi w katalogu docelowym,
-// które nie występują w katalogu źródłowym
-// src - ścieżka do katalogu źródłowego
-// dst - ścieżka do katalogu docelowego
-void remove_extraneous_files(const char *src, const char *dst) {
-    DIR *dir = opendir(dst); // Otwieramy katalog docelowy
-    if (!dir) return; // Jeśli nie udało się otworzyć, kończymy funkcję
-
-    struct dirent *entry; // Struktura opisująca wpis w katalogu
-    // Przeglądamy wszystkie wpisy w katalogu docelowym
-    while ((entry = readdir(dir))) {
-        // Pomijamy "." i ".."
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
-
-        char src_path[1024], dst_path[1024]; // Bufory na ścieżki do plików/katalogów
-        snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name); // Ścieżka w źródle
-        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, entry->d_name); // Ścieżka w docelowym
-
-        Stat src_stat;
-        // Sprawdzamy, czy plik/katalog istnieje w źródle
-        if (lstat(src_path, &src_stat) == -1) {
-            struct stat dst_stat;
-            // Pobieramy informacje o pliku/katalogu w docelowym
-            if (lstat(dst_path, &dst_stat) != -1) {
-                if (S_ISDIR(dst_stat.st_mode)) {
-                    // Jeśli to katalog i kopiowanie jest rekurencyjne, usuwamy cały katalog
-                    if (recursive) {
-                        remove_directory(dst_path);
-                        syslog(LOG_INFO, "Usunięto katalog: %s", dst_path);
-                    }
-                } else {
-                    // Jeśli to plik, usuwamy go
-                    unlink(dst_path);
-                    syslog(LOG_INFO, "Usunięto plik: %s", dst_path);
-                }
-            }
+#define BENCH_TINY_DIRS 100             // Drzewo "małe pliki": liczba katalogów
+#define BENCH_TINY_FILES 100            // ... i plików w każdym z nich (64 B - 4 KB)
+#define BENCH_HUGE_FILES 4              // Drzewo "duże pliki": liczba plików
+#define BENCH_HUGE_SIZE (64 * 1024 * 1024) // ... i rozmiar każdego z nich
+#define BENCH_DEEP_LEVELS 128           // Drzewo "zagnieżdżone": głębokość
+#define BENCH_DEEP_FILES 8              // ... i liczba plików (1 KB) na każdym poziomie
+#define BENCH_CHURN_MODIFY 5            // Drzewo "zmiany": procent modyfikowanych plików w rundzie
+#define BENCH_CHURN_DELETE 2            // ... procent usuwanych plików
+#define BENCH_CHURN_CREATE 1            // ... procent nowych plików
+
+// Wynik jednego pomiaru
+typedef struct {
+    double secs;            // Czas przebiegu synchronizacji (w sekundach)
+    long files;             // Liczba plików w drzewie źródłowym
+    long copied;            // Liczba skopiowanych plików
+    long long bytes;        // Liczba skopiowanych bajtów
+    long long syscalls;     // Liczba wywołań systemowych (-1 - licznik niedostępny)
+    long rss_kb;            // Szczytowe RSS procesu (w KB)
+} BenchResult;
+
+// Generator liczb pseudolosowych xorshift64 (ten sam ciąg przy każdym uruchomieniu)
+uint64_t bench_rand(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Funkcja tworząca plik name w katalogu dfd o rozmiarze size wypełniony pseudolosowymi danymi
+// mtime != 0 ustawia czas modyfikacji (zmiany muszą być nowsze od kopii w celu)
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int bench_write_file(int dfd, const char *name, size_t size, uint64_t *seed, time_t mtime) {
+    static uint64_t buf[COPY_BUFFER_SIZE / sizeof(uint64_t)];
+    int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    int ret = 0;
+    while (size > 0 && ret == 0) {
+        size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+        for (size_t i = 0; i < (chunk + 7) / 8; i++)
+            buf[i] = bench_rand(seed);
+        ret = write_all(fd, (const char *)buf, chunk);
+        size -= chunk;
+    }
+    if (mtime) {
+        struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+        futimens(fd, times);
+    }
+    close(fd);
+    return ret;
+}
+
+// Funkcja tworząca (od nowa) katalog path i zwracająca jego deskryptor
+int bench_mkdir(const char *path) {
+    remove_directory(AT_FDCWD, path);
+    mkdir(path, DEFAULT_MODE);
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Funkcja generująca drzewo "małe pliki" (lub wyjściowe drzewo "zmiany")
+// Zwraca liczbę utworzonych plików
+long bench_gen_tiny(const char *path, uint64_t seed) {
+    int root = bench_mkdir(path);
+    if (root == -1) return 0;
+    char name[64];
+    long files = 0;
+    for (int d = 0; d < BENCH_TINY_DIRS; d++) {
+        snprintf(name, sizeof(name), "d%03d", d);
+        mkdirat(root, name, DEFAULT_MODE);
+        int dfd = openat(root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd == -1) continue;
+        for (int f = 0; f < BENCH_TINY_FILES; f++) {
+            snprintf(name, sizeof(name), "f%03d", f);
+            if (bench_write_file(dfd, name, 64 + bench_rand(&seed) % 4033, &seed, 0) == 0) files++;
         }
+        close(dfd);
     }
-    closedir(dir); // Zamykamy katalog
+    close(root);
+    return files;
 }
 
-// Funkcja synchronizująca zawartość katalogu źródłowego z docelowym
-// src - ścieżka do katalogu źródłowego
-// dst - ścieżka do katalogu docelowego
-void sync_directories(const char *src, const char *dst) {
-    DIR *dir = opendir(src); // Otwieramy katalog źródłowy
-    if (!dir) return; // Jeśli nie udało się otworzyć, kończymy funkcję
-
-    struct dirent *entry; // Struktura opisująca wpis w katalogu
-    // Przeglądamy wszystkie wpisy w katalogu źródłowym
-    while ((entry = readdir(dir))) {
-        // Pomijamy "." i ".."
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
-
-        char src_path[1024], dst_path[1024]; // Bufory na ścieżki
-        snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name); // Ścieżka w źródle
-        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, entry->d_name); // Ścieżka w docelowym
-
-        Stat src_stat, dst_stat;
-        // Pobieramy informacje o pliku/katalogu w źródle
-        // Pomijamy linki symboliczne i błędy stat
-        if (lstat(src_path, &src_stat) == -1 || S_ISLNK(src_stat.st_mode)) continue;
-
-        // Jeśli wpis jest katalogiem i mamy włączoną rekurencję
-        if (S_ISDIR(src_stat.st_mode)) {
-            if (recursive) {
-                // Tworzymy katalog docelowy, jeśli nie istnieje
-                if (stat(dst_path, &dst_stat) == -1) 
-                    mkdir(dst_path, DEFAULT_MODE);
-                // Rekurencyjnie synchronizujemy podkatalogi
-                sync_directories(src_path, dst_path);
-            }
-        } 
-        // Jeśli wpis jest plikiem
-        // Kopiujemy, jeśli plik w źródle jest nowszy (ma większy czas modyfikacji) lub nie istnieje w docelowym
-        else if (lstat(dst_path, &dst_stat) == -1 || src_stat.st_mtime > dst_stat.st_mtime) {
-            copy_file(src_path, dst_path, src_stat.st_size);
+// Funkcja generująca drzewo "duże pliki"
+long bench_gen_huge(const char *path, uint64_t seed) {
+    int root = bench_mkdir(path);
+    if (root == -1) return 0;
+    char name[64];
+    long files = 0;
+    for (int f = 0; f < BENCH_HUGE_FILES; f++) {
+        snprintf(name, sizeof(name), "huge%d", f);
+        if (bench_write_file(root, name, BENCH_HUGE_SIZE, &seed, 0) == 0) files++;
+    }
+    close(root);
+    return files;
+}
+
+// Funkcja generująca drzewo "zagnieżdżone" (jeden łańcuch katalogów z plikami na każdym poziomie)
+long bench_gen_deep(const char *path, uint64_t seed) {
+    int fd = bench_mkdir(path);
+    char name[64];
+    long files = 0;
+    for (int level = 0; fd != -1 && level < BENCH_DEEP_LEVELS; level++) {
+        for (int f = 0; f < BENCH_DEEP_FILES; f++) {
+            snprintf(name, sizeof(name), "f%d", f);
+            if (bench_write_file(fd, name, 1024, &seed, 0) == 0) files++;
         }
+        snprintf(name, sizeof(name), "poziom%03d", level);
+        mkdirat(fd, name, DEFAULT_MODE);
+        int next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
     }
-    closedir(dir); // Zamykamy katalog
+    if (fd != -1) close(fd);
+    return files;
+}
 
-    // Usuwamy zbędne pliki/katalogi z katalogu docelowego
-    remove_extraneous_files(src, dst);
+// Funkcja wprowadzająca jedną rundę zmian w drzewie "zmiany" (modyfikacje, usunięcia, nowe pliki)
+// round - numer rundy (nowe pliki i czasy modyfikacji różnią się między rundami)
+// Zwraca liczbę plików w drzewie po zmianach (files - liczba przed zmianami)
+long bench_churn(const char *path, long files, int round, uint64_t seed) {
+    int root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root == -1) return files;
+    // Zmienione pliki dostają czas modyfikacji z przyszłości - muszą być nowsze od kopii w celu
+    time_t mtime = time(NULL) + 10 * round;
+    char name[64];
+    for (int d = 0; d < BENCH_TINY_DIRS; d++) {
+        snprintf(name, sizeof(name), "d%03d", d);
+        int dfd = openat(root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd == -1) continue;
+        for (int f = 0; f < BENCH_TINY_FILES; f++) {
+            snprintf(name, sizeof(name), "f%03d", f);
+            int r = bench_rand(&seed) % 100;
+            Stat st;
+            if (fstatat(dfd, name, &st, 0) == -1) continue; // Usunięty w poprzedniej rundzie
+            if (r < BENCH_CHURN_MODIFY)
+                bench_write_file(dfd, name, 64 + bench_rand(&seed) % 4033, &seed, mtime);
+            else if (r < BENCH_CHURN_MODIFY + BENCH_CHURN_DELETE && unlinkat(dfd, name, 0) == 0)
+                files--;
+        }
+        for (int f = 0; f < BENCH_TINY_FILES * BENCH_CHURN_CREATE / 100; f++) {
+            snprintf(name, sizeof(name), "nowy%d_%03d", round, f);
+            if (bench_write_file(dfd, name, 64 + bench_rand(&seed) % 4033, &seed, mtime) == 0) files++;
+        }
+        close(dfd);
+    }
+    close(root);
+    return files;
 }
 
-// Funkcja demonizująca, która co sleep_time sekund synchronizuje katalogi
-// src - ścieżka do katalogu źródłowego
-// dst - ścieżka do katalogu docelowego
-void daemonize(const char *src, const char *dst) {
-    if (fork() > 0) exit(0);  // Tworzymy proces potomny i kończymy proces macierzysty (dzięki temu program działa w tle jako demon)
-    signal(SIGUSR1, handle_signal);  // Ustawiamy obsługę sygnału SIGUSR1 (gdy proces dostanie ten sygnał, wywoła się handle_signal)
-    while (1) { 
-        sleep(sleep_time);  // Czekamy określoną liczbę sekund (sleep_time)
-        sync_directories(src, dst);  // Synchronizujemy katalogi (kopiujemy nowe pliki, usuwamy zbędne)
+// Funkcja usuwająca z cache stron zawartość plików drzewa (gdy nie można użyć drop_caches)
+void bench_evict(int dfd) {
+    Arena arena = {0};
+    DirEntry *entries;
+    size_t count = read_dir(dfd, &arena, &entries);
+    if (count == READ_DIR_ERROR) count = 0; // Pomiar zimnego cache będzie wtedy tylko mniej dokładny
+    for (size_t i = 0; i < count; i++) {
+        int fd = openat(dfd, entries[i].name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) continue;
+        if (entry_type(dfd, entries[i].name, entries[i].type) == DT_DIR)
+            bench_evict(fd);
+        else
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    arena_free(&arena);
+}
+
+// Funkcja opróżniająca cache stron przed pomiarem z zimnym cache
+// Najpierw próbujemy /proc/sys/vm/drop_caches (wymaga uprawnień roota), a jeśli się nie uda,
+// wyrzucamy z cache pliki drzewa źródłowego (posix_fadvise)
+void bench_drop_caches(const char *src) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd != -1) {
+        int ok = write(fd, "3", 1) == 1;
+        close(fd);
+        if (ok) return;
+    }
+    int dfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) return;
+    bench_evict(dfd);
+    close(dfd);
+}
+
+// Funkcja otwierająca liczniki wywołań systemowych (tracepoint raw_syscalls:sys_enter)
+// dla wszystkich wątków procesu - również wątków puli, uruchomionych przed pomiarem
+// Zwraca liczbę otwartych liczników (0 - zliczanie niedostępne), deskryptory trafiają do fds
+size_t bench_counters_open(int **fds) {
+    static const char *ids[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+    long long id = -1;
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]) && id == -1; i++) {
+        FILE *f = fopen(ids[i], "r");
+        if (!f) continue;
+        if (fscanf(f, "%lld", &id) != 1) id = -1;
+        fclose(f);
+    }
+    *fds = NULL;
+    if (id == -1) return 0;
+
+    int task_fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd == -1) return 0;
+    Arena arena = {0};
+    DirEntry *tasks;
+    size_t count = read_dir(task_fd, &arena, &tasks), opened = 0;
+    close(task_fd);
+    if (count == READ_DIR_ERROR) {
+        arena_free(&arena);
+        return 0; // Bez licznika wywołań systemowych
+    }
+
+    *fds = malloc((count ? count : 1) * sizeof(int));
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = id;
+    attr.inherit = 1;
+    for (size_t i = 0; i < count; i++) {
+        int fd = syscall(SYS_perf_event_open, &attr, atoi(tasks[i].name), -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+            // Bez licznika dla któregoś wątku wynik byłby zaniżony - rezygnujemy
+            while (opened > 0) close((*fds)[--opened]);
+            break;
+        }
+        (*fds)[opened++] = fd;
+    }
+    arena_free(&arena);
+    return opened;
+}
+
+// Funkcja sumująca i zamykająca liczniki wywołań systemowych (-1, jeśli niedostępne)
+long long bench_counters_close(int *fds, size_t count) {
+    long long total = count ? 0 : -1;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t value;
+        if (read(fds[i], &value, sizeof(value)) == sizeof(value)) total += value;
+        close(fds[i]);
+    }
+    free(fds);
+    return total;
+}
+
+// Funkcja odczytująca szczytowe RSS procesu (VmHWM, w KB)
+long bench_peak_rss(void) {
+    char line[256];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+// Funkcja przygotowująca indeks (-I) dla pary katalogów pomiaru
+// fresh - zaczynamy od pustego indeksu (cel jest pusty, więc stary indeks pomijałby kopie)
+void bench_index(const char *src, const char *dst, int fresh) {
+    if (!index_path) return;
+    if (index_map) munmap(index_map, index_map_size);
+    index_map = NULL;
+    if (fresh) unlink(index_path);
+    index_open(src, dst);
+}
+
+// Funkcja mierząca pojedynczy przebieg synchronizacji src -> dst
+BenchResult bench_measure(const char *src, const char *dst, long files) {
+    BenchResult r = {0};
+    r.files = files;
+
+    // Zerujemy szczytowe RSS (Linux >= 4.0), żeby zmierzyć tylko ten przebieg
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (write(fd, "5", 1) != 1) syslog(LOG_WARNING, "Nie można wyzerować VmHWM: %s", strerror(errno));
+        close(fd);
+    }
+
+    long copied = atomic_load(&files_copied);
+    long long bytes = atomic_load(&bytes_copied);
+    int *counters;
+    size_t counter_count = bench_counters_open(&counters);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    sync_pass(src, dst);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    r.syscalls = bench_counters_close(counters, counter_count);
+    r.secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    r.copied = atomic_load(&files_copied) - copied;
+    r.bytes = atomic_load(&bytes_copied) - bytes;
+    r.rss_kb = bench_peak_rss();
+    return r;
+}
+
+// Funkcja wypisująca wiersz wyników (nazwy bez polskich znaków - printf wyrównuje kolumny w bajtach)
+void bench_report(const char *scenario, const char *cache, const BenchResult *r) {
+    double secs = r->secs > 0 ? r->secs : 1e-9;
+    char syscalls[32] = "n/d";
+    if (r->syscalls >= 0 && r->files > 0)
+        snprintf(syscalls, sizeof(syscalls), "%.1f", (double)r->syscalls / r->files);
+    printf("%-14s %-6s %8ld %8ld %10.1f %9.3f %11.0f %9.1f %13s %9.1f\n",
+           scenario, cache, r->files, r->copied, r->bytes / 1048576.0, r->secs,
+           r->files / secs, r->bytes / 1048576.0 / secs, syscalls, r->rss_kb / 1024.0);
+    fflush(stdout);
+}
+
+// Funkcja mierząca pełną synchronizację drzewa do pustego celu: z zimnym, a potem z ciepłym cache
+void bench_full(const char *scenario, const char *src, const char *dst, long files) {
+    BenchResult r;
+    close(bench_mkdir(dst));
+    bench_index(src, dst, 1);
+    bench_drop_caches(src);
+    r = bench_measure(src, dst, files);
+    bench_report(scenario, "zimny", &r);
+
+    close(bench_mkdir(dst));
+    bench_index(src, dst, 1);
+    sync(); // Zapisujemy usunięcie poprzedniej kopii, żeby nie obciążało pomiaru
+    r = bench_measure(src, dst, files);
+    bench_report(scenario, "cieply", &r);
+}
+
+// Funkcja uruchamiająca test wydajności w katalogu roboczym dir
+// Zwraca EXIT_SUCCESS lub EXIT_FAILURE
+int run_bench(const char *dir) {
+    char src[4096], dst[4096];
+    if (mkdir(dir, DEFAULT_MODE) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Nie można utworzyć katalogu %s: %s\n", dir, strerror(errno));
+        return EXIT_FAILURE;
     }
+    // Wpisy o każdym pliku zdominowałyby pomiar - zostawiamy tylko ostrzeżenia i błędy
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    recursive = 1; // Wszystkie drzewa testowe mają podkatalogi
+    if (jobs > 1) pool_start(); // Wątki puli muszą istnieć przed otwarciem liczników
+    // Z -I mierzymy na prywatnym indeksie w katalogu roboczym - pomiar usuwa go i tworzy od nowa,
+    // więc nie może dotknąć indeksu podanego przez użytkownika (np. indeksu działającego demona)
+    char index_copy[4200];
+    if (index_path) {
+        snprintf(index_copy, sizeof(index_copy), "%s/indeks.XXXXXX", dir);
+        int fd = mkstemp(index_copy);
+        if (fd == -1) {
+            fprintf(stderr, "Nie można utworzyć indeksu w %s: %s\n", dir, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        index_path = index_copy;
+    }
+
+    printf("Test wydajności: %s (wątki: %d, io_uring: %s, indeks: %s, delta: %lld, próg mmap: %d)\n",
+           dir, jobs, uring_mode ? "tak" : "nie", index_path ? index_path : "brak",
+           (long long)delta_threshold, mmap_threshold);
+    printf("%-14s %-6s %8s %8s %10s %9s %11s %9s %13s %9s\n", "scenariusz", "cache", "pliki",
+           "kopie", "MB", "czas [s]", "pliki/s", "MB/s", "syscalle/plik", "RSS [MB]");
+
+    snprintf(src, sizeof(src), "%s/zrodlo", dir);
+    snprintf(dst, sizeof(dst), "%s/cel", dir);
+    close(bench_mkdir(src));
+    close(bench_mkdir(dst));
+
+    // Drzewa kopiowane w całości do pustego celu
+    static const struct {
+        const char *name;
+        long (*generate)(const char *path, uint64_t seed);
+    } scenarios[] = {
+        {"male_pliki", bench_gen_tiny},
+        {"duze_pliki", bench_gen_huge},
+        {"zagniezdzone", bench_gen_deep},
+    };
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        char s[4200], d[4200];
+        snprintf(s, sizeof(s), "%s/%s", src, scenarios[i].name);
+        snprintf(d, sizeof(d), "%s/%s", dst, scenarios[i].name);
+        long files = scenarios[i].generate(s, 0x9e3779b97f4a7c15ULL + i);
+        bench_full(scenarios[i].name, s, d, files);
+        remove_directory(AT_FDCWD, s);
+        remove_directory(AT_FDCWD, d);
+    }
+
+    // Drzewo "zmiany": po wstępnej synchronizacji (bez pomiaru) mierzymy przebiegi,
+    // w których zmieniła się niewielka część plików (z indeksem - tak jak w demonie)
+    char s[4200], d[4200];
+    snprintf(s, sizeof(s), "%s/zmiany", src);
+    snprintf(d, sizeof(d), "%s/zmiany", dst);
+    long files = bench_gen_tiny(s, 0x2545f4914f6cdd1dULL);
+    close(bench_mkdir(d));
+    bench_index(s, d, 1);
+    sync_pass(s, d);
+
+    files = bench_churn(s, files, 1, 0xda942042e4dd58b5ULL);
+    bench_drop_caches(s);
+    BenchResult r = bench_measure(s, d, files);
+    bench_report("zmiany", "zimny", &r);
+
+    files = bench_churn(s, files, 2, 0xa0761d6478bd642fULL);
+    r = bench_measure(s, d, files);
+    bench_report("zmiany", "cieply", &r);
+
+    remove_directory(AT_FDCWD, src);
+    remove_directory(AT_FDCWD, dst);
+    if (index_path) unlink(index_path); // Tylko prywatny indeks pomiaru
+    return EXIT_SUCCESS;
+}
+
+// Funkcja wypisująca sposób użycia programu
+void usage(const char *prog) {
+    fprintf(stderr, "Użycie: %s <źródło> <cel> [-R] [-W] [-U] [-H] [-S] [-P] [-n] [-A] [-N] [-j wątki] [-I indeks] [-D próg delta] [-M gniazdo metryk] [-L limit logów]\n"
+                    "       [-B bajty/s] [-O operacje/s] [-C gniazdo sterujące] [czas] [próg mmap]\n", prog);
+    fprintf(stderr, "       %s -c <plik konfiguracyjny> [opcje jak wyżej - domyślne dla par]\n", prog);
+    fprintf(stderr, "       %s --restore <magazyn> <katalog>   (bez rozszerzonych atrybutów; bloki zer jako dziury)\n", prog);
+    fprintf(stderr, "       %s --bench <katalog roboczy> [-U] [-H] [-A] [-N] [-j wątki] [-I indeks] [-D próg delta] [-B bajty/s] [-O operacje/s] [czas] [próg mmap]\n", prog);
+}
+
+// Funkcja przetwarzająca opcje args[0..count) do zmiennych globalnych
+// pair_only - opcje z pliku konfiguracyjnego: dozwolone są tylko ustawienia pary
+//             (-R, -H, -S, -P, -I, -D, czas, próg mmap); pozostałe dotyczą całego demona
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędnej lub nadmiarowej opcji
+int parse_options(char **args, int count, int pair_only) {
+    int numbers = 0; // Liczba podanych argumentów liczbowych (czas, próg mmap)
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(args[i], "-R")) {
+            recursive = 1;  // Włączamy rekurencyjne kopiowanie katalogów
+        } else if (!strcmp(args[i], "-H")) {
+            hash_mode = 1;  // Włączamy porównywanie zawartości skrótami
+        } else if (!strcmp(args[i], "-S")) {
+            store_mode = 1;  // Cel będzie magazynem fragmentów
+        } else if (!strcmp(args[i], "-P")) {
+            plan_mode = 1;  // Przebiegi według planu operacji
+        } else if (!strcmp(args[i], "-I") && i + 1 < count) {
+            index_path = args[++i];  // Ustawiamy ścieżkę do pliku indeksu metadanych
+        } else if (!strcmp(args[i], "-D") && i + 1 < count) {
+            delta_threshold = atoll(args[++i]);  // Ustawiamy próg kopiowania różnicowego
+        } else if (pair_only && args[i][0] == '-' && args[i][1] && (args[i][1] < '0' || args[i][1] > '9')) {
+            fprintf(stderr, "Opcja %s dotyczy całego demona - podaj ją w wierszu poleceń\n", args[i]);
+            return -1;
+        } else if (!strcmp(args[i], "-W")) {
+            watch_mode = 1;  // Włączamy tryb obserwacji zmian (inotify)
+        } else if (!strcmp(args[i], "-U")) {
+            uring_mode = 1;  // Włączamy asynchroniczne wejście/wyjście (io_uring)
+        } else if (!strcmp(args[i], "-j") && i + 1 < count) {
+            jobs = atoi(args[++i]);  // Ustawiamy liczbę wątków roboczych
+            if (jobs < 1) jobs = 1;
+        } else if (!strcmp(args[i], "-M") && i + 1 < count) {
+            metrics_path = args[++i];  // Ustawiamy ścieżkę gniazda metryk
+        } else if (!strcmp(args[i], "-C") && i + 1 < count) {
+            control_path = args[++i];  // Ustawiamy ścieżkę gniazda sterującego
+        } else if (!strcmp(args[i], "-L") && i + 1 < count) {
+            log_limit = atol(args[++i]);  // Ustawiamy limit komunikatów o plikach na cykl
+            if (log_limit < 0) log_limit = 0;
+        } else if (!strcmp(args[i], "-B") && i + 1 < count) {
+            bandwidth_limit = atoll(args[++i]);  // Ustawiamy limit przepustowości (B/s)
+            if (bandwidth_limit < 0) bandwidth_limit = 0;
+        } else if (!strcmp(args[i], "-O") && i + 1 < count) {
+            ops_limit = atol(args[++i]);  // Ustawiamy limit operacji na sekundę
+            if (ops_limit < 0) ops_limit = 0;
+        } else if (!strcmp(args[i], "-A")) {
+            adaptive_mode = 1;  // Włączamy zwalnianie przy rosnącym opóźnieniu dysku
+        } else if (!strcmp(args[i], "-N")) {
+            nice_mode = 1;  // Włączamy niski priorytet wejścia/wyjścia i zwalnianie cache stron
+        } else if (!strcmp(args[i], "-n")) {
+            dry_run = 1;  // Tylko wypisujemy plan synchronizacji
+        } else if (numbers == 0) {
+            sleep_time = atoi(args[i]);  // Ustawiamy czas oczekiwania między synchronizacjami (zamieniamy tekst na liczbę)
+            numbers++;
+        } else if (numbers == 1) {
+            mmap_threshold = atol(args[i]);  // Ustawiamy próg rozmiaru pliku dla mmap (zamieniamy tekst na liczbę)
+            numbers++;
+        } else {
+            return -1;  // Nadmiarowy argument
+        }
+    }
+    // Jeśli nie podano czasu, ustawiamy domyślny (300 sekund)
+    if (!sleep_time) sleep_time = 300;
+    return 0;
+}
+
+// Funkcja sprawdzająca parę katalogów i dodająca ją z bieżącymi ustawieniami globalnymi
+// Katalog docelowy tworzymy, jeśli nie istnieje
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int pair_add(const char *src, const char *dst) {
+    Stat src_stat, dst_stat;
+    // Sprawdzamy, czy katalog źródłowy istnieje i jest katalogiem
+    if (stat(src, &src_stat) == -1 || !S_ISDIR(src_stat.st_mode)) {
+        fprintf(stderr, "Błąd: Źródło musi być katalogiem: %s\n", src);
+        return -1;
+    }
+    // Sprawdzamy, czy katalog docelowy istnieje i jest katalogiem
+    if (stat(dst, &dst_stat) == -1 || !S_ISDIR(dst_stat.st_mode)) {
+        fprintf(stderr, "Katalog docelowy nie istnieje!\n");
+        // Próbujemy utworzyć katalog docelowy (próba na sucho niczego nie tworzy)
+        if (dry_run) return pair_capture(src, dst);
+        if (mkdir(dst, DEFAULT_MODE) == -1) return -1;
+        fprintf(stderr, "Utworzono katalog: %s\n", dst);
+        syslog(LOG_INFO, "Utworzono katalog: %s\n", dst);
+    }
+    return pair_capture(src, dst);
+}
+
+// Funkcja zwracająca znormalizowaną ścieżkę pliku indeksu (realpath; pliku może jeszcze nie być -
+// wtedy normalizujemy jego katalog). Wynik trzeba zwolnić (free)
+char *index_realpath(const char *path) {
+    char *full = realpath(path, NULL);
+    if (full || errno != ENOENT) return full ? full : strdup(path);
+    char *copy = strdup(path);
+    if (!copy) return NULL;
+    char *slash = strrchr(copy, '/');
+    const char *name = slash ? slash + 1 : copy;
+    if (slash) *slash = '\0';
+    char *dir = realpath(!slash ? "." : *copy ? copy : "/", NULL);
+    if (dir && asprintf(&full, "%s/%s", strcmp(dir, "/") ? dir : "", name) == -1) full = NULL;
+    free(dir);
+    if (!full) full = strdup(path);
+    free(copy);
+    return full;
+}
+
+// Funkcja sprawdzająca, czy plik indeksu path ma już któraś z dodanych par (po normalizacji ścieżek,
+// np. "./a.idx" i "/etc/sync/a.idx" to ten sam plik)
+int index_in_use(const char *path) {
+    char *full = index_realpath(path);
+    int used = 0;
+    for (size_t i = 0; full && !used && i < pair_count; i++) {
+        if (!pairs[i].index_path) continue;
+        char *other = index_realpath(pairs[i].index_path);
+        used = other && !strcmp(full, other);
+        free(other);
+    }
+    free(full);
+    return used;
+}
+
+// Funkcja wczytująca pary katalogów z pliku konfiguracyjnego
+// Każdy niepusty wiersz (poza komentarzami od '#') opisuje jedną parę:
+//   źródło cel [-R] [-H] [-S] [-P] [-I indeks] [-D próg delta] [czas] [próg mmap]
+// Opcje z wiersza poleceń są domyślnymi ustawieniami każdej pary
+// Zwraca 0 w przypadku powodzenia, -1 w przypadku błędu
+int load_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Nie można otworzyć pliku konfiguracyjnego %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Zapamiętujemy ustawienia domyślne (z wiersza poleceń), żeby każda para zaczynała od nich
+    unsigned int default_sleep = sleep_time;
+    int default_recursive = recursive, default_hash = hash_mode, default_mmap = mmap_threshold;
+    int default_store = store_mode, default_plan = plan_mode;
+    off_t default_delta = delta_threshold;
+    const char *default_index = index_path;
+
+    char *line = NULL;
+    size_t cap = 0;
+    int number = 0, ret = 0;
+    while (ret == 0 && getline(&line, &cap, f) != -1) {
+        number++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0'; // Komentarz do końca wiersza
+
+        // Dzielimy wiersz na słowa (ścieżki bez spacji); słowa zostają w pamięci jako ustawienia pary
+        char *copy = strdup(line), *save, *args[64];
+        int count = 0;
+        for (char *tok = strtok_r(copy, " \t\r\n", &save); tok && count < 64; tok = strtok_r(NULL, " \t\r\n", &save))
+            args[count++] = tok;
+        if (count == 0) {
+            free(copy);
+            continue;
+        }
+
+        sleep_time = default_sleep;
+        recursive = default_recursive;
+        hash_mode = default_hash;
+        store_mode = default_store;
+        plan_mode = default_plan;
+        mmap_threshold = default_mmap;
+        delta_threshold = default_delta;
+        index_path = default_index;
+        if (count < 2 || parse_options(args + 2, count - 2, 1) == -1) {
+            fprintf(stderr, "%s:%d: błędny wiersz\n", path, number);
+            ret = -1;
+        } else if (index_path && index_path == default_index && pair_count > 0) {
+            // Indeks jest związany z jedną parą katalogów
+            fprintf(stderr, "%s:%d: każda para potrzebuje własnego indeksu (-I)\n", path, number);
+            ret = -1;
+        } else if (index_path && index_in_use(index_path)) {
+            fprintf(stderr, "%s:%d: indeks %s ma już inna para - każda para potrzebuje własnego indeksu (-I)\n",
+                    path, number, index_path);
+            ret = -1;
+        } else {
+            ret = pair_add(args[0], args[1]);
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (ret == 0 && pair_count == 0) {
+        fprintf(stderr, "Plik konfiguracyjny %s nie zawiera żadnej pary katalogów\n", path);
+        ret = -1;
+    }
+    return ret;
 }
 
 /*
@@ -225,56 +5899,98 @@ void daemonize(const char *src, const char *dst) {
  * Argumenty wywołania:
  *   argv[1] - ścieżka do katalogu źródłowego (musi istnieć)
  *   argv[2] - ścieżka do katalogu docelowego (jeśli nie istnieje, zostanie utworzony)
- *   argv[3] - opcjonalnie: "-R" (rekurencyjne kopiowanie katalogów)
- *   argv[4] - opcjonalnie: czas (w sekundach) między synchronizacjami (domyślnie 300)
- *   argv[5] - opcjonalnie: próg rozmiaru pliku (w bajtach) dla mmap (domyślnie 10MB)
+ *   dalej, w dowolnej kolejności:
+ *   "-R" - opcjonalnie: rekurencyjne kopiowanie katalogów
+ *   "-W" - opcjonalnie: tryb obserwacji (inotify) - synchronizujemy tylko zmienione wpisy,
+ *          a pełne skanowanie wykonujemy co sleep_time sekund lub po przepełnieniu kolejki zdarzeń
+ *   "-j N" - opcjonalnie: liczba wątków roboczych skanujących katalogi i kopiujących pliki (domyślnie 1)
+ *   "-I plik" - opcjonalnie: trwały indeks metadanych - niezmienione pliki i katalogi są pomijane
+ *   "-D próg" - opcjonalnie: pliki od tego rozmiaru (w bajtach) aktualizujemy różnicowo (tylko zmienione bloki)
+ *   "-U" - opcjonalnie: io_uring - hurtowe statx dla katalogów i kopiowanie małych plików partiami
+ *   "-H" - opcjonalnie: pliki o tym samym rozmiarze i innym mtime porównujemy skrótem zawartości
+ *          (przy równej zawartości poprawiamy tylko metadane celu)
+ *   "-S" - opcjonalnie: cel jest magazynem - zawartość plików jako fragmenty wyznaczane przez treść,
+ *          bez powtórzeń i skompresowane, a strukturę drzewa opisuje manifest (odtwarzanie: --restore)
+ *   "-P" - opcjonalnie: przebieg najpierw buduje plan operacji (usunięcia, katalogi, metadane, kopie),
+ *          a potem go wykonuje: małe pliki grupami po katalogach, duże od największego, kopie na -j wątkach
+ *   "-n" - opcjonalnie: próba na sucho - wypisujemy plan każdej pary z szacunkiem bajtów i kończymy
+ *   "-M gniazdo" - opcjonalnie: gniazdo uniksowe z metrykami w formacie Prometheus
+ *   "-L limit" - opcjonalnie: najwięcej tyle komunikatów o plikach w syslogu na cykl (domyślnie 100)
+ *   "-B bajty/s" - opcjonalnie: limit przepustowości kopiowania (kubełek żetonów wspólny dla wątków)
+ *   "-O operacje/s" - opcjonalnie: limit operacji na wpisach (stat, kopiowanie, usunięcie)
+ *   "-A" - opcjonalnie: tryb adaptacyjny - zwalniamy, gdy rośnie zmierzone opóźnienie odczytu/zapisu
+ *   "-N" - opcjonalnie: najniższy priorytet wejścia/wyjścia (best-effort 7) i zwalnianie z cache stron
+ *          skopiowanych danych (posix_fadvise DONTNEED)
+ *   "-C gniazdo" - opcjonalnie: gniazdo uniksowe sterujące demonem (polecenia sync [ścieżka], plan, reload, set, stop)
+ *   czas - opcjonalnie: czas (w sekundach) między synchronizacjami (domyślnie 300)
+ *   próg mmap - opcjonalnie: próg rozmiaru pliku (w bajtach) dla mmap (domyślnie 10MB)
+ * Tryb wielu par:
+ *   argv[1] = "-c", argv[2] - plik konfiguracyjny; w każdym wierszu "źródło cel [opcje pary]"
+ *   (-R, -H, -S, -P, -I, -D, czas, próg mmap). Opcje z wiersza poleceń są domyślne dla wszystkich par,
+ *   a -W, -U, -j, -M, -L, -B, -O, -A, -N, -n i -C dotyczą całego demona (limity tempa są wspólne dla par).
+ *   SIGHUP lub polecenie "reload" wczytuje plik ponownie (bez restartu).
+ *   Pary synchronizujemy po kolei we wspólnej puli, z terminami rozłożonymi równomiernie w ich okresach.
+ * Tryb testu wydajności:
+ *   argv[1] = "--bench", argv[2] - katalog roboczy na syntetyczne drzewa; pozostałe opcje jak wyżej
+ *   (czas jest pomijany). Wyniki trafiają na standardowe wyjście, demon nie jest uruchamiany.
+ * Odtwarzanie magazynu:
+ *   argv[1] = "--restore", argv[2] - katalog magazynu (-S), argv[3] - katalog, w którym odtwarzamy drzewo
+ *   (ścieżki tylko względne i bez ".."; właściciel tylko jako root; rozszerzonych atrybutów magazyn nie ma)
  * Przykład wywołania:
- *   ./program /ścieżka/źródło /ścieżka/cel -R 60 1048576
+ *   ./program /ścieżka/źródło /ścieżka/cel -R -W -U -H -j 8 -I /var/tmp/sync.idx -D 1073741824 -M /run/syncdir.sock 60 1048576
+ *   ./program -c /etc/syncdir.conf -W -j 4 -M /run/syncdir.sock -C /run/syncdir.ctl
+ *   ./program --bench /var/tmp/bench -j 4 0 1048576
+ *   ./program /home /backup/home.store -R -S -j 4 3600
+ *   ./program --restore /backup/home.store /tmp/home
+ *   ./program /srv/data /backup/data -R -D 1048576 -n
  */
 int main(int argc, char *argv[]) {
     // Inicjalizujemy sysloga (logowanie zdarzeń systemowych)
     openlog(argv[0], LOG_PID | LOG_CONS, LOG_USER);
 
-    // Sprawdzamy, czy liczba argumentów jest poprawna (minimum 3, maksimum 6)
-    if (argc < 3 || argc > 6) {
-        fprintf(stderr, "Użycie: %s <źródło> <cel> [-R] [czas] [próg mmap]\n", argv[0]);
+    // Sprawdzamy, czy podano przynajmniej źródło i cel
+    if (argc < 3) {
+        usage(argv[0]);
         return EXIT_FAILURE; // Kończymy program z kodem błędu
     }
         
-    Stat src_stat, dst_stat;
-    // Sprawdzamy, czy katalog źródłowy istnieje i jest katalogiem
-    if (stat(argv[1], &src_stat) == -1 || !S_ISDIR(src_stat.st_mode)) {
-        fprintf(stderr, "Błąd: Źródło musi być katalogiem\n");
-        return EXIT_FAILURE;
-    }
-    // Sprawdzamy, czy katalog docelowy istnieje i jest katalogiem
-    if (stat(argv[2], &dst_stat) == -1 || !S_ISDIR(dst_stat.st_mode)) {
-        fprintf(stderr, "Katalog docelowy nie istnieje!\n");
-        // Próbujemy utworzyć katalog docelowy
-        if(!mkdir(argv[2], DEFAULT_MODE)) {
-            fprintf(stderr, "Utworzono katalog: %s\n", argv[2]);
-            syslog(LOG_INFO, "Utworzono katalog: %s\n", argv[2]);
-        } else {
+    owner_mode = geteuid() == 0; // Właściciela (fchown) może zmienić tylko root
+
+    // Odtwarzanie magazynu fragmentów do zwykłego katalogu (na pierwszym planie)
+    if (!strcmp(argv[1], "--restore")) {
+        if (argc != 4) {
+            usage(argv[0]);
             return EXIT_FAILURE;
         }
+        return store_restore(argv[2], argv[3]);
     }
 
-    // Przetwarzamy dodatkowe argumenty: -R, czas i próg mmap
-    for (int i = 3; i < argc; i++) {
-        if (!strcmp(argv[i], "-R")) {
-            recursive = 1;  // Włączamy rekurencyjne kopiowanie katalogów
-        } else if (!sleep_time) { 
-            sleep_time = atoi(argv[i]);  // Ustawiamy czas oczekiwania między synchronizacjami (zamieniamy tekst na liczbę)
-        } else {
-            mmap_threshold = atol(argv[i]);  // Ustawiamy próg rozmiaru pliku dla mmap (zamieniamy tekst na liczbę)
-        }
+    // Tryb testu wydajności: zamiast źródła i celu podajemy katalog roboczy
+    int bench = !strcmp(argv[1], "--bench");
+    // Tryb wielu par: zamiast źródła i celu podajemy plik konfiguracyjny
+    int config = !strcmp(argv[1], "-c");
+
+    // Przetwarzamy dodatkowe argumenty: -R, -W, -U, -H, -S, -P, -n, -j, -I, -D, -M, -L, -B, -O, -A, -N, -C, czas i próg mmap
+    if (parse_options(argv + 3, argc - 3, 0) == -1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
     }
+    if (nice_mode) set_io_priority(); // Dziedziczą go proces demona i wszystkie wątki
 
-    // Jeśli nie podano czasu, ustawiamy domyślny (300 sekund)
-    if(!sleep_time) sleep_time = 300;
+    // Test wydajności wykonujemy na pierwszym planie i kończymy program
+    if (bench) return run_bench(argv[2]);
+
+    // Wczytujemy pary katalogów (z pliku albo jedną parę z wiersza poleceń)
+    pair_store(&pair_defaults); // Domyślne ustawienia par przy przeładowaniu konfiguracji
+    if (config) config_path = argv[2];
+    if ((config ? load_config(argv[2]) : pair_add(argv[1], argv[2])) == -1)
+        return EXIT_FAILURE;
+
+    // Próba na sucho: wypisujemy plany na standardowe wyjście i kończymy bez demonizacji
+    if (dry_run) return plan_report(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
     // Uruchamiamy proces demonizujący (program działa w tle)
-    daemonize(argv[1], argv[2]);
+    daemonize();
 
     closelog(); // Zamykamy sysloga (kończymy logowanie)
 }
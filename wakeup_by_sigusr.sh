@@ -1 +1,10 @@
-kill -SIGUSR1 `pgrep syncdir-deamon`
\ No newline at end of file
+#!/bin/sh
+# Bez argumentów: SIGUSR1 - zrzut metryk do sysloga i pełna synchronizacja wszystkich par
+# Z argumentami: gniazdo sterujące demona (-C) i opcjonalnie plik lub katalog do natychmiastowej
+# synchronizacji (odpowiedź OK przychodzi po jej zakończeniu), np.:
+#   ./wakeup_by_sigusr.sh /run/syncdir.ctl /data/www/index.html
+if [ $# -eq 0 ]; then
+    kill -SIGUSR1 `pgrep syncdir-deamon`
+else
+    printf 'sync %s\n' "$2" | socat - UNIX-CONNECT:"$1"
+fi